@@ -0,0 +1,183 @@
+/*
+ * bufpool.c
+ *
+ * Copyright (C) 2026 usbmuxd contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <libimobiledevice-glue/thread.h>
+
+#include "bufpool.h"
+#include "log.h"
+
+// size classes grow by a factor of 4, starting here
+#define BUFPOOL_MIN_SIZE 4096
+// free memory kept per class; a class always keeps at least one buffer
+#define BUFPOOL_CACHE_BYTES (1024 * 1024)
+
+struct bufpool_entry {
+	struct bufpool_entry *next;
+};
+
+struct bufpool_class {
+	mutex_t mutex;
+	struct bufpool_entry *free_list;
+	uint32_t max_cached;
+	struct bufpool_stats stats;
+};
+
+static struct bufpool_class classes[BUFPOOL_CLASSES];
+
+static int bufpool_class_index(uint32_t size)
+{
+	uint32_t class_size = BUFPOOL_MIN_SIZE;
+	int i;
+	for (i = 0; i < BUFPOOL_CLASSES; i++) {
+		if (size <= class_size)
+			return i;
+		class_size *= 4;
+	}
+	return -1;
+}
+
+void bufpool_init(void)
+{
+	uint32_t size = BUFPOOL_MIN_SIZE;
+	int i;
+	for (i = 0; i < BUFPOOL_CLASSES; i++) {
+		mutex_init(&classes[i].mutex);
+		classes[i].free_list = NULL;
+		classes[i].max_cached = (size < BUFPOOL_CACHE_BYTES) ? BUFPOOL_CACHE_BYTES / size : 1;
+		memset(&classes[i].stats, 0, sizeof(classes[i].stats));
+		classes[i].stats.size = size;
+		size *= 4;
+	}
+}
+
+void bufpool_shutdown(void)
+{
+	int i;
+	for (i = 0; i < BUFPOOL_CLASSES; i++) {
+		struct bufpool_entry *entry = classes[i].free_list;
+		while (entry) {
+			struct bufpool_entry *next = entry->next;
+			free(entry);
+			entry = next;
+		}
+		classes[i].free_list = NULL;
+		classes[i].stats.cached = 0;
+		mutex_destroy(&classes[i].mutex);
+	}
+}
+
+/**
+ * Get a buffer of at least the given size.
+ *
+ * @param size The size needed. Updated to the size of the returned
+ *     buffer, which must be passed to bufpool_free().
+ * @return The buffer, or NULL if out of memory.
+ */
+void *bufpool_alloc(uint32_t *size)
+{
+	struct bufpool_class *class;
+	void *buf = NULL;
+	int index = bufpool_class_index(*size);
+
+	if (index < 0) {
+		// larger than any class, not pooled
+		return malloc(*size);
+	}
+	class = &classes[index];
+	*size = class->stats.size;
+
+	mutex_lock(&class->mutex);
+	if (class->free_list) {
+		buf = class->free_list;
+		class->free_list = class->free_list->next;
+		class->stats.cached--;
+		class->stats.reuses++;
+	}
+	class->stats.in_use++;
+	if (class->stats.in_use > class->stats.in_use_peak)
+		class->stats.in_use_peak = class->stats.in_use;
+	class->stats.allocs++;
+	mutex_unlock(&class->mutex);
+
+	if (!buf) {
+		buf = malloc(*size);
+		if (!buf) {
+			usbmuxd_log(LL_FATAL, "%s: Failed to allocate %u bytes.", __func__, *size);
+			mutex_lock(&class->mutex);
+			class->stats.in_use--;
+			class->stats.allocs--;
+			mutex_unlock(&class->mutex);
+		}
+	}
+	return buf;
+}
+
+/**
+ * Return a buffer obtained from bufpool_alloc().
+ *
+ * @param buf The buffer, may be NULL.
+ * @param size The size bufpool_alloc() returned for it.
+ */
+void bufpool_free(void *buf, uint32_t size)
+{
+	struct bufpool_class *class;
+	int index;
+
+	if (!buf)
+		return;
+	index = bufpool_class_index(size);
+	if (index < 0 || classes[index].stats.size != size) {
+		free(buf);
+		return;
+	}
+	class = &classes[index];
+
+	mutex_lock(&class->mutex);
+	class->stats.in_use--;
+	if (class->stats.cached < class->max_cached) {
+		struct bufpool_entry *entry = buf;
+		entry->next = class->free_list;
+		class->free_list = entry;
+		class->stats.cached++;
+		buf = NULL;
+	}
+	mutex_unlock(&class->mutex);
+	free(buf);
+}
+
+/**
+ * @return The number of size classes stored in stats.
+ */
+int bufpool_get_stats(struct bufpool_stats *stats, int max)
+{
+	int i;
+	for (i = 0; i < BUFPOOL_CLASSES && i < max; i++) {
+		mutex_lock(&classes[i].mutex);
+		stats[i] = classes[i].stats;
+		mutex_unlock(&classes[i].mutex);
+	}
+	return i;
+}
@@ -0,0 +1,48 @@
+/*
+ * bufpool.h
+ *
+ * Copyright (C) 2026 usbmuxd contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include <stdint.h>
+
+/*
+ * Pool of client and connection buffers in a few size classes. Freed
+ * buffers are kept for reuse up to a limit per class. All functions may
+ * be called from any thread.
+ */
+
+#define BUFPOOL_CLASSES 6
+
+struct bufpool_stats {
+	uint32_t size; // buffer size of the class
+	uint32_t in_use; // buffers handed out
+	uint32_t in_use_peak; // highest number of buffers handed out
+	uint32_t cached; // free buffers kept for reuse
+	uint64_t allocs; // buffers handed out in total
+	uint64_t reuses; // of which came from the cache
+};
+
+void bufpool_init(void);
+void bufpool_shutdown(void);
+void *bufpool_alloc(uint32_t *size);
+void bufpool_free(void *buf, uint32_t size);
+int bufpool_get_stats(struct bufpool_stats *stats, int max);
+
+#endif
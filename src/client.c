@@ -31,6 +31,7 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <sys/un.h>
@@ -46,9 +47,14 @@
 #include "client.h"
 #include "device.h"
 #include "conf.h"
+#include "evloop.h"
+#include "worker.h"
+#include "timer.h"
+#include "bufpool.h"
 
+// command buffers start small and grow up to CMD_BUF_SIZE for long commands
+#define CMD_BUF_MIN	0x1000
 #define CMD_BUF_SIZE	0x10000
-#define REPLY_BUF_SIZE	0x10000
 
 enum client_state {
 	CLIENT_COMMAND,		// waiting for command
@@ -56,30 +62,96 @@ enum client_state {
 	CLIENT_CONNECTING1,	// issued connection request
 	CLIENT_CONNECTING2,	// connection established, but waiting for response message to get sent
 	CLIENT_CONNECTED,	// connected
+	CLIENT_LINGER,		// connection gone, sending the data still buffered for the client
 	CLIENT_DEAD
 };
 
 struct mux_client {
 	int fd;
-	unsigned char *ob_buf;
-	uint32_t ob_size;
-	uint32_t ob_capacity;
+	struct ringbuf ob;
 	unsigned char *ib_buf;
 	uint32_t ib_size;
 	uint32_t ib_capacity;
 	short events, devents;
 	uint32_t connect_tag;
 	int connect_device;
+	uint16_t connect_port;
+	struct evloop *loop;
+	struct worker *handoff;
+	struct mux_connection *connection;
 	enum client_state state;
 	uint32_t proto_version;
 	uint32_t number;
 	plist_t info;
+	struct timer linger_timer;
+	struct timer_queue *linger_timers;
 };
 
 static struct collection client_list;
 mutex_t client_list_mutex;
 static uint32_t client_number = 0;
 
+/*
+ * Device notifications for listening clients. Devices are announced from
+ * the preflight thread and go away on the thread that handles them, but
+ * the output buffers of listening clients belong to the main thread and
+ * may be returned to the buffer pool there at any time. The notifications
+ * are therefore queued and sent from the main loop by
+ * client_process_notifications().
+ */
+enum client_notification_type {
+	NOTIFY_DEVICE_ADD,
+	NOTIFY_DEVICE_REMOVE
+};
+
+struct client_notification {
+	enum client_notification_type type;
+	int device_id;
+	struct device_info dev; // NOTIFY_DEVICE_ADD only, with its own copy of the serial
+	struct client_notification *next;
+};
+
+static mutex_t notify_mutex;
+static struct client_notification *notify_head = NULL;
+static struct client_notification *notify_tail = NULL;
+
+static void client_release_input(struct mux_client *client)
+{
+	bufpool_free(client->ib_buf, client->ib_capacity);
+	client->ib_buf = NULL;
+	client->ib_capacity = 0;
+}
+
+// make room for a command of the given size in the input buffer
+static int client_reserve_input(struct mux_client *client, uint32_t size)
+{
+	unsigned char *buf;
+	if(size <= client->ib_capacity)
+		return 0;
+	buf = bufpool_alloc(&size);
+	if(!buf)
+		return -1;
+	if(client->ib_size)
+		memcpy(buf, client->ib_buf, client->ib_size);
+	bufpool_free(client->ib_buf, client->ib_capacity);
+	client->ib_buf = buf;
+	client->ib_capacity = size;
+	return 0;
+}
+
+/**
+ * Update the poll event mask of the client and propagate it
+ * to the event loop if it changed.
+ */
+static void client_set_poll_events(struct mux_client *client, short events)
+{
+	if(client->events == events)
+		return;
+	client->events = events;
+	if(client->loop)
+		evloop_modify(client->loop, client->fd, events);
+}
+
 #ifdef SO_PEERCRED
 static char* _get_process_name_by_pid(const int pid)
 {
@@ -116,6 +188,8 @@ int client_read(struct mux_client *client, void *buffer, uint32_t len)
 		usbmuxd_log(LL_ERROR, "Attempted to read from client %d not in CONNECTED state", client->fd);
 		return -1;
 	}
+	if(client->loop)
+		return evloop_recv(client->loop, client->fd, buffer, len);
 	return recv(client->fd, buffer, len, 0);
 }
 
@@ -137,7 +211,10 @@ int client_write(struct mux_client *client, void *buffer, uint32_t len)
 		return -1;
 	}
 
-	sret = send(client->fd, buffer, len, 0);
+	if(client->loop)
+		sret = evloop_send(client->loop, client->fd, buffer, len);
+	else
+		sret = send(client->fd, buffer, len, 0);
 	if (sret < 0) {
 		if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
 			usbmuxd_log(LL_DEBUG, "client_write: fd %d not ready for writing", client->fd);
@@ -149,6 +226,65 @@ int client_write(struct mux_client *client, void *buffer, uint32_t len)
 	return sret;
 }
 
+/**
+ * Send several buffers of raw data to the client socket at once.
+ *
+ * @param client Client to send to.
+ * @param iov The buffers to send.
+ * @param iovcnt Number of buffers.
+ * @return Same as client_write().
+ */
+int client_writev(struct mux_client *client, const struct iovec *iov, int iovcnt)
+{
+	int sret = -1;
+
+	usbmuxd_log(LL_SPEW, "client_writev fd %d iovcnt %d", client->fd, iovcnt);
+	if(client->state != CLIENT_CONNECTED) {
+		usbmuxd_log(LL_ERROR, "Attempted to write to client %d not in CONNECTED state", client->fd);
+		return -1;
+	}
+
+	if(client->loop)
+		sret = evloop_sendv(client->loop, client->fd, iov, iovcnt);
+	else
+		sret = writev(client->fd, iov, iovcnt);
+	if (sret < 0) {
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+			usbmuxd_log(LL_DEBUG, "client_writev: fd %d not ready for writing", client->fd);
+			sret = 0;
+		} else {
+			usbmuxd_log(LL_ERROR, "ERROR: client_writev: sending to fd %d failed: %s", client->fd, strerror(errno));
+		}
+	}
+	return sret;
+}
+
+/**
+ * Check whether raw data may be written to the client, that is, the
+ * result of its connect request has been sent completely.
+ *
+ * @param client The client to check.
+ * @return 1 if the client is in CONNECTED state, 0 otherwise.
+ */
+int client_is_connected(struct mux_client *client)
+{
+	return client->state == CLIENT_CONNECTED;
+}
+
+/**
+ * Get the amount of data written to the client that still sits in the
+ * event loop's send queue of the client socket.
+ *
+ * @param client The client to check.
+ * @return Number of queued bytes.
+ */
+uint32_t client_get_queued(struct mux_client *client)
+{
+	if(!client->loop)
+		return 0;
+	return evloop_get_queued(client->loop, client->fd);
+}
+
 /**
  * Set event mask to use for ppoll()ing the client socket.
  * Typically POLLOUT and/or POLLIN. Note that this overrides
@@ -167,10 +303,59 @@ int client_set_events(struct mux_client *client, short events)
 	}
 	client->devents = events;
 	if(client->state == CLIENT_CONNECTED)
-		client->events = events;
+		client_set_poll_events(client, events);
 	return 0;
 }
 
+static void client_linger_timeout(struct timer *timer, void *data)
+{
+	struct mux_client *client = data;
+	usbmuxd_log(LL_ERROR, "Client %d: aborting buffer flush after %u bytes could not be sent in time", client->fd, client->ob.size);
+	client_close(client);
+}
+
+/**
+ * Close a client whose device connection is gone once the data still
+ * buffered for it has been sent. Sending continues from the event loop,
+ * and the client is closed when the deadline passes.
+ *
+ * @param client The connected client.
+ * @param data The data to send. The ring buffer is taken over and
+ *   emptied.
+ * @param timers Timer queue of the thread serving the client.
+ * @param timeout Milliseconds to wait for the data to be sent.
+ */
+void client_linger(struct mux_client *client, struct ringbuf *data, struct timer_queue *timers, int timeout)
+{
+	usbmuxd_log(LL_DEBUG, "Client %d: flushing %u buffered bytes before closing", client->fd, data->size);
+	ringbuf_free(&client->ob);
+	client->ob = *data;
+	memset(data, 0, sizeof(*data));
+	client->state = CLIENT_LINGER;
+	client->linger_timers = timers;
+	timer_arm(timers, &client->linger_timer, mstime64() + timeout);
+	client_set_poll_events(client, POLLOUT);
+}
+
+static void linger_process(struct mux_client *client)
+{
+	struct iovec iov[2];
+	int n = ringbuf_get_iov(&client->ob, iov);
+	ssize_t res = 0;
+	if(n)
+		res = client->loop ? evloop_sendv(client->loop, client->fd, iov, n) : writev(client->fd, iov, n);
+	if(res < 0) {
+		if(errno == EAGAIN || errno == EWOULDBLOCK)
+			return;
+		usbmuxd_log(LL_ERROR, "Client %d: aborting buffer flush after error: %s", client->fd, strerror(errno));
+		client_close(client);
+		return;
+	}
+	ringbuf_consume(&client->ob, res);
+	if(!client->ob.size)
+		client_close(client);
+}
+
 /**
  * Wait for an inbound connection on the usbmuxd socket
  * and create a new mux_client instance for it, and store
@@ -214,23 +399,29 @@ int client_accept(int listenfd)
 	struct mux_client *client;
 	client = malloc(sizeof(struct mux_client));
 	memset(client, 0, sizeof(struct mux_client));
+	timer_init(&client->linger_timer, client_linger_timeout, client);
 
 	client->fd = cfd;
-	client->ob_buf = malloc(REPLY_BUF_SIZE);
-	client->ob_size = 0;
-	client->ob_capacity = REPLY_BUF_SIZE;
-	client->ib_buf = malloc(CMD_BUF_SIZE);
+	// buffers are taken from the pool when there is something to hold
+	client->ib_buf = NULL;
 	client->ib_size = 0;
-	client->ib_capacity = CMD_BUF_SIZE;
+	client->ib_capacity = 0;
 	client->state = CLIENT_COMMAND;
 	client->events = POLLIN;
 	client->info = NULL;
+	client->loop = main_evloop;
 
 	mutex_lock(&client_list_mutex);
 	client->number = client_number++;
 	collection_add(&client_list, client);
 	mutex_unlock(&client_list_mutex);
 
+	if(evloop_add(client->loop, client->fd, FD_CLIENT, client->events, client) < 0) {
+		usbmuxd_log(LL_ERROR, "Could not add client %d to event loop", client->fd);
+		client_close(client);
+		return -1;
+	}
+
 #ifdef SO_PEERCRED
 	if (log_level >= LL_INFO) {
 		struct ucred cr;
@@ -287,11 +478,15 @@ void client_close(struct mux_client *client)
 	if(client->state == CLIENT_CONNECTING1 || client->state == CLIENT_CONNECTING2) {
 		usbmuxd_log(LL_INFO, "Client died mid-connect, aborting device %d connection", client->connect_device);
 		client->state = CLIENT_DEAD;
-		device_abort_connect(client->connect_device, client);
+		device_abort_connect(client->connection);
 	}
+	if(client->linger_timers)
+		timer_disarm(client->linger_timers, &client->linger_timer);
+	if(client->loop)
+		evloop_remove(client->loop, client->fd);
 	close(client->fd);
-	free(client->ob_buf);
-	free(client->ib_buf);
+	ringbuf_free(&client->ob);
+	client_release_input(client);
 	plist_free(client->info);
 
 	collection_remove(&client_list, client);
@@ -299,15 +494,6 @@ void client_close(struct mux_client *client)
 	free(client);
 }
 
-void client_get_fds(struct fdlist *list)
-{
-	mutex_lock(&client_list_mutex);
-	FOREACH(struct mux_client *client, &client_list) {
-		fdlist_add(list, FD_CLIENT, client->fd, client->events);
-	} ENDFOREACH
-	mutex_unlock(&client_list_mutex);
-}
-
 static int output_buffer_add_message(struct mux_client *client, uint32_t tag, enum usbmuxd_msgtype msg, void *payload, int payload_length)
 {
 	struct usbmuxd_header hdr;
@@ -317,25 +503,18 @@ static int output_buffer_add_message(struct mux_client *client, uint32_t tag, en
 	hdr.tag = tag;
 	usbmuxd_log(LL_DEBUG, "Client %d output buffer got tag %d msg %d payload_length %d", client->fd, tag, msg, payload_length);
 
-	uint32_t available = client->ob_capacity - client->ob_size;
 	/* the output buffer _should_ be large enough, but just in case */
-	if(available < hdr.length) {
-		unsigned char* new_buf;
-		uint32_t new_size = ((client->ob_capacity + hdr.length + 4096) / 4096) * 4096;
-		usbmuxd_log(LL_DEBUG, "%s: Enlarging client %d output buffer %d -> %d", __func__, client->fd, client->ob_capacity, new_size);
-		new_buf = realloc(client->ob_buf, new_size);
-		if (!new_buf) {
+	if(client->ob.capacity - client->ob.size < hdr.length) {
+		usbmuxd_log(LL_DEBUG, "%s: Enlarging client %d output buffer %d -> %d", __func__, client->fd, client->ob.capacity, client->ob.size + hdr.length);
+		if(ringbuf_reserve(&client->ob, client->ob.size + hdr.length) < 0) {
 			usbmuxd_log(LL_FATAL, "%s: Failed to realloc.", __func__);
 			return -1;
 		}
-		client->ob_buf = new_buf;
-		client->ob_capacity = new_size;
 	}
-	memcpy(client->ob_buf + client->ob_size, &hdr, sizeof(hdr));
+	ringbuf_append(&client->ob, &hdr, sizeof(hdr));
 	if(payload && payload_length)
-		memcpy(client->ob_buf + client->ob_size + sizeof(hdr), payload, payload_length);
-	client->ob_size += hdr.length;
-	client->events |= POLLOUT;
+		ringbuf_append(&client->ob, payload, payload_length);
+	client_set_poll_events(client, client->events | POLLOUT);
 	return hdr.length;
 }
 
@@ -371,6 +550,119 @@ static int send_result(struct mux_client *client, uint32_t tag, uint32_t result)
 	return res;
 }
 
+/**
+ * Move a client that went back to COMMAND state from a worker thread
+ * to the main event loop.
+ *
+ * @param client The client to move.
+ */
+static void client_return_to_main(struct mux_client *client)
+{
+	if(client->loop == main_evloop)
+		return;
+	if(client->loop)
+		evloop_remove(client->loop, client->fd);
+	client->loop = main_evloop;
+	if(evloop_add(client->loop, client->fd, FD_CLIENT, client->events, client) < 0) {
+		usbmuxd_log(LL_ERROR, "Could not return client %d to the main event loop", client->fd);
+		client->loop = NULL;
+		client_close(client);
+	}
+}
+
+/**
+ * Worker job that adopts a client handed off by the main thread and
+ * starts its pending device connection.
+ */
+static void client_connect_job(void *data)
+{
+	struct mux_client *client = data;
+	struct worker *worker = client->handoff;
+	int res;
+
+	client->handoff = NULL;
+	client->loop = worker_get_evloop(worker);
+	if(evloop_add(client->loop, client->fd, FD_CLIENT, client->events, client) < 0) {
+		usbmuxd_log(LL_ERROR, "Could not add client %d to worker event loop", client->fd);
+		client->loop = NULL;
+		client->state = CLIENT_COMMAND;
+		client_close(client);
+		return;
+	}
+	res = device_start_connect(client->connect_device, client->connect_port, client);
+	if(res < 0) {
+		client->state = CLIENT_COMMAND;
+		if(send_result(client, client->connect_tag, -res) < 0) {
+			client_close(client);
+			return;
+		}
+		client_return_to_main(client);
+	}
+}
+
+/**
+ * Pass a client with a pending connect request on to the worker thread
+ * that owns the target device. Must be called after the command that
+ * requested the connection has been fully processed.
+ *
+ * @param client The client to hand off.
+ */
+static void client_handoff(struct mux_client *client)
+{
+	evloop_remove(client->loop, client->fd);
+	client->loop = NULL;
+	if(worker_post(client->handoff, client_connect_job, client) < 0) {
+		usbmuxd_log(LL_ERROR, "Could not hand off client %d to worker thread", client->fd);
+		client->handoff = NULL;
+		client->state = CLIENT_COMMAND;
+		client_close(client);
+	}
+}
+
+/**
+ * Start connecting a client to the given device port. When the device
+ * is served by a worker thread, the client is marked for handoff and the
+ * connection is started from that worker instead.
+ *
+ * @return 0 on success, -1 if the result could not be sent to the client.
+ */
+static int start_connect(struct mux_client *client, uint32_t tag, int device_id, uint16_t port)
+{
+	struct worker *worker = device_get_worker(device_id);
+	int res;
+
+	client->connect_tag = tag;
+	client->connect_device = device_id;
+	client->connect_port = port;
+
+	if(worker && worker != worker_get_current()) {
+		client->state = CLIENT_CONNECTING1;
+		client->handoff = worker;
+		return 0;
+	}
+
+	res = device_start_connect(device_id, port, client);
+	if(res < 0) {
+		if(send_result(client, tag, -res) < 0)
+			return -1;
+	} else {
+		client->state = CLIENT_CONNECTING1;
+	}
+	return 0;
+}
+
+/**
+ * Associate the client with its device connection, so events on the
+ * client socket can be dispatched without looking the connection up.
+ *
+ * @param client The client to update.
+ * @param conn The connection, or NULL when the connection goes away.
+ */
+void client_set_connection(struct mux_client *client, struct mux_connection *conn)
+{
+	client->connection = conn;
+}
+
 int client_notify_connect(struct mux_client *client, enum usbmuxd_result result)
 {
 	usbmuxd_log(LL_SPEW, "client_notify_connect fd %d result %d", client->fd, result);
@@ -384,12 +676,12 @@ int client_notify_connect(struct mux_client *client, enum usbmuxd_result result)
 		return -1;
 	if(result == RESULT_OK) {
 		client->state = CLIENT_CONNECTING2;
-		client->events = POLLOUT; // wait for the result packet to go through
+		client_set_poll_events(client, POLLOUT); // wait for the result packet to go through
 		// no longer need this
-		free(client->ib_buf);
-		client->ib_buf = NULL;
+		client_release_input(client);
 	} else {
 		client->state = CLIENT_COMMAND;
+		client_return_to_main(client);
 	}
 	return 0;
 }
@@ -437,6 +729,75 @@ static int send_device_list(struct mux_client *client, uint32_t tag)
 	return res;
 }
 
+static const char *init_stage_keys[USB_INIT_STAGES] = {
+	"Found", "Mode", "Configured", "Serial", "Started", "Connected", "Visible"
+};
+
+static int send_stats(struct mux_client *client, uint32_t tag)
+{
+	int res = -1;
+	plist_t dict = plist_new_dict();
+	plist_t devices = plist_new_array();
+
+	struct device_info *devs = NULL;
+	struct device_info *dev;
+	int i, j;
+
+	int count = device_get_list(1, &devs);
+	dev = devs;
+	for (i = 0; devs && i < count; i++, dev++) {
+		plist_t stats = plist_new_dict();
+		plist_dict_set_item(stats, "DeviceID", plist_new_uint(dev->id));
+		plist_dict_set_item(stats, "RXQueueDepth", plist_new_uint(dev->usb_stats.rx_depth));
+		plist_dict_set_item(stats, "RXQueueDepthPeak", plist_new_uint(dev->usb_stats.rx_depth_peak));
+		plist_dict_set_item(stats, "RXTransfers", plist_new_uint(dev->usb_stats.rx_transfers));
+		plist_dict_set_item(stats, "RXFullTransfers", plist_new_uint(dev->usb_stats.rx_full_transfers));
+		plist_dict_set_item(stats, "RXTransferSize", plist_new_uint(dev->usb_stats.rx_transfer_size));
+		plist_dict_set_item(stats, "DMABuffers", plist_new_uint(dev->usb_stats.dma_buffers));
+		plist_dict_set_item(stats, "HeapBuffers", plist_new_uint(dev->usb_stats.heap_buffers));
+		plist_dict_set_item(stats, "BufferMemory", plist_new_uint(dev->buffer_memory));
+		plist_t init = plist_new_dict();
+		for (j = USB_INIT_FOUND + 1; j < USB_INIT_STAGES; j++) {
+			if (dev->usb_stats.init_ms[j] >= 0)
+				plist_dict_set_item(init, init_stage_keys[j], plist_new_uint(dev->usb_stats.init_ms[j]));
+		}
+		plist_dict_set_item(stats, "InitTimes", init);
+		plist_array_append_item(devices, stats);
+	}
+	if (devs)
+		free(devs);
+
+	plist_dict_set_item(dict, "DeviceStats", devices);
+
+	struct buffer_budget_stats budget_stats;
+	plist_t budget = plist_new_dict();
+	device_get_budget_stats(&budget_stats);
+	plist_dict_set_item(budget, "Used", plist_new_uint(budget_stats.used));
+	plist_dict_set_item(budget, "Budget", plist_new_uint(budget_stats.budget));
+	plist_dict_set_item(budget, "DeviceBudget", plist_new_uint(budget_stats.device_budget));
+	plist_dict_set_item(budget, "RefusedConnections", plist_new_uint(budget_stats.refused));
+	plist_dict_set_item(dict, "BufferBudget", budget);
+
+	struct bufpool_stats pool_stats[BUFPOOL_CLASSES];
+	plist_t pools = plist_new_array();
+	count = bufpool_get_stats(pool_stats, BUFPOOL_CLASSES);
+	for (i = 0; i < count; i++) {
+		plist_t pool = plist_new_dict();
+		plist_dict_set_item(pool, "Size", plist_new_uint(pool_stats[i].size));
+		plist_dict_set_item(pool, "InUse", plist_new_uint(pool_stats[i].in_use));
+		plist_dict_set_item(pool, "InUsePeak", plist_new_uint(pool_stats[i].in_use_peak));
+		plist_dict_set_item(pool, "Cached", plist_new_uint(pool_stats[i].cached));
+		plist_dict_set_item(pool, "Allocations", plist_new_uint(pool_stats[i].allocs));
+		plist_dict_set_item(pool, "Reuses", plist_new_uint(pool_stats[i].reuses));
+		plist_array_append_item(pools, pool);
+	}
+	plist_dict_set_item(dict, "BufferPools", pools);
+
+	res = send_plist(client, tag, dict);
+	plist_free(dict);
+	return res;
+}
+
 static int send_listener_list(struct mux_client *client, uint32_t tag)
 {
 	int res = -1;
@@ -726,22 +1087,19 @@ static int handle_command(struct mux_client *client, struct usbmuxd_header *hdr)
 					plist_free(dict);
 
 					usbmuxd_log(LL_DEBUG, "Client %d requesting connection to device %d port %d", client->fd, device_id, ntohs(portnum));
-					res = device_start_connect(device_id, ntohs(portnum), client);
-					if(res < 0) {
-						if (send_result(client, hdr->tag, -res) < 0)
-							return -1;
-					} else {
-						client->connect_tag = hdr->tag;
-						client->connect_device = device_id;
-						client->state = CLIENT_CONNECTING1;
-					}
-					return 0;
+					return start_connect(client, hdr->tag, device_id, ntohs(portnum));
 				} else if (!strcmp(message, "ListDevices")) {
 					free(message);
 					plist_free(dict);
 					if (send_device_list(client, hdr->tag) < 0)
 						return -1;
 					return 0;
+				} else if (!strcmp(message, "ReadStats")) {
+					free(message);
+					plist_free(dict);
+					if (send_stats(client, hdr->tag) < 0)
+						return -1;
+					return 0;
 				} else if (!strcmp(message, "ListListeners")) {
 					free(message);
 					plist_free(dict);
@@ -789,24 +1147,11 @@ static int handle_command(struct mux_client *client, struct usbmuxd_header *hdr)
 								dev_id = (uint32_t)u_dev_id;
 							}
 							if (dev_id > 0) {
-								struct device_info *devs = NULL;
-								struct device_info *dev;
-								int i;
-								int count = device_get_list(1, &devs);
-								int found = 0;
-								dev = devs;
-								for (i = 0; devs && i < count; i++, dev++) {
-									if ((uint32_t)dev->id == dev_id && (strcmp(dev->serial, record_id) == 0)) {
-										found++;
-										break;
-									}
-								}
-								if (!found) {
+								if (!device_has_serial(dev_id, record_id)) {
 									usbmuxd_log(LL_ERROR, "ERROR: SavePairRecord: DeviceID %d (%s) is not connected\n", dev_id, record_id);
 								} else {
 									client_device_paired(dev_id);
 								}
-								free(devs);
 							}
 						}
 						free(record_id);
@@ -854,16 +1199,7 @@ static int handle_command(struct mux_client *client, struct usbmuxd_header *hdr)
 		case MESSAGE_CONNECT:
 			ch = (void*)hdr;
 			usbmuxd_log(LL_DEBUG, "Client %d connection request to device %d port %d", client->fd, ch->device_id, ntohs(ch->port));
-			res = device_start_connect(ch->device_id, ntohs(ch->port), client);
-			if(res < 0) {
-				if(send_result(client, hdr->tag, -res) < 0)
-					return -1;
-			} else {
-				client->connect_tag = hdr->tag;
-				client->connect_device = ch->device_id;
-				client->state = CLIENT_CONNECTING1;
-			}
-			return 0;
+			return start_connect(client, hdr->tag, ch->device_id, ntohs(ch->port));
 		default:
 			usbmuxd_log(LL_ERROR, "Client %d invalid command %d", client->fd, hdr->message);
 			if(send_result(client, hdr->tag, RESULT_BADCOMMAND) < 0)
@@ -875,38 +1211,42 @@ static int handle_command(struct mux_client *client, struct usbmuxd_header *hdr)
 
 static void output_buffer_process(struct mux_client *client)
 {
-	int res;
-	if(!client->ob_size) {
+	struct iovec iov[2];
+	int res, n;
+	if(!client->ob.size) {
 		usbmuxd_log(LL_WARNING, "Client %d OUT process but nothing to send?", client->fd);
-		client->events &= ~POLLOUT;
+		client_set_poll_events(client, client->events & ~POLLOUT);
 		return;
 	}
-	res = send(client->fd, client->ob_buf, client->ob_size, 0);
+	n = ringbuf_get_iov(&client->ob, iov);
+	res = writev(client->fd, iov, n);
 	if(res <= 0) {
 		usbmuxd_log(LL_ERROR, "Sending to client fd %d failed: %d %s", client->fd, res, strerror(errno));
 		client_close(client);
 		return;
 	}
-	if((uint32_t)res == client->ob_size) {
-		client->ob_size = 0;
-		client->events &= ~POLLOUT;
+	ringbuf_consume(&client->ob, res);
+	if(!client->ob.size) {
+		// give the buffer back to the pool until the next reply
+		ringbuf_free(&client->ob);
+		client_set_poll_events(client, client->events & ~POLLOUT);
 		if(client->state == CLIENT_CONNECTING2) {
 			usbmuxd_log(LL_DEBUG, "Client %d switching to CONNECTED state", client->fd);
 			client->state = CLIENT_CONNECTED;
-			client->events = client->devents;
-			// no longer need this
-			free(client->ob_buf);
-			client->ob_buf = NULL;
+			// the command protocol is done, use io_uring for the data if enabled
+			evloop_attach_uring(client->loop, client->fd);
+			client_set_poll_events(client, client->devents);
 		}
-	} else {
-		client->ob_size -= res;
-		memmove(client->ob_buf, client->ob_buf + res, client->ob_size);
 	}
 }
 static void input_buffer_process(struct mux_client *client)
 {
 	int res;
 	int did_read = 0;
+	if(client_reserve_input(client, CMD_BUF_MIN) < 0) {
+		client_close(client);
+		return;
+	}
 	if(client->ib_size < sizeof(struct usbmuxd_header)) {
 		res = recv(client->fd, client->ib_buf + client->ib_size, sizeof(struct usbmuxd_header) - client->ib_size, 0);
 		if(res <= 0) {
@@ -923,7 +1263,7 @@ static void input_buffer_process(struct mux_client *client)
 		did_read = 1;
 	}
 	struct usbmuxd_header *hdr = (void*)client->ib_buf;
-	if(hdr->length > client->ib_capacity) {
+	if(hdr->length > CMD_BUF_SIZE) {
 		usbmuxd_log(LL_INFO, "Client %d message is too long (%d bytes)", client->fd, hdr->length);
 		client_close(client);
 		return;
@@ -936,6 +1276,11 @@ static void input_buffer_process(struct mux_client *client)
 	if(client->ib_size < hdr->length) {
 		if(did_read)
 			return; //maybe we would block, so defer to next loop
+		if(client_reserve_input(client, hdr->length) < 0) {
+			client_close(client);
+			return;
+		}
+		hdr = (void*)client->ib_buf;
 		res = recv(client->fd, client->ib_buf + client->ib_size, hdr->length - client->ib_size, 0);
 		if(res < 0) {
 			usbmuxd_log(LL_ERROR, "Receive from client fd %d failed: %s", client->fd, strerror(errno));
@@ -950,30 +1295,24 @@ static void input_buffer_process(struct mux_client *client)
 		if(client->ib_size < hdr->length)
 			return;
 	}
-	handle_command(client, hdr);
+	// reset before handling, the command may close the client
 	client->ib_size = 0;
+	if(handle_command(client, hdr) == 0) {
+		// most clients send a command or two, don't keep a buffer around
+		client_release_input(client);
+		if(client->handoff)
+			client_handoff(client);
+	}
 }
 
-void client_process(int fd, short events)
+void client_process(struct mux_client *client, short events)
 {
-	struct mux_client *client = NULL;
-	mutex_lock(&client_list_mutex);
-	FOREACH(struct mux_client *lc, &client_list) {
-		if(lc->fd == fd) {
-			client = lc;
-			break;
-		}
-	} ENDFOREACH
-	mutex_unlock(&client_list_mutex);
-
-	if(!client) {
-		usbmuxd_log(LL_INFO, "client_process: fd %d not found in client list", fd);
-		return;
-	}
-
 	if(client->state == CLIENT_CONNECTED) {
 		usbmuxd_log(LL_SPEW, "client_process in CONNECTED state");
-		device_client_process(client->connect_device, client, events);
+		device_client_process(client->connection, events);
+	} else if(client->state == CLIENT_LINGER) {
+		if(events & (POLLOUT | POLLERR | POLLHUP))
+			linger_process(client);
 	} else {
 		if(events & POLLIN) {
 			input_buffer_process(client);
@@ -984,7 +1323,7 @@ void client_process(int fd, short events)
 
 }
 
-void client_device_add(struct device_info *dev)
+static void notify_device_add(struct device_info *dev)
 {
 	mutex_lock(&client_list_mutex);
 	usbmuxd_log(LL_DEBUG, "client_device_add: id %d, location 0x%x, serial %s", dev->id, dev->location, dev->serial);
@@ -996,7 +1335,7 @@ void client_device_add(struct device_info *dev)
 	mutex_unlock(&client_list_mutex);
 }
 
-void client_device_remove(int device_id)
+static void notify_device_remove(int device_id)
 {
 	mutex_lock(&client_list_mutex);
 	uint32_t id = device_id;
@@ -1008,6 +1347,83 @@ void client_device_remove(int device_id)
 	mutex_unlock(&client_list_mutex);
 }
 
+static void client_queue_notification(struct client_notification *notification)
+{
+	notification->next = NULL;
+	mutex_lock(&notify_mutex);
+	if(notify_tail)
+		notify_tail->next = notification;
+	else
+		notify_head = notification;
+	notify_tail = notification;
+	mutex_unlock(&notify_mutex);
+	evloop_wakeup(main_evloop);
+}
+
+/**
+ * Make a device visible and announce it to listening clients. May be
+ * called from any thread; the notification is sent from the main loop.
+ *
+ * @param dev The device, copied.
+ */
+void client_device_add(struct device_info *dev)
+{
+	struct client_notification *notification = malloc(sizeof(struct client_notification));
+	if(!notification) {
+		usbmuxd_log(LL_ERROR, "%s: Failed to allocate notification.", __func__);
+		return;
+	}
+	notification->type = NOTIFY_DEVICE_ADD;
+	notification->device_id = dev->id;
+	notification->dev = *dev;
+	notification->dev.serial = strdup(dev->serial ? dev->serial : "");
+	client_queue_notification(notification);
+}
+
+/**
+ * Tell listening clients that a device is gone. May be called from any
+ * thread; the notification is sent from the main loop.
+ *
+ * @param device_id The id of the removed device.
+ */
+void client_device_remove(int device_id)
+{
+	struct client_notification *notification = malloc(sizeof(struct client_notification));
+	if(!notification) {
+		usbmuxd_log(LL_ERROR, "%s: Failed to allocate notification.", __func__);
+		return;
+	}
+	notification->type = NOTIFY_DEVICE_REMOVE;
+	notification->device_id = device_id;
+	client_queue_notification(notification);
+}
+
+/**
+ * Send the device notifications queued by other threads to the listening
+ * clients. Must be called from the main loop.
+ */
+void client_process_notifications(void)
+{
+	struct client_notification *notification;
+
+	mutex_lock(&notify_mutex);
+	notification = notify_head;
+	notify_head = notify_tail = NULL;
+	mutex_unlock(&notify_mutex);
+
+	while(notification) {
+		struct client_notification *next = notification->next;
+		if(notification->type == NOTIFY_DEVICE_ADD) {
+			notify_device_add(&notification->dev);
+			free((char*)notification->dev.serial);
+		} else if(notification->type == NOTIFY_DEVICE_REMOVE) {
+			notify_device_remove(notification->device_id);
+		}
+		free(notification);
+		notification = next;
+	}
+}
+
 void client_device_paired(int device_id)
 {
 	mutex_lock(&client_list_mutex);
@@ -1025,6 +1441,34 @@ void client_init(void)
 	usbmuxd_log(LL_DEBUG, "client_init");
 	collection_init(&client_list);
 	mutex_init(&client_list_mutex);
+	mutex_init(&notify_mutex);
+}
+
+/**
+ * Detach the clients served by a worker thread from its event loop and
+ * timers, which go away with the worker. The clients stay in the client
+ * list and are closed by client_shutdown(). Must be called on the worker
+ * thread, after the last job that could hand a client to it.
+ *
+ * @param worker The worker that is about to exit.
+ */
+void client_detach_worker(struct worker *worker)
+{
+	struct evloop *loop = worker_get_evloop(worker);
+	struct timer_queue *timers = worker_get_timers(worker);
+
+	mutex_lock(&client_list_mutex);
+	FOREACH(struct mux_client *client, &client_list) {
+		if(client->linger_timers == timers) {
+			timer_disarm(client->linger_timers, &client->linger_timer);
+			client->linger_timers = NULL;
+		}
+		if(client->loop == loop) {
+			evloop_remove(client->loop, client->fd);
+			client->loop = NULL;
+		}
+	} ENDFOREACH
+	mutex_unlock(&client_list_mutex);
 }
 
 void client_shutdown(void)
@@ -1034,5 +1478,14 @@ void client_shutdown(void)
 		client_close(client);
 	} ENDFOREACH
 	mutex_destroy(&client_list_mutex);
+	while(notify_head) {
+		struct client_notification *next = notify_head->next;
+		if(notify_head->type == NOTIFY_DEVICE_ADD)
+			free((char*)notify_head->dev.serial);
+		free(notify_head);
+		notify_head = next;
+	}
+	notify_tail = NULL;
+	mutex_destroy(&notify_mutex);
 	collection_free(&client_list);
 }
@@ -22,26 +22,37 @@
 #define CLIENT_H
 
 #include <stdint.h>
+#include <sys/uio.h>
 #include "usbmuxd-proto.h"
 
 struct device_info;
+struct ringbuf;
+struct timer_queue;
+struct worker;
 struct mux_client;
+struct mux_connection;
 
 int client_read(struct mux_client *client, void *buffer, uint32_t len);
 int client_write(struct mux_client *client, void *buffer, uint32_t len);
+int client_writev(struct mux_client *client, const struct iovec *iov, int iovcnt);
+int client_is_connected(struct mux_client *client);
+uint32_t client_get_queued(struct mux_client *client);
 int client_set_events(struct mux_client *client, short events);
 void client_close(struct mux_client *client);
+void client_linger(struct mux_client *client, struct ringbuf *data, struct timer_queue *timers, int timeout);
 int client_notify_connect(struct mux_client *client, enum usbmuxd_result result);
+void client_set_connection(struct mux_client *client, struct mux_connection *conn);
 
 void client_device_add(struct device_info *dev);
 void client_device_remove(int device_id);
 void client_device_paired(int device_id);
+void client_process_notifications(void);
 
 int client_accept(int fd);
-void client_get_fds(struct fdlist *list);
-void client_process(int fd, short events);
+void client_process(struct mux_client *client, short events);
 
 void client_init(void);
+void client_detach_worker(struct worker *worker);
 void client_shutdown(void);
 
 #endif
@@ -64,6 +64,7 @@
 #endif
 
 #define CONFIG_FILE "SystemConfiguration"CONFIG_EXT
+#define CONFIG_USB_CACHE_FILE "USBDeviceCache"CONFIG_EXT
 
 static char *__config_dir = NULL;
 
@@ -556,3 +557,59 @@ void config_device_record_get_host_id(const char *udid, char **host_id)
 		usbmuxd_log(LL_ERROR, "ERROR: Could not get HostID from pairing record for udid %s", udid);
 	}
 }
+
+/**
+ * Read the USB configuration decisions cached for known devices.
+ *
+ * @return A dictionary keyed by device model, or NULL if there is no cache yet.
+ */
+plist_t config_get_usb_device_cache(void)
+{
+	plist_t cache = NULL;
+	char *cache_file = string_concat(config_get_config_dir(), DIR_SEP_S, CONFIG_USB_CACHE_FILE, NULL);
+
+	plist_read_from_file(cache_file, &cache, NULL);
+	if (cache && plist_get_node_type(cache) != PLIST_DICT) {
+		usbmuxd_log(LL_WARNING, "Ignoring invalid USB device cache %s", cache_file);
+		plist_free(cache);
+		cache = NULL;
+	}
+	free(cache_file);
+
+	return cache;
+}
+
+/**
+ * Store the USB configuration decisions for known devices. The file is
+ * replaced atomically so a crash never leaves a truncated cache behind.
+ *
+ * @param cache The dictionary returned by config_get_usb_device_cache(),
+ *     with updated entries.
+ *
+ * @return 0 on success or a negative errno otherwise.
+ */
+int config_set_usb_device_cache(plist_t cache)
+{
+	int res = 0;
+
+	if (config_create_config_dir() < 0) {
+		usbmuxd_log(LL_ERROR, "ERROR: Failed to create config directory\n");
+		return -1;
+	}
+
+	char *cache_file = string_concat(config_get_config_dir(), DIR_SEP_S, CONFIG_USB_CACHE_FILE, NULL);
+	char *tmp_file = string_concat(cache_file, ".tmp", NULL);
+
+	if (plist_write_to_file(cache, tmp_file, PLIST_FORMAT_XML, 0) != PLIST_ERR_SUCCESS) {
+		usbmuxd_log(LL_DEBUG, "Could not open '%s' for writing: %s", tmp_file, strerror(errno));
+		res = -ENOENT;
+	} else if (rename(tmp_file, cache_file) != 0) {
+		res = -errno;
+		usbmuxd_log(LL_DEBUG, "Could not rename '%s' to '%s': %s", tmp_file, cache_file, strerror(errno));
+		remove(tmp_file);
+	}
+	free(tmp_file);
+	free(cache_file);
+
+	return res;
+}
@@ -38,4 +38,7 @@ int config_remove_device_record(const char *udid);
 
 void config_device_record_get_host_id(const char *udid, char **host_id);
 
+plist_t config_get_usb_device_cache(void);
+int config_set_usb_device_cache(plist_t cache);
+
 #endif
@@ -28,10 +28,12 @@
 #include <sys/time.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <errno.h>
 #include <unistd.h>
 
 #include <libimobiledevice-glue/collection.h>
@@ -42,15 +44,60 @@
 #include "preflight.h"
 #include "usb.h"
 #include "log.h"
+#include "timer.h"
+#include "worker.h"
 
 int next_device_id;
 
 #define DEV_MRU 65536
 
-#define CONN_INBUF_SIZE		262144
-#define CONN_OUTBUF_SIZE	65536
+// The receive window of each connection is tuned between these bounds.
+// It grows while the client keeps up and the device uses all of it, and
+// shrinks while data piles up because the client reads slowly.
+#define CONN_WIN_MIN		131072
+#define CONN_WIN_MAX		1048576
+// smallest and largest window that may be configured; the latter is the
+// most the 16 bit window field with a scale of 256 can carry
+#define CONN_WIN_FLOOR		16384
+#define CONN_WIN_LIMIT		(65535 << 8)
+
+// time a closed connection may take to hand its buffered data to the client
+#define CONN_LINGER_TIMEOUT	1000
+
+// buffer memory in KiB the connections of all devices, and of one device,
+// may use before new connections are refused
+#define BUFFER_BUDGET		262144
+#define DEVICE_BUFFER_BUDGET	65536
+// a connection without any traffic for this long gives back what it can
+#define CONN_IDLE_TIMEOUT	10000
+
+// most segments forwarded from one client per readiness event, so a busy
+// connection cannot starve the others served by the same thread
+#define CONN_BATCH_SEGMENTS	16
+
+// Delay of an ACK that is due but could not be piggybacked on data. It
+// follows twice the smoothed gap between incoming segments, so a steady
+// stream is acknowledged quickly while sparse traffic waits for a reply.
+#define ACK_TIMEOUT_MIN 5
+#define ACK_TIMEOUT_MAX 30
+
+// tests/ack-policy-bench shows no throughput difference between the two;
+// delayed sends a quarter of the ACK-only packets, but stays opt-in
+enum ack_policy {
+	ACK_POLICY_IMMEDIATE,	// one ACK per incoming segment
+	ACK_POLICY_DELAYED	// one ACK once half the window is used, or on timeout
+};
+
+static enum ack_policy ack_policy = ACK_POLICY_IMMEDIATE;
 
-#define ACK_TIMEOUT 30
+static uint32_t conn_win_min = CONN_WIN_MIN;
+static uint32_t conn_win_max = CONN_WIN_MAX;
+
+// connections are indexed by local port in a two-level table, pages are allocated on demand
+#define SPORT_PAGE_SHIFT	8
+#define SPORT_PAGE_SIZE		(1 << SPORT_PAGE_SHIFT)
+#define SPORT_PAGES		(65536 >> SPORT_PAGE_SHIFT)
+#define SPORT_MAP_WORDS		(65536 / 64)
 
 enum mux_protocol {
 	MUX_PROTO_VERSION = 0,
@@ -92,6 +139,7 @@ struct version_header
 struct mux_device;
 
 #define CONN_ACK_PENDING 1
+#define CONN_ACK_QUEUED 2
 
 struct mux_connection
 {
@@ -100,17 +148,21 @@ struct mux_connection
 	enum mux_conn_state state;
 	uint16_t sport, dport;
 	uint32_t tx_seq, tx_ack, tx_acked, tx_win;
+	uint32_t tx_edge; // tx_acked plus the window sent along with it
 	uint32_t rx_seq, rx_recvd, rx_ack, rx_win;
 	uint32_t max_payload;
 	uint32_t sendable;
 	int flags;
-	unsigned char *ib_buf;
-	uint32_t ib_size;
-	uint32_t ib_capacity;
-	unsigned char *ob_buf;
-	uint32_t ob_capacity;
+	struct ringbuf ib;
 	short events;
 	uint64_t last_ack_time;
+	uint64_t last_rx_time;
+	uint32_t rx_gap; // smoothed time between incoming segments, in 1/8 ms
+	uint64_t last_io_time; // last data from the device or read by the client
+	uint32_t charged; // buffer bytes counted against the budgets
+	struct timer ack_timer;
+	struct timer idle_timer;
+	struct mux_connection *ack_next;
 };
 
 struct mux_device
@@ -120,6 +172,9 @@ struct mux_device
 	enum mux_dev_state state;
 	int visible;
 	struct collection connections;
+	struct mux_connection **conn_table[SPORT_PAGES];
+	struct mux_connection *ack_list; // connections to ACK after the current RX transfer
+	uint64_t sport_map[SPORT_MAP_WORDS];
 	uint16_t next_sport;
 	unsigned char *pktbuf;
 	uint32_t pktlen;
@@ -127,62 +182,152 @@ struct mux_device
 	int version;
 	uint16_t rx_seq;
 	uint16_t tx_seq;
+	int tx_blocked; // no USB transfers available for client data
+	uint64_t buffer_used; // connection buffer bytes, protected by budget_mutex
+	struct worker *worker; // NULL if the device is handled on the main thread
+	struct mux_device *id_next;
 };
 
+// number of hash buckets of the device id index (power of 2)
+#define DEVICE_HASH_SIZE 64
+
 static struct collection device_list;
 mutex_t device_list_mutex;
 
-static struct mux_device* get_mux_device_for_id(int device_id)
+// pending delayed ACKs of connections handled on the main thread, only used from there
+static struct timer_queue ack_timers;
+
+// set by device_kill_connections(), no event loop runs afterwards to flush lingering clients
+static int connections_killed;
+
+/*
+ * Buffer memory budget. The input buffers of all connections, and the
+ * data queued for sending on their client sockets, count against a
+ * global and a per-device limit. Beyond either of them new
+ * connections are refused and existing ones keep their smallest window.
+ * The counters are shared by all threads and protected by budget_mutex.
+ */
+static mutex_t budget_mutex;
+static uint64_t buffer_budget; // bytes, 0 for no limit
+static uint64_t device_buffer_budget;
+static uint64_t buffer_used;
+static uint64_t buffer_refused;
+
+/*
+ * Device registry. device_list is kept for iteration, lookups by id go
+ * through the hash index below. Both are protected by device_list_mutex. Incoming USB data doesn't need any of
+ * this: the usb_device carries a back-pointer to its mux_device, which is
+ * only set and cleared on the USB event thread.
+ */
+static struct mux_device *device_id_hash[DEVICE_HASH_SIZE];
+
+// caller must hold device_list_mutex
+static struct mux_device *device_registry_find_id(int device_id)
 {
-	struct mux_device *dev = NULL;
-	mutex_lock(&device_list_mutex);
-	FOREACH(struct mux_device *cdev, &device_list) {
-		if(cdev->id == device_id) {
-			dev = cdev;
+	struct mux_device *dev = device_id_hash[(unsigned int)device_id & (DEVICE_HASH_SIZE - 1)];
+	while(dev && dev->id != device_id)
+		dev = dev->id_next;
+	return dev;
+}
+
+// caller must hold device_list_mutex
+static void device_registry_add(struct mux_device *dev)
+{
+	struct mux_device **head = &device_id_hash[(unsigned int)dev->id & (DEVICE_HASH_SIZE - 1)];
+
+	collection_add(&device_list, dev);
+	dev->id_next = *head;
+	*head = dev;
+}
+
+// caller must hold device_list_mutex
+static void device_registry_remove(struct mux_device *dev)
+{
+	struct mux_device **p;
+
+	collection_remove(&device_list, dev);
+	for(p = &device_id_hash[(unsigned int)dev->id & (DEVICE_HASH_SIZE - 1)]; *p; p = &(*p)->id_next) {
+		if(*p == dev) {
+			*p = dev->id_next;
 			break;
 		}
-	} ENDFOREACH
+	}
+	dev->id_next = NULL;
+}
+
+static struct mux_device* get_mux_device_for_id(int device_id)
+{
+	struct mux_device *dev;
+	mutex_lock(&device_list_mutex);
+	dev = device_registry_find_id(device_id);
 	mutex_unlock(&device_list_mutex);
 
 	return dev;
 }
 
-static struct mux_connection* get_mux_connection(int device_id, struct mux_client *client)
+static int get_next_device_id(void)
 {
-	struct mux_connection *conn = NULL;
-	FOREACH(struct mux_device *dev, &device_list) {
-		if(dev->id == device_id) {
-			FOREACH(struct mux_connection *lconn, &dev->connections) {
-				if(lconn->client == client) {
-					conn = lconn;
-					break;
-				}
-			} ENDFOREACH
-			break;
-		}
-	} ENDFOREACH
+	int id;
+	mutex_lock(&device_list_mutex);
+	while(device_registry_find_id(next_device_id))
+		next_device_id++;
+	id = next_device_id++;
+	mutex_unlock(&device_list_mutex);
+	return id;
+}
 
-	return conn;
+static int get_mux_header_size(struct mux_device *dev)
+{
+	return (dev->version < 2) ? 8 : sizeof(struct mux_header);
 }
 
-static int get_next_device_id(void)
+static void fill_mux_header(struct mux_device *dev, enum mux_protocol proto, unsigned char *buffer, int total)
 {
-	while(1) {
-		int ok = 1;
-		mutex_lock(&device_list_mutex);
-		FOREACH(struct mux_device *dev, &device_list) {
-			if(dev->id == next_device_id) {
-				next_device_id++;
-				ok = 0;
-				break;
-			}
-		} ENDFOREACH
-		mutex_unlock(&device_list_mutex);
-		if(ok)
-			return next_device_id++;
+	struct mux_header *mhdr = (struct mux_header *)buffer;
+	mhdr->protocol = htonl(proto);
+	mhdr->length = htonl(total);
+	if (dev->version >= 2) {
+		mhdr->magic = htonl(0xfeedface);
+		if (proto == MUX_PROTO_SETUP) {
+			dev->tx_seq = 0;
+			dev->rx_seq = 0xFFFF;
+		}
+		mhdr->tx_seq = htons(dev->tx_seq);
+		mhdr->rx_seq = htons(dev->rx_seq);
+		dev->tx_seq++;
 	}
 }
 
+/**
+ * Fill in the mux header at the start of a complete outgoing packet and
+ * hand the packet to the USB layer.
+ *
+ * @param dev The device to send to.
+ * @param proto The protocol of the packet.
+ * @param buffer Packet buffer from usb_get_tx_buffer(), starting with
+ *   room for the mux header. It goes back to the USB layer, also on error.
+ * @param total Total packet length including the mux header.
+ * @return The number of bytes sent, or a negative value on error.
+ */
+static int send_packet_buffer(struct mux_device *dev, enum mux_protocol proto, unsigned char *buffer, int total)
+{
+	int res;
+
+	if(total > USB_MTU) {
+		usbmuxd_log(LL_ERROR, "Tried to send packet larger than USB MTU (total %d) to device %d", total, dev->id);
+		usb_release_tx_buffer(dev->usbdev, buffer);
+		return -1;
+	}
+
+	fill_mux_header(dev, proto, buffer, total);
+
+	if((res = usb_send_tx_buffer(dev->usbdev, buffer, total)) < 0) {
+		usbmuxd_log(LL_ERROR, "usb_send failed while sending packet (len %d) to device %d: %d", total, dev->id, res);
+		return res;
+	}
+	return total;
+}
+
 static int send_packet(struct mux_device *dev, enum mux_protocol proto, void *header, const void *data, int length)
 {
 	unsigned char *buffer;
@@ -205,7 +350,7 @@ static int send_packet(struct mux_device *dev, enum mux_protocol proto, void *he
 	}
 	usbmuxd_log(LL_SPEW, "send_packet(%d, 0x%x, %p, %p, %d)", dev->id, proto, header, data, length);
 
-	int mux_header_size = ((dev->version < 2) ? 8 : sizeof(struct mux_header));
+	int mux_header_size = get_mux_header_size(dev);
 
 	int total = mux_header_size + hdrlen + length;
 
@@ -214,23 +359,20 @@ static int send_packet(struct mux_device *dev, enum mux_protocol proto, void *he
 		return -1;
 	}
 
-	buffer = malloc(total);
-	struct mux_header *mhdr = (struct mux_header *)buffer;
-	mhdr->protocol = htonl(proto);
-	mhdr->length = htonl(total);
-	if (dev->version >= 2) {
-		mhdr->magic = htonl(0xfeedface);
-		if (proto == MUX_PROTO_SETUP) {
-			dev->tx_seq = 0;
-			dev->rx_seq = 0xFFFF;
-		}
-		mhdr->tx_seq = htons(dev->tx_seq);
-		mhdr->rx_seq = htons(dev->rx_seq);
-		dev->tx_seq++;
+	buffer = usb_get_tx_buffer(dev->usbdev, 0);
+	if(buffer) {
+		memcpy(buffer + mux_header_size, header, hdrlen);
+		if(data && length)
+			memcpy(buffer + mux_header_size + hdrlen, data, length);
+		return send_packet_buffer(dev, proto, buffer, total);
 	}
+
+	// all pooled transfers are in flight, don't hold back control packets
+	buffer = malloc(total);
 	memcpy(buffer + mux_header_size, header, hdrlen);
 	if(data && length)
 		memcpy(buffer + mux_header_size + hdrlen, data, length);
+	fill_mux_header(dev, proto, buffer, total);
 
 	if((res = usb_send(dev->usbdev, buffer, total)) < 0) {
 		usbmuxd_log(LL_ERROR, "usb_send failed while sending packet (len %d) to device %d: %d", total, dev->id, res);
@@ -240,23 +382,81 @@ static int send_packet(struct mux_device *dev, enum mux_protocol proto, void *he
 	return total;
 }
 
+/**
+ * Allocate a free local port for a new connection. Ports in use are tracked
+ * in a bitmap, so this only scans one 64 bit word per 64 ports starting at
+ * next_sport and wrapping around. Port 0 is permanently reserved.
+ *
+ * @param dev The device to allocate a port on.
+ * @return The port number, or 0 if all ports are in use.
+ */
 static uint16_t find_sport(struct mux_device *dev)
 {
-	if(collection_count(&dev->connections) >= 65535)
-		return 0; //insanity
+	uint32_t word = dev->next_sport / 64;
+	uint64_t bits;
+	int i;
+
+	// the first word is visited twice: the upper bits first, the lower bits after wrapping around
+	for(i = 0; i <= SPORT_MAP_WORDS; i++) {
+		bits = ~dev->sport_map[word];
+		if(i == 0)
+			bits &= ~0ULL << (dev->next_sport % 64);
+		if(bits) {
+			uint16_t sport = word * 64 + __builtin_ctzll(bits);
+			dev->next_sport = sport + 1;
+			return sport;
+		}
+		word = (word + 1) % SPORT_MAP_WORDS;
+	}
+	return 0; //insanity
+}
 
-	while(1) {
-		int ok = 1;
-		FOREACH(struct mux_connection *conn, &dev->connections) {
-			if(dev->next_sport == conn->sport) {
-				dev->next_sport++;
-				ok = 0;
-				break;
-			}
-		} ENDFOREACH
-		if(ok)
-			return dev->next_sport++;
+static struct mux_connection *conn_table_get(struct mux_device *dev, uint16_t sport)
+{
+	struct mux_connection **page = dev->conn_table[sport >> SPORT_PAGE_SHIFT];
+	if(!page)
+		return NULL;
+	return page[sport & (SPORT_PAGE_SIZE - 1)];
+}
+
+static int conn_table_add(struct mux_device *dev, struct mux_connection *conn)
+{
+	struct mux_connection ***page = &dev->conn_table[conn->sport >> SPORT_PAGE_SHIFT];
+	if(!*page) {
+		*page = calloc(SPORT_PAGE_SIZE, sizeof(struct mux_connection *));
+		if(!*page) {
+			usbmuxd_log(LL_ERROR, "%s: Failed to allocate connection table page", __func__);
+			return -1;
+		}
 	}
+	(*page)[conn->sport & (SPORT_PAGE_SIZE - 1)] = conn;
+	dev->sport_map[conn->sport / 64] |= 1ULL << (conn->sport % 64);
+	return 0;
+}
+
+static void conn_table_remove(struct mux_device *dev, struct mux_connection *conn)
+{
+	struct mux_connection **page = dev->conn_table[conn->sport >> SPORT_PAGE_SHIFT];
+	if(!page || page[conn->sport & (SPORT_PAGE_SIZE - 1)] != conn)
+		return;
+	page[conn->sport & (SPORT_PAGE_SIZE - 1)] = NULL;
+	dev->sport_map[conn->sport / 64] &= ~(1ULL << (conn->sport % 64));
+}
+
+static void conn_table_free(struct mux_device *dev)
+{
+	int i;
+	for(i = 0; i < SPORT_PAGES; i++) {
+		free(dev->conn_table[i]);
+		dev->conn_table[i] = NULL;
+	}
+}
+
+static struct timer_queue *connection_timers(struct mux_connection *conn)
+{
+	if(conn->dev->worker)
+		return worker_get_timers(conn->dev->worker);
+	return &ack_timers;
 }
 
 static int send_anon_rst(struct mux_device *dev, uint16_t sport, uint16_t dport, uint32_t ack)
@@ -275,34 +475,122 @@ static int send_anon_rst(struct mux_device *dev, uint16_t sport, uint16_t dport,
 	return res;
 }
 
-static int send_tcp(struct mux_connection *conn, uint8_t flags, const unsigned char *data, int length)
+static void fill_tcp_header(struct mux_connection *conn, struct tcphdr *th, uint8_t flags, int length)
 {
-	struct tcphdr th;
-	memset(&th, 0, sizeof(th));
-	th.th_sport = htons(conn->sport);
-	th.th_dport = htons(conn->dport);
-	th.th_seq = htonl(conn->tx_seq);
-	th.th_ack = htonl(conn->tx_ack);
-	th.th_flags = flags;
-	th.th_off = sizeof(th) / 4;
-	th.th_win = htons(conn->tx_win >> 8);
+	memset(th, 0, sizeof(struct tcphdr));
+	th->th_sport = htons(conn->sport);
+	th->th_dport = htons(conn->dport);
+	th->th_seq = htonl(conn->tx_seq);
+	th->th_ack = htonl(conn->tx_ack);
+	th->th_flags = flags;
+	th->th_off = sizeof(struct tcphdr) / 4;
+	th->th_win = htons(conn->tx_win >> 8);
 
 	usbmuxd_log(LL_DEBUG, "[OUT] dev=%d sport=%d dport=%d seq=%d ack=%d flags=0x%x window=%d[%d] len=%d",
 		conn->dev->id, conn->sport, conn->dport, conn->tx_seq, conn->tx_ack, flags, conn->tx_win, conn->tx_win >> 8, length);
+}
+
+// everything up to tx_ack has been acknowledged to the device
+static void tcp_ack_sent(struct mux_connection *conn)
+{
+	conn->tx_acked = conn->tx_ack;
+	conn->tx_edge = conn->tx_ack + conn->tx_win;
+	conn->last_ack_time = mstime64();
+	conn->flags &= ~CONN_ACK_PENDING;
+	timer_disarm(connection_timers(conn), &conn->ack_timer);
+}
+
+static int send_tcp(struct mux_connection *conn, uint8_t flags, const unsigned char *data, int length)
+{
+	struct tcphdr th;
+	fill_tcp_header(conn, &th, flags, length);
 
 	int res = send_packet(conn->dev, MUX_PROTO_TCP, &th, data, length);
-	if(res >= 0) {
-		conn->tx_acked = conn->tx_ack;
-		conn->last_ack_time = mstime64();
-		conn->flags &= ~CONN_ACK_PENDING;
-	}
+	if(res >= 0)
+		tcp_ack_sent(conn);
+	return res;
+}
+
+/**
+ * Space needed in front of a TCP payload for the headers of the packet.
+ */
+static int get_tcp_headroom(struct mux_device *dev)
+{
+	return get_mux_header_size(dev) + sizeof(struct tcphdr);
+}
+
+/**
+ * Send a TCP segment whose payload has been placed in a transfer buffer
+ * behind get_tcp_headroom() bytes of reserved space. The headers are
+ * filled in place, so the payload is not copied again.
+ *
+ * @param conn The connection to send on.
+ * @param flags TCP flags.
+ * @param buffer The transfer buffer. Ownership passes to the USB layer,
+ *   also on error.
+ * @param length Length of the payload behind the headroom.
+ * @return The number of bytes sent, or a negative value on error.
+ */
+static int send_tcp_buffer(struct mux_connection *conn, uint8_t flags, unsigned char *buffer, int length)
+{
+	int mux_header_size = get_mux_header_size(conn->dev);
+	fill_tcp_header(conn, (struct tcphdr *)(buffer + mux_header_size), flags, length);
+
+	int res = send_packet_buffer(conn->dev, MUX_PROTO_TCP, buffer, get_tcp_headroom(conn->dev) + length);
+	if(res >= 0)
+		tcp_ack_sent(conn);
 	return res;
 }
 
+// caller must hold budget_mutex
+static int budget_exceeded(struct mux_device *dev)
+{
+	if(buffer_budget && buffer_used >= buffer_budget)
+		return 1;
+	if(device_buffer_budget && dev->buffer_used >= device_buffer_budget)
+		return 1;
+	return 0;
+}
+
+static void connection_idle_timeout(struct timer *timer, void *data);
+
+// Account for a change of the input buffer's capacity, or of the data
+// queued on the client socket, in the budgets
+static void connection_charge_input(struct mux_connection *conn)
+{
+	uint32_t capacity = conn->ib.capacity;
+	if(conn->state != CONN_DEAD && conn->client)
+		capacity += client_get_queued(conn->client);
+	if(capacity == conn->charged)
+		return;
+	mutex_lock(&budget_mutex);
+	buffer_used = buffer_used - conn->charged + capacity;
+	conn->dev->buffer_used = conn->dev->buffer_used - conn->charged + capacity;
+	mutex_unlock(&budget_mutex);
+	// a grown buffer is given back if the connection goes quiet
+	if(capacity > conn->charged && !timer_is_armed(&conn->idle_timer))
+		timer_arm(connection_timers(conn), &conn->idle_timer, mstime64() + CONN_IDLE_TIMEOUT);
+	conn->charged = capacity;
+}
+
+static void connection_unqueue_ack(struct mux_connection *conn)
+{
+	struct mux_connection **p;
+	if(!(conn->flags & CONN_ACK_QUEUED))
+		return;
+	for(p = &conn->dev->ack_list; *p; p = &(*p)->ack_next) {
+		if(*p == conn) {
+			*p = conn->ack_next;
+			break;
+		}
+	}
+	conn->flags &= ~CONN_ACK_QUEUED;
+	conn->ack_next = NULL;
+}
+
 static void connection_teardown(struct mux_connection *conn)
 {
 	int res;
-	int size;
 	if(conn->state == CONN_DEAD)
 		return;
 	usbmuxd_log(LL_DEBUG, "connection_teardown dev %d sport %d dport %d", conn->dev->id, conn->sport, conn->dport);
@@ -312,46 +600,33 @@ static void connection_teardown(struct mux_connection *conn)
 			usbmuxd_log(LL_ERROR, "Error sending TCP RST to device %d (%d->%d)", conn->dev->id, conn->sport, conn->dport);
 	}
 	if(conn->client) {
+		client_set_connection(conn->client, NULL);
 		if(conn->state == CONN_REFUSED || conn->state == CONN_CONNECTING) {
 			client_notify_connect(conn->client, RESULT_CONNREFUSED);
 		} else {
 			conn->state = CONN_DEAD;
-			if((conn->events & POLLOUT) && conn->ib_size > 0){
-				usbmuxd_log(LL_DEBUG, "%s: flushing buffer to client (%u bytes)", __func__, conn->ib_size);
-				uint64_t tm_last = mstime64();
-				while(1){
-					size = client_write(conn->client, conn->ib_buf, conn->ib_size);
-					if(size < 0) {
-						usbmuxd_log(LL_ERROR, "%s: aborting buffer flush to client after error.", __func__);
-						break;
-					} else if (size == 0) {
-						uint64_t tm_now = mstime64();
-						if (tm_now - tm_last > 1000) {
-							usbmuxd_log(LL_ERROR, "%s: aborting buffer flush to client after unsuccessfully attempting for %dms.", __func__, (int)(tm_now - tm_last));
-							break;
-						}
-						usleep(10000);
-						continue;
-					}
-					if(size == (int)conn->ib_size) {
-						conn->ib_size = 0;
-						break;
-					} else {
-						conn->ib_size -= size;
-						memmove(conn->ib_buf, conn->ib_buf + size, conn->ib_size);
-					}
-					tm_last = mstime64();
-				}
+			if(!connections_killed && (conn->events & POLLOUT) && conn->ib.size > 0) {
+				// let the client have what the device sent before the end
+				client_linger(conn->client, &conn->ib, connection_timers(conn), CONN_LINGER_TIMEOUT);
+			} else {
+				client_close(conn->client);
 			}
-			client_close(conn->client);
 		}
 	}
-	free(conn->ib_buf);
-	free(conn->ob_buf);
+	// nothing stays charged once the connection is gone
+	conn->state = CONN_DEAD;
+	ringbuf_free(&conn->ib);
+	connection_charge_input(conn);
+	timer_disarm(connection_timers(conn), &conn->ack_timer);
+	timer_disarm(connection_timers(conn), &conn->idle_timer);
+	connection_unqueue_ack(conn);
+	conn_table_remove(conn->dev, conn);
 	collection_remove(&conn->dev->connections, conn);
 	free(conn);
 }
 
+static void connection_ack_timeout(struct timer *timer, void *data);
+
 int device_start_connect(int device_id, uint16_t dport, struct mux_client *client)
 {
 	struct mux_device *dev = get_mux_device_for_id(device_id);
@@ -360,6 +635,16 @@ int device_start_connect(int device_id, uint16_t dport, struct mux_client *clien
 		return -RESULT_BADDEV;
 	}
 
+	mutex_lock(&budget_mutex);
+	int exceeded = budget_exceeded(dev);
+	if(exceeded)
+		buffer_refused++;
+	mutex_unlock(&budget_mutex);
+	if(exceeded) {
+		usbmuxd_log(LL_WARNING, "Refusing connection to device %d, connection buffers exhausted the memory budget", device_id);
+		return -RESULT_NOMEM;
+	}
+
 	uint16_t sport = find_sport(dev);
 	if(!sport) {
 		usbmuxd_log(LL_WARNING, "Unable to allocate port for device %d", device_id);
@@ -378,39 +663,47 @@ int device_start_connect(int device_id, uint16_t dport, struct mux_client *clien
 	conn->tx_seq = 0;
 	conn->tx_ack = 0;
 	conn->tx_acked = 0;
-	conn->tx_win = 131072;
+	conn->tx_win = conn_win_min;
 	conn->rx_recvd = 0;
 	conn->flags = 0;
 	conn->max_payload = USB_MTU - sizeof(struct mux_header) - sizeof(struct tcphdr);
+	conn->last_io_time = mstime64();
+	timer_init(&conn->ack_timer, connection_ack_timeout, conn);
+	timer_init(&conn->idle_timer, connection_idle_timeout, conn);
 
-	conn->ob_buf = malloc(CONN_OUTBUF_SIZE);
-	conn->ob_capacity = CONN_OUTBUF_SIZE;
-	conn->ib_buf = malloc(CONN_INBUF_SIZE);
-	conn->ib_capacity = CONN_INBUF_SIZE;
-	conn->ib_size = 0;
+	if(conn_table_add(dev, conn) < 0) {
+		ringbuf_free(&conn->ib);
+		free(conn);
+		return -RESULT_BADDEV;
+	}
 
 	int res;
 
 	res = send_tcp(conn, TH_SYN, NULL, 0);
 	if(res < 0) {
 		usbmuxd_log(LL_ERROR, "Error sending TCP SYN to device %d (%d->%d)", dev->id, sport, dport);
-		free(conn->ib_buf);
-		free(conn->ob_buf);
+		conn_table_remove(dev, conn);
+		ringbuf_free(&conn->ib);
 		free(conn);
 		return -RESULT_CONNREFUSED; //bleh
 	}
 	collection_add(&dev->connections, conn);
+	client_set_connection(client, conn);
 	return 0;
 }
 
-/**
- * Examine the state of a connection's buffers and
- * update all connection flags and masks accordingly.
- * Does not do I/O.
- *
- * @param conn The connection to update.
- */
-static void update_connection(struct mux_connection *conn)
+static int connection_ack_delay(struct mux_connection *conn)
+{
+	int delay = conn->rx_gap / 4; // twice the gap, in ms
+	if(delay < ACK_TIMEOUT_MIN)
+		return ACK_TIMEOUT_MIN;
+	if(delay > ACK_TIMEOUT_MAX)
+		return ACK_TIMEOUT_MAX;
+	return delay;
+}
+
+// how much client data the device's window allows in the next segment
+static void update_sendable(struct mux_connection *conn)
 {
 	uint32_t sent = conn->tx_seq - conn->rx_ack;
 
@@ -419,17 +712,29 @@ static void update_connection(struct mux_connection *conn)
 	else
 		conn->sendable = 0;
 
-	if(conn->sendable > conn->ob_capacity)
-		conn->sendable = conn->ob_capacity;
 	if(conn->sendable > conn->max_payload)
 		conn->sendable = conn->max_payload;
+}
 
-	if(conn->sendable > 0)
+/**
+ * Examine the state of a connection's buffers and
+ * update all connection flags and masks accordingly.
+ * Does not do I/O.
+ *
+ * @param conn The connection to update.
+ */
+static void update_connection(struct mux_connection *conn)
+{
+	update_sendable(conn);
+
+	// with all USB transfers in flight, leave client data in the socket
+	if(conn->sendable > 0 && !conn->dev->tx_blocked)
 		conn->events |= POLLIN;
 	else
 		conn->events &= ~POLLIN;
 
-	if(conn->ib_size)
+	// data queued on the client socket is uncharged once it was sent
+	if(conn->ib.size || client_get_queued(conn->client))
 		conn->events |= POLLOUT;
 	else
 		conn->events &= ~POLLOUT;
@@ -439,6 +744,13 @@ static void update_connection(struct mux_connection *conn)
 	else
 		conn->flags &= ~CONN_ACK_PENDING;
 
+	if((conn->state == CONN_CONNECTED) && (conn->flags & CONN_ACK_PENDING)) {
+		if(!timer_is_armed(&conn->ack_timer))
+			timer_arm(connection_timers(conn), &conn->ack_timer, conn->last_ack_time + connection_ack_delay(conn));
+	} else {
+		timer_disarm(connection_timers(conn), &conn->ack_timer);
+	}
+
 	usbmuxd_log(LL_SPEW, "update_connection: sendable %d, events %d, flags %d", conn->sendable, conn->events, conn->flags);
 	client_set_events(conn->client, conn->events);
 }
@@ -456,106 +768,290 @@ static int send_tcp_ack(struct mux_connection *conn)
 	return 0;
 }
 
+static void connection_ack_timeout(struct timer *timer, void *data)
+{
+	struct mux_connection *conn = data;
+	if((conn->state != CONN_CONNECTED) || !(conn->flags & CONN_ACK_PENDING))
+		return;
+	usbmuxd_log(LL_DEBUG, "Sending ACK due to expired timeout (%" PRIu64 " -> %" PRIu64 ")", conn->last_ack_time, mstime64());
+	send_tcp_ack(conn);
+}
+
+// Give the input buffer back to the pool once the client drained it
+static void connection_trim_input(struct mux_connection *conn)
+{
+	if(conn->ib.size)
+		return;
+	ringbuf_free(&conn->ib);
+	connection_charge_input(conn);
+}
+
 /**
  * Flush input and output buffers for a client connection.
  *
- * @param device_id Numeric id for the device.
- * @param client The client to flush buffers for.
+ * @param conn The connection of the client to flush buffers for.
  * @param events event mask for the client. POLLOUT means that
  *   the client is ready to receive data, POLLIN that it has
  *   data to be read (and send along to the device).
  */
-void device_client_process(int device_id, struct mux_client *client, short events)
+void device_client_process(struct mux_connection *conn, short events)
 {
-	mutex_lock(&device_list_mutex);
-	struct mux_connection *conn = get_mux_connection(device_id, client);
-	mutex_unlock(&device_list_mutex);
 	if(!conn) {
-		usbmuxd_log(LL_WARNING, "Could not find connection for device %d client %p", device_id, client);
+		usbmuxd_log(LL_WARNING, "Could not find connection for client event");
 		return;
 	}
 	usbmuxd_log(LL_SPEW, "device_client_process (%d)", events);
 
 	int res;
 	int size;
-	if((events & POLLOUT) && conn->ib_size > 0) {
+	int segments;
+	if((events & POLLOUT) && conn->ib.size > 0) {
 		// Client is ready to receive data, send what we have
 		// in the client's connection buffer (if there is any)
-		size = client_write(conn->client, conn->ib_buf, conn->ib_size);
+		struct iovec iov[2];
+		int n = ringbuf_get_iov(&conn->ib, iov);
+		size = client_writev(conn->client, iov, n);
 		if(size <= 0) {
 			usbmuxd_log(LL_DEBUG, "error writing to client (%d)", size);
 			connection_teardown(conn);
 			return;
 		}
 		conn->tx_ack += size;
-		if(size == (int)conn->ib_size) {
-			conn->ib_size = 0;
-		} else {
-			conn->ib_size -= size;
-			memmove(conn->ib_buf, conn->ib_buf + size, conn->ib_size);
-		}
+		conn->last_io_time = mstime64();
+		ringbuf_consume(&conn->ib, size);
+		connection_trim_input(conn);
 	}
-	if((events & POLLIN) && conn->sendable > 0) {
-		// There is inbound trafic on the client socket,
-		// convert it to tcp and send to the device
-		// (if the device's input buffer is not full)
-		size = client_read(conn->client, conn->ob_buf, conn->sendable);
+	if(events & POLLOUT)
+		connection_charge_input(conn);
+	// There is inbound trafic on the client socket, convert it to tcp
+	// and send it to the device, segment after segment until the socket
+	// is drained, the device's window is closed or the connection used
+	// up its share of this dispatch
+	for(segments = 0; (events & POLLIN) && conn->sendable > 0 && segments < CONN_BATCH_SEGMENTS; segments++) {
+		// read right behind the space reserved for the headers of a
+		// pooled USB transfer buffer, which is then sent as a whole
+		int headroom = get_tcp_headroom(conn->dev);
+		uint32_t want = conn->sendable;
+		unsigned char *buffer = usb_get_tx_buffer(conn->dev->usbdev, 1);
+		if(!buffer) {
+			// device_tx_resume() picks up again
+			usbmuxd_log(LL_DEBUG, "All TX transfers of device %d in flight, pausing client input", conn->dev->id);
+			conn->dev->tx_blocked = 1;
+			break;
+		}
+		size = client_read(conn->client, buffer + headroom, want);
+		if(size < 0 && segments > 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			usb_release_tx_buffer(conn->dev->usbdev, buffer);
+			break;
+		}
 		if(size <= 0) {
 			if (size < 0) {
 				usbmuxd_log(LL_DEBUG, "error reading from client (%d)", size);
 			}
+			usb_release_tx_buffer(conn->dev->usbdev, buffer);
 			connection_teardown(conn);
 			return;
 		}
-		res = send_tcp(conn, TH_ACK, conn->ob_buf, size);
+		res = send_tcp_buffer(conn, TH_ACK, buffer, size);
 		if(res < 0) {
 			connection_teardown(conn);
 			return;
 		}
 		conn->tx_seq += size;
+		// a short read means the socket is empty
+		if((uint32_t)size < want)
+			break;
+		update_sendable(conn);
 	}
 
 	update_connection(conn);
 }
 
+static int connection_reserve_input(struct mux_connection *conn, uint32_t size)
+{
+	// the window never exceeds conn_win_max; the slack is for devices
+	// overshooting it, as the fixed buffer of twice the window allowed
+	if(size > 2 * conn_win_max)
+		return -1;
+	if(ringbuf_reserve(&conn->ib, size) < 0)
+		return -1;
+	connection_charge_input(conn);
+	return 0;
+}
+
+// the right edge of a window that was already advertised never moves back
+static uint32_t connection_clamp_window(struct mux_connection *conn, uint32_t win)
+{
+	uint32_t promised = conn->tx_edge - conn->tx_ack;
+	if((int32_t)promised > 0 && win < promised)
+		win = (promised + 255) & ~255U;
+	return win;
+}
+
+/*
+ * Adjust the window advertised with the next ACK. Everything received
+ * and not yet acknowledged counts as in flight; if the device filled
+ * most of the window while the client drained the data, the window is
+ * what limits the transfer rate. If instead the data sits in the input
+ * buffer, the client is the bottleneck and a smaller window just keeps
+ * less data buffered. While the buffers of all connections exceed the
+ * memory budget, the window stays at its minimum.
+ */
+static void connection_tune_window(struct mux_connection *conn)
+{
+	uint32_t in_flight = conn->ib.size + (conn->tx_ack - conn->tx_acked);
+	uint32_t win = conn->tx_win;
+	int exceeded;
+
+	mutex_lock(&budget_mutex);
+	exceeded = budget_exceeded(conn->dev);
+	mutex_unlock(&budget_mutex);
+
+	if(exceeded) {
+		win = conn_win_min;
+	} else if(conn->ib.size < win / 4 && in_flight >= win - win / 4) {
+		win *= 2;
+		if(win > conn_win_max)
+			win = conn_win_max;
+	} else if(conn->ib.size >= win - win / 4) {
+		win /= 2;
+		if(win < conn_win_min)
+			win = conn_win_min;
+	}
+	win = connection_clamp_window(conn, win);
+	if(win != conn->tx_win) {
+		usbmuxd_log(LL_SPEW, "Window of device %d connection %d->%d: %u -> %u (in flight %u, buffered %u)", conn->dev->id, conn->sport, conn->dport, conn->tx_win, win, in_flight, conn->ib.size);
+		conn->tx_win = win;
+	}
+}
+
 /**
- * Copy a payload to a connection's in-buffer and
- * set the POLLOUT event mask on the connection so
- * the next main_loop iteration will dispatch the
- * buffer if the connection socket is writable.
+ * Pass a payload received from the device on to the client. If nothing
+ * is queued for the client yet, the payload is written to the client
+ * socket right away, straight from the buffer it was received in. Only
+ * what could not be written is copied to the connection's in-buffer and
+ * the POLLOUT event mask is set on the connection so the next main_loop
+ * iteration will dispatch the buffer if the connection socket is
+ * writable.
  *
  * Connection buffers are flushed in the
  * device_client_process() function.
  *
  * @param conn The connection to add incoming data to.
  * @param payload Payload to prepare for writing.
- *   The payload will be copied immediately so you are
+ *   The payload will be written or copied immediately so you are
  *   free to alter or free the payload buffer when this
  *   function returns.
  * @param payload_length number of bytes to copy from from
  *   the payload.
  */
-static void connection_device_input(struct mux_connection *conn, unsigned char *payload, uint32_t payload_length)
+static int connection_device_input(struct mux_connection *conn, unsigned char *payload, uint32_t payload_length)
 {
-	if((conn->ib_size + payload_length) > conn->ib_capacity) {
-		usbmuxd_log(LL_ERROR, "Input buffer overflow on device %d connection %d->%d (space=%d, payload=%d)", conn->dev->id, conn->sport, conn->dport, conn->ib_capacity-conn->ib_size, payload_length);
+	uint32_t written = 0;
+
+	if(payload_length > 0) {
+		uint64_t now = mstime64();
+		uint64_t gap = now - conn->last_rx_time;
+		if(gap > ACK_TIMEOUT_MAX)
+			gap = ACK_TIMEOUT_MAX;
+		if(conn->last_rx_time)
+			conn->rx_gap += ((int32_t)gap * 8 - (int32_t)conn->rx_gap) / 8;
+		conn->last_rx_time = now;
+		conn->last_io_time = now;
+	}
+
+	if(conn->ib.size == 0 && payload_length > 0 && conn->client && client_is_connected(conn->client)) {
+		// errors are picked up when the buffered data is flushed
+		int size = client_write(conn->client, payload, payload_length);
+		if(size > 0) {
+			written = size;
+			conn->tx_ack += size;
+		}
+	}
+	if(connection_reserve_input(conn, conn->ib.size + payload_length - written) < 0) {
+		usbmuxd_log(LL_ERROR, "Input buffer overflow on device %d connection %d->%d (space=%d, payload=%d)", conn->dev->id, conn->sport, conn->dport, conn->ib.capacity-conn->ib.size, payload_length - written);
 		connection_teardown(conn);
-		return;
+		return -1;
 	}
-	memcpy(conn->ib_buf + conn->ib_size, payload, payload_length);
-	conn->ib_size += payload_length;
+	ringbuf_append(&conn->ib, payload + written, payload_length - written);
 	conn->rx_recvd += payload_length;
+	connection_tune_window(conn);
 	update_connection(conn);
+	return 0;
+}
+
+/*
+ * A connection that neither received data nor had its client read any
+ * for CONN_IDLE_TIMEOUT keeps only the buffer the data still waiting for
+ * the client needs, and falls back to the smallest window so the device
+ * does not fill it up again right away.
+ */
+static void connection_idle_timeout(struct timer *timer, void *data)
+{
+	struct mux_connection *conn = data;
+	uint64_t idle_at = conn->last_io_time + CONN_IDLE_TIMEOUT;
+	uint32_t capacity = conn->ib.capacity;
+
+	if(conn->state != CONN_CONNECTED || !capacity)
+		return;
+	if(mstime64() < idle_at) {
+		timer_arm(connection_timers(conn), &conn->idle_timer, idle_at);
+		return;
+	}
+	if(conn->ib.size)
+		ringbuf_resize(&conn->ib, conn->ib.size);
+	else
+		ringbuf_free(&conn->ib);
+	connection_charge_input(conn);
+	conn->tx_win = connection_clamp_window(conn, conn_win_min);
+	usbmuxd_log(LL_DEBUG, "Device %d connection %d->%d is idle, input buffer %u -> %u bytes", conn->dev->id, conn->sport, conn->dport, capacity, conn->ib.capacity);
+}
+
+/*
+ * Acknowledge received data according to the ACK policy. Unless every
+ * segment is to be acknowledged right away, the connection is queued and
+ * device_flush_acks() decides once the whole RX transfer has been parsed
+ * whether the ACK can wait for the ACK timer. Data sent to the device in
+ * the meantime carries the ACK, which makes the separate one unnecessary.
+ */
+static void connection_ack_input(struct mux_connection *conn)
+{
+	if(ack_policy == ACK_POLICY_IMMEDIATE) {
+		send_tcp_ack(conn);
+		return;
+	}
+	if(conn->flags & CONN_ACK_QUEUED)
+		return;
+	conn->flags |= CONN_ACK_QUEUED;
+	conn->ack_next = conn->dev->ack_list;
+	conn->dev->ack_list = conn;
+}
+
+static void device_flush_acks(struct mux_device *dev)
+{
+	while(dev->ack_list) {
+		struct mux_connection *conn = dev->ack_list;
+		dev->ack_list = conn->ack_next;
+		conn->ack_next = NULL;
+		conn->flags &= ~CONN_ACK_QUEUED;
+		if(conn->state != CONN_CONNECTED || !(conn->flags & CONN_ACK_PENDING))
+			continue;
+		// left to the ACK timer, unless the device is about to run out of
+		// window: everything buffered or written to the client since the
+		// last ACK counts against it
+		if((conn->ib.size + conn->tx_ack - conn->tx_acked) < conn->tx_win / 2)
+			continue;
+		send_tcp_ack(conn);
+	}
 }
 
-void device_abort_connect(int device_id, struct mux_client *client)
+void device_abort_connect(struct mux_connection *conn)
 {
-	struct mux_connection *conn = get_mux_connection(device_id, client);
 	if (conn) {
 		conn->client = NULL;
 		connection_teardown(conn);
 	} else {
-		usbmuxd_log(LL_WARNING, "Attempted to abort for nonexistent connection for device %d", device_id);
+		usbmuxd_log(LL_WARNING, "Attempted to abort nonexistent connection");
 	}
 }
 
@@ -569,9 +1065,11 @@ static void device_version_input(struct mux_device *dev, struct version_header *
 	vh->minor = ntohl(vh->minor);
 	if(vh->major != 2 && vh->major != 1) {
 		usbmuxd_log(LL_ERROR, "Device %d has unknown version %d.%d", dev->id, vh->major, vh->minor);
+		usb_set_mux_device(dev->usbdev, NULL);
 		mutex_lock(&device_list_mutex);
-		collection_remove(&device_list, dev);
+		device_registry_remove(dev);
 		mutex_unlock(&device_list_mutex);
+		free(dev->pktbuf);
 		free(dev);
 		return;
 	}
@@ -584,6 +1082,7 @@ static void device_version_input(struct mux_device *dev, struct version_header *
 	usbmuxd_log(LL_NOTICE, "Connected to v%d.%d device %d on location 0x%x with serial number %s", dev->version, vh->minor, dev->id, usb_get_location(dev->usbdev), usb_get_serial(dev->usbdev));
 	dev->state = MUXDEV_ACTIVE;
 	collection_init(&dev->connections);
+	usb_set_init_stage(dev->usbdev, USB_INIT_CONNECTED);
 	struct device_info info;
 	info.id = dev->id;
 	info.location = usb_get_location(dev->usbdev);
@@ -650,12 +1149,9 @@ static void device_tcp_input(struct mux_device *dev, struct tcphdr *th, unsigned
 	}
 
 	// Find the connection on this device that has the right sport and dport
-	FOREACH(struct mux_connection *lconn, &dev->connections) {
-		if(lconn->sport == sport && lconn->dport == dport) {
-			conn = lconn;
-			break;
-		}
-	} ENDFOREACH
+	conn = conn_table_get(dev, sport);
+	if(conn && conn->dport != dport)
+		conn = NULL;
 
 	if(!conn) {
 		if(!(th->th_flags & TH_RST)) {
@@ -698,8 +1194,10 @@ static void device_tcp_input(struct mux_device *dev, struct tcphdr *th, unsigned
 			conn->state = CONN_CONNECTED;
 			usbmuxd_log(LL_INFO, "Client connected to device %d (%d->%d)", dev->id, sport, dport);
 			if(client_notify_connect(conn->client, RESULT_OK) < 0) {
+				client_set_connection(conn->client, NULL);
 				conn->client = NULL;
 				connection_teardown(conn);
+				return;
 			}
 			update_connection(conn);
 		}
@@ -709,11 +1207,10 @@ static void device_tcp_input(struct mux_device *dev, struct tcphdr *th, unsigned
 			if(th->th_flags & TH_RST)
 				conn->state = CONN_DYING;
 			connection_teardown(conn);
-		} else {
-			connection_device_input(conn, payload, payload_length);
-
-			// Device likes it best when we are prompty ACKing data
-			send_tcp_ack(conn);
+		} else if(connection_device_input(conn, payload, payload_length) == 0) {
+			// Device likes it best when we are promptly ACKing data, which the
+			// default policy does; delayed trades that for fewer ACK packets
+			connection_ack_input(conn);
 		}
 	}
 }
@@ -726,66 +1223,15 @@ static void device_tcp_input(struct mux_device *dev, struct tcphdr *th, unsigned
  * @param buffer
  * @param length
  */
-void device_data_input(struct usb_device *usbdev, unsigned char *buffer, uint32_t length)
-{
-	struct mux_device *dev = NULL;
-	mutex_lock(&device_list_mutex);
-	FOREACH(struct mux_device *tdev, &device_list) {
-		if(tdev->usbdev == usbdev) {
-			dev = tdev;
-			break;
-		}
-	} ENDFOREACH
-	mutex_unlock(&device_list_mutex);
-	if(!dev) {
-		usbmuxd_log(LL_WARNING, "Cannot find device entry for RX input from USB device %p on location 0x%x", usbdev, usb_get_location(usbdev));
-		return;
-	}
-
-	if(!length)
-		return;
-
-	// sanity check (should never happen with current USB implementation)
-	if((length > USB_MRU) || (length > DEV_MRU)) {
-		usbmuxd_log(LL_ERROR, "Too much data received from USB (%d), file a bug", length);
-		return;
-	}
-
-	usbmuxd_log(LL_SPEW, "Mux data input for device %p: %p len %d", dev, buffer, length);
-
-	// handle broken up transfers
-	if(dev->pktlen) {
-		if((length + dev->pktlen) > DEV_MRU) {
-			usbmuxd_log(LL_ERROR, "Incoming split packet is too large (%d so far), dropping!", length + dev->pktlen);
-			dev->pktlen = 0;
-			return;
-		}
-		memcpy(dev->pktbuf + dev->pktlen, buffer, length);
-		struct mux_header *mhdr = (struct mux_header *)dev->pktbuf;
-		if((length < USB_MRU) || (ntohl(mhdr->length) == (length + dev->pktlen))) {
-			buffer = dev->pktbuf;
-			length += dev->pktlen;
-			dev->pktlen = 0;
-			usbmuxd_log(LL_SPEW, "Gathered mux data from buffer (total size: %d)", length);
-		} else {
-			dev->pktlen += length;
-			usbmuxd_log(LL_SPEW, "Appended mux data to buffer (total size: %d)", dev->pktlen);
-			return;
-		}
-	} else {
-		struct mux_header *mhdr = (struct mux_header *)buffer;
-		if((length == USB_MRU) && (length < ntohl(mhdr->length))) {
-			memcpy(dev->pktbuf, buffer, length);
-			dev->pktlen = length;
-			usbmuxd_log(LL_SPEW, "Copied mux data to buffer (size: %d)", dev->pktlen);
-			return;
-		}
-	}
+// the protocol and length fields, common to all mux header versions
+#define MUX_HEADER_MIN 8
 
+static void device_packet_input(struct mux_device *dev, unsigned char *buffer, uint32_t length)
+{
 	struct mux_header *mhdr = (struct mux_header *)buffer;
-	int mux_header_size = ((dev->version < 2) ? 8 : sizeof(struct mux_header));
-	if(ntohl(mhdr->length) != length) {
-		usbmuxd_log(LL_ERROR, "Incoming packet size mismatch (dev %d, expected %d, got %d)", dev->id, ntohl(mhdr->length), length);
+	int mux_header_size = get_mux_header_size(dev);
+	if(length < (uint32_t)mux_header_size) {
+		usbmuxd_log(LL_ERROR, "Incoming packet is too small (dev %d, %d bytes)", dev->id, length);
 		return;
 	}
 
@@ -824,7 +1270,126 @@ void device_data_input(struct usb_device *usbdev, unsigned char *buffer, uint32_
 			usbmuxd_log(LL_ERROR, "Incoming packet for device %d has unknown protocol 0x%x)", dev->id, ntohl(mhdr->protocol));
 			break;
 	}
+}
+
+/*
+ * Handle data of a completed RX transfer. Usually that is exactly one mux
+ * packet, but transfers smaller than a packet (USB_MRU) split it up, and
+ * larger transfers may carry the end of one packet and the start of the
+ * next. Packets are parsed in place where possible; only the pieces of a
+ * packet spanning transfers are gathered in pktbuf.
+ */
+static void device_data_parse(struct usb_device *usbdev, struct mux_device *dev, unsigned char *buffer, uint32_t length)
+{
+
+	if(!length)
+		return;
+
+	// sanity check (should never happen with current USB implementation)
+	if(length > USB_MRU_MAX) {
+		usbmuxd_log(LL_ERROR, "Too much data received from USB (%d), file a bug", length);
+		return;
+	}
+
+	usbmuxd_log(LL_SPEW, "Mux data input for device %p: %p len %d", dev, buffer, length);
 
+	while(length > 0) {
+		uint32_t pktsize, chunk;
+
+		// handle broken up packets
+		if(dev->pktlen) {
+			if(dev->pktlen < MUX_HEADER_MIN) {
+				chunk = MUX_HEADER_MIN - dev->pktlen;
+				if(chunk > length)
+					chunk = length;
+				memcpy(dev->pktbuf + dev->pktlen, buffer, chunk);
+				dev->pktlen += chunk;
+				buffer += chunk;
+				length -= chunk;
+				if(dev->pktlen < MUX_HEADER_MIN)
+					return;
+			}
+			pktsize = ntohl(((struct mux_header *)dev->pktbuf)->length);
+			if((pktsize < MUX_HEADER_MIN) || (pktsize > DEV_MRU)) {
+				usbmuxd_log(LL_ERROR, "Incoming split packet has invalid size (dev %d, %d), dropping!", dev->id, pktsize);
+				dev->pktlen = 0;
+				return;
+			}
+			chunk = pktsize - dev->pktlen;
+			if(chunk > length)
+				chunk = length;
+			memcpy(dev->pktbuf + dev->pktlen, buffer, chunk);
+			dev->pktlen += chunk;
+			buffer += chunk;
+			length -= chunk;
+			if(dev->pktlen < pktsize) {
+				usbmuxd_log(LL_SPEW, "Appended mux data to buffer (total size: %d)", dev->pktlen);
+				return;
+			}
+			usbmuxd_log(LL_SPEW, "Gathered mux data from buffer (total size: %d)", pktsize);
+			dev->pktlen = 0;
+			device_packet_input(dev, dev->pktbuf, pktsize);
+			// a device with an unsupported version is gone now
+			if(!(dev = usb_get_mux_device(usbdev)))
+				return;
+			continue;
+		}
+
+		if(length < MUX_HEADER_MIN) {
+			memcpy(dev->pktbuf, buffer, length);
+			dev->pktlen = length;
+			return;
+		}
+		pktsize = ntohl(((struct mux_header *)buffer)->length);
+		if((pktsize < MUX_HEADER_MIN) || (pktsize > DEV_MRU)) {
+			usbmuxd_log(LL_ERROR, "Incoming packet size mismatch (dev %d, expected %d, got %d)", dev->id, pktsize, length);
+			return;
+		}
+		if(pktsize > length) {
+			memcpy(dev->pktbuf, buffer, length);
+			dev->pktlen = length;
+			usbmuxd_log(LL_SPEW, "Copied mux data to buffer (size: %d)", dev->pktlen);
+			return;
+		}
+		device_packet_input(dev, buffer, pktsize);
+		if(!(dev = usb_get_mux_device(usbdev)))
+			return;
+		buffer += pktsize;
+		length -= pktsize;
+	}
+}
+
+void device_data_input(struct usb_device *usbdev, unsigned char *buffer, uint32_t length)
+{
+	struct mux_device *dev = usb_get_mux_device(usbdev);
+	if(!dev) {
+		usbmuxd_log(LL_WARNING, "Cannot find device entry for RX input from USB device %p on location 0x%x", usbdev, usb_get_location(usbdev));
+		return;
+	}
+
+	device_data_parse(usbdev, dev, buffer, length);
+
+	// the device may have gone away while parsing
+	if((dev = usb_get_mux_device(usbdev)))
+		device_flush_acks(dev);
+}
+
+/**
+ * Called by the USB layer once TX transfers are available again after
+ * client input was paused because all of them were in flight.
+ *
+ * @param usbdev The USB device.
+ */
+void device_tx_resume(struct usb_device *usbdev)
+{
+	struct mux_device *dev = usb_get_mux_device(usbdev);
+	if(!dev || !dev->tx_blocked)
+		return;
+	dev->tx_blocked = 0;
+	FOREACH(struct mux_connection *conn, &dev->connections) {
+		if(conn->state == CONN_CONNECTED)
+			update_connection(conn);
+	} ENDFOREACH
 }
 
 int device_add(struct usb_device *usbdev)
@@ -834,15 +1399,19 @@ int device_add(struct usb_device *usbdev)
 	struct mux_device *dev;
 	usbmuxd_log(LL_NOTICE, "Connecting to new device on location 0x%x as ID %d", usb_get_location(usbdev), id);
 	dev = malloc(sizeof(struct mux_device));
+	memset(dev, 0, sizeof(struct mux_device));
 	dev->id = id;
 	dev->usbdev = usbdev;
 	dev->state = MUXDEV_INIT;
 	dev->visible = 0;
 	dev->next_sport = 1;
+	dev->sport_map[0] = 1; // port 0 is never handed out
 	dev->pktbuf = malloc(DEV_MRU);
 	dev->pktlen = 0;
 	dev->preflight_cb_data = NULL;
 	dev->version = 0;
+	dev->worker = worker_get(id);
+	usb_set_worker(usbdev, dev->worker);
 	struct version_header vh;
 	vh.major = htonl(2);
 	vh.minor = htonl(0);
@@ -854,147 +1423,221 @@ int device_add(struct usb_device *usbdev)
 		return res;
 	}
 	mutex_lock(&device_list_mutex);
-	collection_add(&device_list, dev);
+	device_registry_add(dev);
 	mutex_unlock(&device_list_mutex);
+	usb_set_mux_device(usbdev, dev);
 	return 0;
 }
 
+/**
+ * Remove the mux device of a USB device and tear down its connections.
+ * Has to run on the thread handling the device, i.e. on its worker if it
+ * has one; the USB layer queues it there.
+ *
+ * @param usbdev The USB device that is going away.
+ */
 void device_remove(struct usb_device *usbdev)
 {
+	struct mux_device *dev = usb_get_mux_device(usbdev);
+	if(!dev) {
+		usbmuxd_log(LL_WARNING, "Cannot find device entry while removing USB device %p on location 0x%x", usbdev, usb_get_location(usbdev));
+		return;
+	}
+
+	usbmuxd_log(LL_NOTICE, "Removed device %d on location 0x%x", dev->id, usb_get_location(usbdev));
+	usb_set_mux_device(usbdev, NULL);
 	mutex_lock(&device_list_mutex);
-	FOREACH(struct mux_device *dev, &device_list) {
-		if(dev->usbdev == usbdev) {
-			usbmuxd_log(LL_NOTICE, "Removed device %d on location 0x%x", dev->id, usb_get_location(usbdev));
-			if(dev->state == MUXDEV_ACTIVE) {
-				dev->state = MUXDEV_DEAD;
-				FOREACH(struct mux_connection *conn, &dev->connections) {
-					connection_teardown(conn);
-				} ENDFOREACH
-				client_device_remove(dev->id);
-				collection_free(&dev->connections);
-			}
-			if (dev->preflight_cb_data) {
-				preflight_device_remove_cb(dev->preflight_cb_data);
-			}
-			collection_remove(&device_list, dev);
-			mutex_unlock(&device_list_mutex);
-			free(dev->pktbuf);
-			free(dev);
-			return;
-		}
-	} ENDFOREACH
+	device_registry_remove(dev);
+	if (dev->preflight_cb_data) {
+		preflight_device_remove_cb(dev->preflight_cb_data);
+	}
 	mutex_unlock(&device_list_mutex);
-
-	usbmuxd_log(LL_WARNING, "Cannot find device entry while removing USB device %p on location 0x%x", usbdev, usb_get_location(usbdev));
+	if(dev->state == MUXDEV_ACTIVE) {
+		dev->state = MUXDEV_DEAD;
+		FOREACH(struct mux_connection *conn, &dev->connections) {
+			connection_teardown(conn);
+		} ENDFOREACH
+		client_device_remove(dev->id);
+		collection_free(&dev->connections);
+	}
+	conn_table_free(dev);
+	free(dev->pktbuf);
+	free(dev);
 }
 
 void device_set_visible(int device_id)
 {
+	struct mux_device *dev;
 	mutex_lock(&device_list_mutex);
-	FOREACH(struct mux_device *dev, &device_list) {
-		if(dev->id == device_id) {
-			dev->visible = 1;
-			break;
-		}
-	} ENDFOREACH
+	dev = device_registry_find_id(device_id);
+	if(dev && !dev->visible) {
+		dev->visible = 1;
+		usb_set_init_stage(dev->usbdev, USB_INIT_VISIBLE);
+	}
 	mutex_unlock(&device_list_mutex);
 }
 
 void device_set_preflight_cb_data(int device_id, void* data)
 {
+	struct mux_device *dev;
 	mutex_lock(&device_list_mutex);
-	FOREACH(struct mux_device *dev, &device_list) {
-		if(dev->id == device_id) {
-			dev->preflight_cb_data = data;
-			break;
-		}
-	} ENDFOREACH
+	dev = device_registry_find_id(device_id);
+	if(dev)
+		dev->preflight_cb_data = data;
 	mutex_unlock(&device_list_mutex);
 }
 
-int device_get_count(int include_hidden)
+/**
+ * Check whether an active device has the given serial number.
+ *
+ * @param device_id The id of the device.
+ * @param serial The serial number (UDID) to compare with.
+ * @return 1 if the device is connected and has this serial number, 0 otherwise.
+ */
+int device_has_serial(int device_id, const char *serial)
 {
-	int count = 0;
-	struct collection dev_list = {NULL, 0};
+	struct mux_device *dev;
+	const char *dev_serial;
+	int res = 0;
+	if(!serial)
+		return 0;
 	mutex_lock(&device_list_mutex);
-	collection_copy(&dev_list, &device_list);
+	dev = device_registry_find_id(device_id);
+	if(dev && dev->state == MUXDEV_ACTIVE) {
+		dev_serial = usb_get_serial(dev->usbdev);
+		res = (dev_serial && !strcmp(dev_serial, serial));
+	}
 	mutex_unlock(&device_list_mutex);
+	return res;
+}
 
-	FOREACH(struct mux_device *dev, &dev_list) {
+/**
+ * Get the worker thread handling the connections of a device.
+ *
+ * @param device_id The id of the device.
+ * @return The worker, or NULL if the device is handled on the main thread
+ *   or does not exist.
+ */
+struct worker *device_get_worker(int device_id)
+{
+	struct mux_device *dev;
+	struct worker *worker = NULL;
+	mutex_lock(&device_list_mutex);
+	dev = device_registry_find_id(device_id);
+	if(dev)
+		worker = dev->worker;
+	mutex_unlock(&device_list_mutex);
+	return worker;
+}
+
+int device_get_count(int include_hidden)
+{
+	int count = 0;
+	mutex_lock(&device_list_mutex);
+	FOREACH(struct mux_device *dev, &device_list) {
 		if((dev->state == MUXDEV_ACTIVE) && (include_hidden || dev->visible))
 			count++;
 	} ENDFOREACH
-
-	collection_free(&dev_list);
+	mutex_unlock(&device_list_mutex);
 	return count;
 }
 
+/**
+ * Get information about the connected devices. The list is filled in
+ * while holding device_list_mutex, since devices handled by a worker are
+ * freed on that thread. The serial numbers are copied behind the entries,
+ * so the list stays valid after a device is gone and is freed in one go.
+ *
+ * @param include_hidden Nonzero to include devices that are not visible yet.
+ * @param devices Set to the list, which the caller must free().
+ * @return The number of entries in the list.
+ */
 int device_get_list(int include_hidden, struct device_info **devices)
 {
 	int count = 0;
-	struct collection dev_list = {NULL, 0};
-	mutex_lock(&device_list_mutex);
-	collection_copy(&dev_list, &device_list);
-	mutex_unlock(&device_list_mutex);
+	struct device_info *p;
+	char *serials;
+	const char *serial;
 
-	*devices = malloc(sizeof(struct device_info) * dev_list.capacity);
-	struct device_info *p = *devices;
+	mutex_lock(&device_list_mutex);
+	*devices = malloc((sizeof(struct device_info) + USB_SERIAL_MAX) * device_list.capacity);
+	if(!*devices) {
+		mutex_unlock(&device_list_mutex);
+		return 0;
+	}
+	p = *devices;
+	serials = (char *)(*devices + device_list.capacity);
 
-	FOREACH(struct mux_device *dev, &dev_list) {
+	FOREACH(struct mux_device *dev, &device_list) {
 		if((dev->state == MUXDEV_ACTIVE) && (include_hidden || dev->visible)) {
 			p->id = dev->id;
-			p->serial = usb_get_serial(dev->usbdev);
+			serial = usb_get_serial(dev->usbdev);
+			snprintf(serials, USB_SERIAL_MAX, "%s", serial ? serial : "");
+			p->serial = serials;
+			serials += USB_SERIAL_MAX;
 			p->location = usb_get_location(dev->usbdev);
 			p->pid = usb_get_pid(dev->usbdev);
 			p->speed = usb_get_speed(dev->usbdev);
+			usb_get_stats(dev->usbdev, &p->usb_stats);
+			mutex_lock(&budget_mutex);
+			p->buffer_memory = dev->buffer_used;
+			mutex_unlock(&budget_mutex);
 			count++;
 			p++;
 		}
 	} ENDFOREACH
-
-	collection_free(&dev_list);
+	mutex_unlock(&device_list_mutex);
 
 	return count;
 }
 
+void device_get_budget_stats(struct buffer_budget_stats *stats)
+{
+	mutex_lock(&budget_mutex);
+	stats->used = buffer_used;
+	stats->budget = buffer_budget;
+	stats->device_budget = device_buffer_budget;
+	stats->refused = buffer_refused;
+	mutex_unlock(&budget_mutex);
+}
+
 int device_get_timeout(void)
 {
-	uint64_t oldest = (uint64_t)-1LL;
-	mutex_lock(&device_list_mutex);
-	FOREACH(struct mux_device *dev, &device_list) {
-		if(dev->state == MUXDEV_ACTIVE) {
-			FOREACH(struct mux_connection *conn, &dev->connections) {
-				if((conn->state == CONN_CONNECTED) && (conn->flags & CONN_ACK_PENDING) && conn->last_ack_time < oldest)
-					oldest = conn->last_ack_time;
-			} ENDFOREACH
-		}
-	} ENDFOREACH
-	mutex_unlock(&device_list_mutex);
-	uint64_t ct = mstime64();
-	if((int64_t)oldest == -1LL)
-		return 100000; //meh
-	if((ct - oldest) > ACK_TIMEOUT)
-		return 0;
-	return ACK_TIMEOUT - (ct - oldest);
+	return timer_queue_get_timeout(&ack_timers, mstime64(), 100000); //meh
 }
 
 void device_check_timeouts(void)
 {
-	uint64_t ct = mstime64();
-	mutex_lock(&device_list_mutex);
-	FOREACH(struct mux_device *dev, &device_list) {
-		if(dev->state == MUXDEV_ACTIVE) {
-			FOREACH(struct mux_connection *conn, &dev->connections) {
-				if((conn->state == CONN_CONNECTED) &&
-						(conn->flags & CONN_ACK_PENDING) &&
-						(ct - conn->last_ack_time) > ACK_TIMEOUT) {
-					usbmuxd_log(LL_DEBUG, "Sending ACK due to expired timeout (%" PRIu64 " -> %" PRIu64 ")", conn->last_ack_time, ct);
-					send_tcp_ack(conn);
-				}
-			} ENDFOREACH
-		}
-	} ENDFOREACH
-	mutex_unlock(&device_list_mutex);
+	timer_queue_run(&ack_timers, mstime64());
+}
+
+static uint32_t parse_window(const char *name, uint32_t def)
+{
+	const char *env = getenv(name);
+	long val;
+	if(!env)
+		return def;
+	val = strtol(env, NULL, 10);
+	if(val < CONN_WIN_FLOOR || val > CONN_WIN_LIMIT) {
+		usbmuxd_log(LL_WARNING, "Ignoring invalid value '%s' for %s (%d-%d)", env, name, CONN_WIN_FLOOR, CONN_WIN_LIMIT);
+		return def;
+	}
+	// the window is sent in units of 256 bytes
+	return (uint32_t)val & ~255U;
+}
+
+static uint64_t parse_budget(const char *name, uint64_t def)
+{
+	const char *env = getenv(name);
+	long val;
+	if(!env)
+		return def * 1024;
+	val = strtol(env, NULL, 10);
+	if(val < 0) {
+		usbmuxd_log(LL_WARNING, "Ignoring invalid value '%s' for %s", env, name);
+		return def * 1024;
+	}
+	return (uint64_t)val * 1024;
 }
 
 void device_init(void)
@@ -1002,36 +1645,121 @@ void device_init(void)
 	usbmuxd_log(LL_DEBUG, "device_init");
 	collection_init(&device_list);
 	mutex_init(&device_list_mutex);
+	timer_queue_init(&ack_timers);
+	mutex_init(&budget_mutex);
 	next_device_id = 1;
+
+	const char *policy = getenv(ENV_ACK_POLICY);
+	if(policy) {
+		if(!strcmp(policy, "immediate"))
+			ack_policy = ACK_POLICY_IMMEDIATE;
+		else if(!strcmp(policy, "delayed"))
+			ack_policy = ACK_POLICY_DELAYED;
+		else
+			usbmuxd_log(LL_WARNING, "Ignoring unknown value '%s' for %s", policy, ENV_ACK_POLICY);
+	}
+
+	conn_win_min = parse_window(ENV_CONN_WINDOW_MIN, CONN_WIN_MIN);
+	conn_win_max = parse_window(ENV_CONN_WINDOW_MAX, CONN_WIN_MAX);
+	if(conn_win_max < conn_win_min)
+		conn_win_max = conn_win_min;
+	usbmuxd_log(LL_INFO, "Connection receive window between %u and %u bytes", conn_win_min, conn_win_max);
+
+	buffer_budget = parse_budget(ENV_BUFFER_BUDGET, BUFFER_BUDGET);
+	device_buffer_budget = parse_budget(ENV_DEVICE_BUFFER_BUDGET, DEVICE_BUFFER_BUDGET);
+	usbmuxd_log(LL_INFO, "Connection buffer budget %" PRIu64 " KiB, %" PRIu64 " KiB per device (0 is unlimited)", buffer_budget / 1024, device_buffer_budget / 1024);
 }
 
-void device_kill_connections(void)
+static void device_kill_worker_connections(void *data)
 {
-	usbmuxd_log(LL_DEBUG, "device_kill_connections");
+	struct worker *worker = data;
+	struct collection dev_list;
+
+	// devices are only freed on their worker thread, so the copy stays valid
+	collection_init(&dev_list);
+	mutex_lock(&device_list_mutex);
 	FOREACH(struct mux_device *dev, &device_list) {
+		if(dev->worker == worker)
+			collection_add(&dev_list, dev);
+	} ENDFOREACH
+	mutex_unlock(&device_list_mutex);
+
+	FOREACH(struct mux_device *dev, &dev_list) {
 		if(dev->state != MUXDEV_INIT) {
 			FOREACH(struct mux_connection *conn, &dev->connections) {
 				connection_teardown(conn);
 			} ENDFOREACH
 		}
 	} ENDFOREACH
+	collection_free(&dev_list);
+	// the loop and timers of this worker are freed when it exits
+	client_detach_worker(worker);
+}
+
+void device_kill_connections(void)
+{
+	int i;
+	usbmuxd_log(LL_DEBUG, "device_kill_connections");
+	connections_killed = 1;
+	if(worker_get_count() > 0) {
+		for(i = 0; i < worker_get_count(); i++) {
+			worker_call(worker_get(i), device_kill_worker_connections, worker_get(i));
+		}
+	} else {
+		FOREACH(struct mux_device *dev, &device_list) {
+			if(dev->state != MUXDEV_INIT) {
+				FOREACH(struct mux_connection *conn, &dev->connections) {
+					connection_teardown(conn);
+				} ENDFOREACH
+			}
+		} ENDFOREACH
+	}
 	// give USB a while to send the final connection RSTs and the like
 	usb_process_timeout(100);
 }
 
-void device_shutdown(void)
+// Free a device that outlived usb_shutdown(), on the thread owning its connections
+static void device_free_job(void *data)
 {
-	usbmuxd_log(LL_DEBUG, "device_shutdown");
-	mutex_lock(&device_list_mutex);
-	FOREACH(struct mux_device *dev, &device_list) {
+	struct mux_device *dev = data;
+	if(dev->state == MUXDEV_ACTIVE) {
+		// the USB device is released already, so no RST goes out
+		dev->state = MUXDEV_DEAD;
 		FOREACH(struct mux_connection *conn, &dev->connections) {
 			connection_teardown(conn);
 		} ENDFOREACH
 		collection_free(&dev->connections);
-		collection_remove(&device_list, dev);
-		free(dev);
+	}
+	conn_table_free(dev);
+	free(dev->pktbuf);
+	free(dev);
+}
+
+/**
+ * Free the devices left after usb_shutdown(). Must run before
+ * worker_shutdown(), since each device is freed on its worker.
+ */
+void device_shutdown(void)
+{
+	struct collection dev_list;
+	usbmuxd_log(LL_DEBUG, "device_shutdown");
+	collection_init(&dev_list);
+	mutex_lock(&device_list_mutex);
+	FOREACH(struct mux_device *dev, &device_list) {
+		device_registry_remove(dev);
+		collection_add(&dev_list, dev);
 	} ENDFOREACH
 	mutex_unlock(&device_list_mutex);
+
+	FOREACH(struct mux_device *dev, &dev_list) {
+		if(dev->worker)
+			worker_call(dev->worker, device_free_job, dev);
+		else
+			device_free_job(dev);
+	} ENDFOREACH
+	collection_free(&dev_list);
+	timer_queue_free(&ack_timers);
 	mutex_destroy(&device_list_mutex);
+	mutex_destroy(&budget_mutex);
 	collection_free(&device_list);
 }
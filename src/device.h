@@ -23,28 +23,49 @@
 #include "usb.h"
 #include "client.h"
 
+struct worker;
+
+#define ENV_ACK_POLICY "USBMUXD_ACK_POLICY"
+#define ENV_CONN_WINDOW_MIN "USBMUXD_CONN_WINDOW_MIN"
+#define ENV_CONN_WINDOW_MAX "USBMUXD_CONN_WINDOW_MAX"
+#define ENV_BUFFER_BUDGET "USBMUXD_BUFFER_BUDGET"
+#define ENV_DEVICE_BUFFER_BUDGET "USBMUXD_DEVICE_BUFFER_BUDGET"
+
 struct device_info {
 	int id;
 	const char *serial;
 	uint32_t location;
 	uint16_t pid;
 	uint64_t speed;
+	struct usb_stats usb_stats;
+	uint64_t buffer_memory; // bytes of connection buffers
+};
+
+struct buffer_budget_stats {
+	uint64_t used; // bytes of connection buffers of all devices
+	uint64_t budget; // limit for all devices, 0 if unlimited
+	uint64_t device_budget; // limit for each device, 0 if unlimited
+	uint64_t refused; // connections refused because a limit was reached
 };
 
 void device_data_input(struct usb_device *dev, unsigned char *buf, uint32_t length);
+void device_tx_resume(struct usb_device *dev);
 
 int device_add(struct usb_device *dev);
 void device_remove(struct usb_device *dev);
 
 int device_start_connect(int device_id, uint16_t port, struct mux_client *client);
-void device_client_process(int device_id, struct mux_client *client, short events);
-void device_abort_connect(int device_id, struct mux_client *client);
+void device_client_process(struct mux_connection *conn, short events);
+void device_abort_connect(struct mux_connection *conn);
 
 void device_set_visible(int device_id);
 void device_set_preflight_cb_data(int device_id, void* data);
+int device_has_serial(int device_id, const char *serial);
+struct worker *device_get_worker(int device_id);
 
 int device_get_count(int include_hidden);
 int device_get_list(int include_hidden, struct device_info **devices);
+void device_get_budget_stats(struct buffer_budget_stats *stats);
 
 int device_get_timeout(void);
 void device_check_timeouts(void);
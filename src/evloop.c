@@ -0,0 +1,853 @@
+/*
+ * evloop.c
+ *
+ * Copyright (C) 2026 usbmuxd contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#define _GNU_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
+#include <libimobiledevice-glue/thread.h>
+
+#include "evloop.h"
+#include "log.h"
+#ifdef HAVE_LIBURING
+#include "uring.h"
+#endif
+
+// maximum number of events returned by a single epoll_wait() call
+#define EPOLL_MAX_EVENTS 256
+
+/*
+ * File descriptors are registered once and stay registered until they are
+ * removed again; interest masks are only touched when they change.
+ * With the epoll backend the kernel keeps the interest list, with the ppoll
+ * backend a persistent pollfd array is maintained instead of rebuilding it
+ * on every main loop iteration.
+ */
+struct evloop_fd {
+	int used;
+	enum fdowner owner;
+	short events;
+	void *data;
+	int pos; // index into pollfds (ppoll backend only)
+#ifdef HAVE_LIBURING
+	struct uring_sock *usock; // I/O handled by io_uring, not polled
+#endif
+};
+
+struct evloop {
+	enum evloop_backend backend;
+	mutex_t mutex;
+
+	// dense table indexed by fd
+	struct evloop_fd *fdtab;
+	int fdtab_size;
+	int fd_count;
+
+	// ppoll backend
+	struct fdlist pollfds;
+	struct pollfd *pollfds_scratch;
+	int pollfds_scratch_capacity;
+
+#ifdef HAVE_SYS_EPOLL_H
+	int epfd;
+	struct epoll_event epevents[EPOLL_MAX_EVENTS];
+#endif
+
+	// events returned by the last evloop_wait() call
+	struct evloop_event *ready;
+	int ready_count;
+	int ready_capacity;
+
+	// self-pipe used by evloop_wakeup()
+	int wakeup_fds[2];
+	int wakeup_pending;
+	int waiting;
+
+#ifdef HAVE_LIBURING
+	struct uring *uring;
+#endif
+};
+
+static enum evloop_backend backend = EVLOOP_BACKEND_PPOLL;
+static int use_uring = 0;
+
+struct evloop *main_evloop = NULL;
+
+#ifndef HAVE_PPOLL
+static int ppoll(struct pollfd *fds, nfds_t nfds, const struct timespec *timeout, const sigset_t *sigmask)
+{
+	int ready;
+	sigset_t origmask;
+	int to = timeout->tv_sec*1000 + timeout->tv_nsec/1000000;
+
+	sigprocmask(SIG_SETMASK, sigmask, &origmask);
+	ready = poll(fds, nfds, to);
+	sigprocmask(SIG_SETMASK, &origmask, NULL);
+
+	return ready;
+}
+#endif
+
+#ifdef HAVE_SYS_EPOLL_H
+static uint32_t poll_to_epoll(short events)
+{
+	uint32_t res = 0;
+	if (events & POLLIN)
+		res |= EPOLLIN;
+	if (events & POLLOUT)
+		res |= EPOLLOUT;
+	if (events & POLLPRI)
+		res |= EPOLLPRI;
+	return res;
+}
+
+static short epoll_to_poll(uint32_t events)
+{
+	short res = 0;
+	if (events & EPOLLIN)
+		res |= POLLIN;
+	if (events & EPOLLOUT)
+		res |= POLLOUT;
+	if (events & EPOLLPRI)
+		res |= POLLPRI;
+	if (events & EPOLLERR)
+		res |= POLLERR;
+	if (events & EPOLLHUP)
+		res |= POLLHUP;
+	return res;
+}
+#endif
+
+static int fdtab_reserve(struct evloop *loop, int fd)
+{
+	struct evloop_fd *new_tab;
+	int new_size;
+
+	if (fd < loop->fdtab_size)
+		return 0;
+
+	new_size = (loop->fdtab_size > 0) ? loop->fdtab_size : 64;
+	while (new_size <= fd)
+		new_size *= 2;
+	new_tab = realloc(loop->fdtab, sizeof(struct evloop_fd) * new_size);
+	if (!new_tab) {
+		usbmuxd_log(LL_FATAL, "%s: Failed to realloc.", __func__);
+		return -1;
+	}
+	memset(new_tab + loop->fdtab_size, 0, sizeof(struct evloop_fd) * (new_size - loop->fdtab_size));
+	loop->fdtab = new_tab;
+	loop->fdtab_size = new_size;
+	return 0;
+}
+
+static int ready_reserve(struct evloop *loop, int count)
+{
+	struct evloop_event *new_ready;
+	if (count <= loop->ready_capacity)
+		return 0;
+	new_ready = realloc(loop->ready, sizeof(struct evloop_event) * count);
+	if (!new_ready) {
+		usbmuxd_log(LL_FATAL, "%s: Failed to realloc.", __func__);
+		return -1;
+	}
+	loop->ready = new_ready;
+	loop->ready_capacity = count;
+	return 0;
+}
+
+/**
+ * Select the event backend and create the main event loop. epoll is used
+ * when it is available, unless the USBMUXD_EVENT_BACKEND environment
+ * variable is set to "ppoll".
+ *
+ * @return 0 on success, -1 on error.
+ */
+int evloop_init(void)
+{
+	const char *env_backend = getenv(ENV_EVENT_BACKEND);
+	const char *env_uring;
+
+	backend = EVLOOP_BACKEND_PPOLL;
+#ifdef HAVE_SYS_EPOLL_H
+	if (!env_backend || strcmp(env_backend, "ppoll") != 0) {
+		backend = EVLOOP_BACKEND_EPOLL;
+	}
+#else
+	if (env_backend && strcmp(env_backend, "ppoll") != 0) {
+		usbmuxd_log(LL_WARNING, "Event backend '%s' is not supported on this platform, using ppoll", env_backend);
+	}
+#endif
+
+	use_uring = 0;
+	env_uring = getenv(ENV_IO_URING);
+	if (env_uring && strcmp(env_uring, "0") != 0) {
+#ifdef HAVE_LIBURING
+		use_uring = 1;
+#else
+		usbmuxd_log(LL_WARNING, "io_uring support is not available in this build");
+#endif
+	}
+
+	main_evloop = evloop_new();
+	if (!main_evloop)
+		return -1;
+	backend = main_evloop->backend;
+
+	usbmuxd_log(LL_INFO, "Using %s event backend", evloop_get_backend_name());
+#ifdef HAVE_LIBURING
+	if (main_evloop->uring) {
+		usbmuxd_log(LL_INFO, "Using io_uring for connected client sockets");
+	} else {
+		use_uring = 0;
+	}
+#endif
+	return 0;
+}
+
+void evloop_shutdown(void)
+{
+	evloop_free(main_evloop);
+	main_evloop = NULL;
+}
+
+/**
+ * Create a new event loop instance using the backend selected by
+ * evloop_init().
+ *
+ * @return The new event loop, or NULL on error.
+ */
+struct evloop *evloop_new(void)
+{
+	int i;
+	struct evloop *loop = malloc(sizeof(struct evloop));
+	if (!loop) {
+		usbmuxd_log(LL_FATAL, "%s: Failed to allocate event loop.", __func__);
+		return NULL;
+	}
+	memset(loop, 0, sizeof(struct evloop));
+	mutex_init(&loop->mutex);
+	fdlist_create(&loop->pollfds);
+	loop->backend = EVLOOP_BACKEND_PPOLL;
+
+#ifdef HAVE_SYS_EPOLL_H
+	loop->epfd = -1;
+	if (backend == EVLOOP_BACKEND_EPOLL) {
+		loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (loop->epfd < 0) {
+			usbmuxd_log(LL_WARNING, "epoll_create1() failed: %s. Falling back to ppoll.", strerror(errno));
+		} else {
+			loop->backend = EVLOOP_BACKEND_EPOLL;
+		}
+	}
+#endif
+
+	loop->wakeup_fds[0] = loop->wakeup_fds[1] = -1;
+	if (pipe(loop->wakeup_fds) < 0) {
+		usbmuxd_log(LL_ERROR, "%s: pipe() failed: %s", __func__, strerror(errno));
+		evloop_free(loop);
+		return NULL;
+	}
+	for (i = 0; i < 2; i++) {
+		fcntl(loop->wakeup_fds[i], F_SETFL, fcntl(loop->wakeup_fds[i], F_GETFL, 0) | O_NONBLOCK);
+		fcntl(loop->wakeup_fds[i], F_SETFD, FD_CLOEXEC);
+	}
+	if (evloop_add(loop, loop->wakeup_fds[0], FD_WAKEUP, POLLIN, NULL) < 0) {
+		evloop_free(loop);
+		return NULL;
+	}
+
+#ifdef HAVE_LIBURING
+	if (use_uring) {
+		loop->uring = uring_new();
+		if (!loop->uring) {
+			usbmuxd_log(LL_WARNING, "Falling back to %s for client sockets", loop->backend == EVLOOP_BACKEND_EPOLL ? "epoll" : "ppoll");
+		} else if (evloop_add(loop, uring_get_fd(loop->uring), FD_URING, POLLIN, NULL) < 0) {
+			uring_free(loop->uring);
+			loop->uring = NULL;
+		}
+	}
+#endif
+
+	return loop;
+}
+
+void evloop_free(struct evloop *loop)
+{
+	if (!loop)
+		return;
+	if (loop->wakeup_fds[0] >= 0) {
+		close(loop->wakeup_fds[0]);
+		close(loop->wakeup_fds[1]);
+	}
+#ifdef HAVE_LIBURING
+	uring_free(loop->uring);
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+	if (loop->epfd >= 0) {
+		close(loop->epfd);
+	}
+#endif
+	fdlist_free(&loop->pollfds);
+	free(loop->pollfds_scratch);
+	free(loop->fdtab);
+	free(loop->ready);
+	mutex_destroy(&loop->mutex);
+	free(loop);
+}
+
+const char *evloop_get_backend_name(void)
+{
+	switch (backend) {
+		case EVLOOP_BACKEND_EPOLL:
+			return "epoll";
+		case EVLOOP_BACKEND_PPOLL:
+		default:
+			return "ppoll";
+	}
+}
+
+/**
+ * Register a file descriptor with an event loop.
+ *
+ * @param loop The event loop.
+ * @param fd The file descriptor to watch.
+ * @param owner Which subsystem the fd belongs to.
+ * @param events Initial poll event mask (POLLIN/POLLOUT).
+ * @param data Opaque pointer returned with every event for this fd.
+ * @return 0 on success, -1 on error.
+ */
+int evloop_add(struct evloop *loop, int fd, enum fdowner owner, short events, void *data)
+{
+	struct evloop_fd *efd;
+	int wakeup;
+
+	if (fd < 0)
+		return -1;
+
+	mutex_lock(&loop->mutex);
+	if (fdtab_reserve(loop, fd) < 0) {
+		mutex_unlock(&loop->mutex);
+		return -1;
+	}
+	efd = &loop->fdtab[fd];
+	if (efd->used) {
+		usbmuxd_log(LL_WARNING, "%s: fd %d is already registered", __func__, fd);
+		mutex_unlock(&loop->mutex);
+		return -1;
+	}
+
+#ifdef HAVE_SYS_EPOLL_H
+	if (loop->backend == EVLOOP_BACKEND_EPOLL) {
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = poll_to_epoll(events);
+		ev.data.fd = fd;
+		if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			usbmuxd_log(LL_ERROR, "%s: epoll_ctl(ADD) for fd %d failed: %s", __func__, fd, strerror(errno));
+			mutex_unlock(&loop->mutex);
+			return -1;
+		}
+	} else
+#endif
+	{
+		efd->pos = loop->pollfds.count;
+		fdlist_add(&loop->pollfds, owner, fd, events);
+	}
+
+	efd->used = 1;
+	efd->owner = owner;
+	efd->events = events;
+	efd->data = data;
+	loop->fd_count++;
+	// a ppoll() already in progress would not see the new fd
+	wakeup = (loop->backend == EVLOOP_BACKEND_PPOLL && loop->waiting);
+	mutex_unlock(&loop->mutex);
+
+	if (wakeup)
+		evloop_wakeup(loop);
+
+	return 0;
+}
+
+/**
+ * Change the poll event mask of a registered file descriptor.
+ * This is a no-op if the mask did not change. Unlike evloop_remove()
+ * this may be called from any thread.
+ *
+ * @param loop The event loop the fd is registered with.
+ * @param fd The file descriptor to update.
+ * @param events The new event mask. Replaces the current mask.
+ * @return 0 on success, -1 on error.
+ */
+int evloop_modify(struct evloop *loop, int fd, short events)
+{
+	int res = 0;
+	int wakeup = 0;
+
+	mutex_lock(&loop->mutex);
+	if (fd < 0 || fd >= loop->fdtab_size || !loop->fdtab[fd].used) {
+		mutex_unlock(&loop->mutex);
+		return -1;
+	}
+	if (loop->fdtab[fd].events == events) {
+		mutex_unlock(&loop->mutex);
+		return 0;
+	}
+
+#ifdef HAVE_LIBURING
+	if (loop->fdtab[fd].usock) {
+		uring_sock_set_events(loop->fdtab[fd].usock, events);
+		// readiness of the socket is only reported after waiting
+		wakeup = loop->waiting && (events & ~loop->fdtab[fd].events);
+	} else
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+	if (loop->backend == EVLOOP_BACKEND_EPOLL) {
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = poll_to_epoll(events);
+		ev.data.fd = fd;
+		if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+			usbmuxd_log(LL_ERROR, "%s: epoll_ctl(MOD) for fd %d failed: %s", __func__, fd, strerror(errno));
+			res = -1;
+		}
+	} else
+#endif
+	{
+		loop->pollfds.fds[loop->fdtab[fd].pos].events = events;
+		// a ppoll() already in progress works on a copy of the old mask
+		wakeup = loop->waiting && (events & ~loop->fdtab[fd].events);
+	}
+	if (res == 0)
+		loop->fdtab[fd].events = events;
+	mutex_unlock(&loop->mutex);
+
+	if (wakeup)
+		evloop_wakeup(loop);
+
+	return res;
+}
+
+// stop polling fd for readiness; caller must hold the loop mutex
+static void evloop_unpoll(struct evloop *loop, int fd)
+{
+#ifdef HAVE_SYS_EPOLL_H
+	if (loop->backend == EVLOOP_BACKEND_EPOLL) {
+		if (epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL) < 0 && errno != EBADF && errno != ENOENT) {
+			usbmuxd_log(LL_WARNING, "%s: epoll_ctl(DEL) for fd %d failed: %s", __func__, fd, strerror(errno));
+		}
+	} else
+#endif
+	{
+		struct fdlist *pollfds = &loop->pollfds;
+		int pos = loop->fdtab[fd].pos;
+		int last = pollfds->count - 1;
+		if (pos != last) {
+			pollfds->fds[pos] = pollfds->fds[last];
+			pollfds->owners[pos] = pollfds->owners[last];
+			loop->fdtab[pollfds->fds[pos].fd].pos = pos;
+		}
+		pollfds->count--;
+	}
+}
+
+/**
+ * Unregister a file descriptor. This has to be called before the fd is
+ * closed, from the thread running the loop or while that thread is known
+ * not to dispatch events. Events for this fd that were returned by the
+ * current evloop_wait() call but not dispatched yet are invalidated, so a
+ * reused fd number will not see stale events.
+ *
+ * @param loop The event loop the fd is registered with.
+ * @param fd The file descriptor to remove.
+ */
+void evloop_remove(struct evloop *loop, int fd)
+{
+	int i;
+
+	mutex_lock(&loop->mutex);
+	if (fd < 0 || fd >= loop->fdtab_size || !loop->fdtab[fd].used) {
+		mutex_unlock(&loop->mutex);
+		return;
+	}
+
+#ifdef HAVE_LIBURING
+	if (loop->fdtab[fd].usock) {
+		uring_sock_release(loop->fdtab[fd].usock);
+	} else
+#endif
+	evloop_unpoll(loop, fd);
+
+	memset(&loop->fdtab[fd], 0, sizeof(struct evloop_fd));
+	loop->fd_count--;
+
+	for (i = 0; i < loop->ready_count; i++) {
+		if (loop->ready[i].fd == fd) {
+			loop->ready[i].revents = 0;
+		}
+	}
+	mutex_unlock(&loop->mutex);
+}
+
+int evloop_get_count(struct evloop *loop)
+{
+	return loop->fd_count;
+}
+
+/**
+ * Hand the data transfer of a registered socket over to io_uring, if it
+ * is enabled for this loop. The fd is no longer polled for readiness;
+ * events are reported based on data received and queued by the ring
+ * instead. Reads and writes must go through evloop_recv() and
+ * evloop_send() from then on. May only be called from the loop's thread.
+ *
+ * @param loop The event loop the fd is registered with.
+ * @param fd The connected socket.
+ * @return 0 if io_uring handles the socket now, -1 if it keeps
+ *   being polled.
+ */
+int evloop_attach_uring(struct evloop *loop, int fd)
+{
+#ifdef HAVE_LIBURING
+	struct evloop_fd *efd;
+
+	if (!loop->uring)
+		return -1;
+
+	mutex_lock(&loop->mutex);
+	if (fd < 0 || fd >= loop->fdtab_size || !loop->fdtab[fd].used) {
+		mutex_unlock(&loop->mutex);
+		return -1;
+	}
+	efd = &loop->fdtab[fd];
+	if (!efd->usock) {
+		efd->usock = uring_sock_new(loop->uring, fd, efd->events);
+		if (!efd->usock) {
+			mutex_unlock(&loop->mutex);
+			return -1;
+		}
+		evloop_unpoll(loop, fd);
+	}
+	mutex_unlock(&loop->mutex);
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+/**
+ * Receive from a registered socket, like recv() without flags.
+ */
+ssize_t evloop_recv(struct evloop *loop, int fd, void *buf, size_t len)
+{
+#ifdef HAVE_LIBURING
+	if (loop->uring) {
+		ssize_t res;
+		mutex_lock(&loop->mutex);
+		if (fd >= 0 && fd < loop->fdtab_size && loop->fdtab[fd].usock) {
+			res = uring_sock_recv(loop->fdtab[fd].usock, buf, len);
+			mutex_unlock(&loop->mutex);
+			return res;
+		}
+		mutex_unlock(&loop->mutex);
+	}
+#endif
+	return recv(fd, buf, len, 0);
+}
+
+/**
+ * Send on a registered socket, like send() on a non-blocking socket.
+ */
+ssize_t evloop_send(struct evloop *loop, int fd, const void *buf, size_t len)
+{
+#ifdef HAVE_LIBURING
+	if (loop->uring) {
+		ssize_t res;
+		mutex_lock(&loop->mutex);
+		if (fd >= 0 && fd < loop->fdtab_size && loop->fdtab[fd].usock) {
+			res = uring_sock_send(loop->fdtab[fd].usock, buf, len);
+			mutex_unlock(&loop->mutex);
+			return res;
+		}
+		mutex_unlock(&loop->mutex);
+	}
+#endif
+	return send(fd, buf, len, 0);
+}
+
+/**
+ * Send several buffers on a registered socket, like writev().
+ */
+ssize_t evloop_sendv(struct evloop *loop, int fd, const struct iovec *iov, int iovcnt)
+{
+#ifdef HAVE_LIBURING
+	if (loop->uring) {
+		ssize_t res = 0;
+		int i;
+		mutex_lock(&loop->mutex);
+		if (fd >= 0 && fd < loop->fdtab_size && loop->fdtab[fd].usock) {
+			// stop at the first buffer the socket did not take completely
+			for (i = 0; i < iovcnt; i++) {
+				ssize_t sent = uring_sock_send(loop->fdtab[fd].usock, iov[i].iov_base, iov[i].iov_len);
+				if (sent < 0) {
+					if (res == 0)
+						res = -1;
+					break;
+				}
+				res += sent;
+				if ((size_t)sent < iov[i].iov_len)
+					break;
+			}
+			mutex_unlock(&loop->mutex);
+			return res;
+		}
+		mutex_unlock(&loop->mutex);
+	}
+#endif
+	return writev(fd, iov, iovcnt);
+}
+
+/**
+ * @return The number of bytes accepted by evloop_send() or evloop_sendv()
+ *   for a registered socket that were not written to it yet. Always 0
+ *   unless io_uring handles the socket.
+ */
+size_t evloop_get_queued(struct evloop *loop, int fd)
+{
+	size_t queued = 0;
+#ifdef HAVE_LIBURING
+	if (loop->uring) {
+		mutex_lock(&loop->mutex);
+		if (fd >= 0 && fd < loop->fdtab_size && loop->fdtab[fd].usock)
+			queued = uring_sock_get_queued(loop->fdtab[fd].usock);
+		mutex_unlock(&loop->mutex);
+	}
+#endif
+	return queued;
+}
+
+/**
+ * Interrupt an evloop_wait() call that is in progress on another thread,
+ * or make the next one return immediately. May be called from any thread.
+ *
+ * @param loop The event loop to wake up.
+ */
+void evloop_wakeup(struct evloop *loop)
+{
+	mutex_lock(&loop->mutex);
+	if (!loop->wakeup_pending) {
+		char c = 0;
+		loop->wakeup_pending = 1;
+		if (write(loop->wakeup_fds[1], &c, 1) < 0 && errno != EAGAIN) {
+			usbmuxd_log(LL_WARNING, "%s: write() failed: %s", __func__, strerror(errno));
+		}
+	}
+	mutex_unlock(&loop->mutex);
+}
+
+// caller must hold the loop mutex
+static void evloop_drain_wakeup(struct evloop *loop)
+{
+	char buf[16];
+	while (read(loop->wakeup_fds[0], buf, sizeof(buf)) > 0);
+	loop->wakeup_pending = 0;
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+static int evloop_wait_epoll(struct evloop *loop, int timeout, const sigset_t *sigmask)
+{
+	int cnt, i;
+
+	cnt = epoll_pwait(loop->epfd, loop->epevents, EPOLL_MAX_EVENTS, timeout, sigmask);
+	if (cnt <= 0)
+		return cnt;
+
+	mutex_lock(&loop->mutex);
+	if (ready_reserve(loop, cnt) < 0) {
+		mutex_unlock(&loop->mutex);
+		errno = ENOMEM;
+		return -1;
+	}
+	loop->ready_count = 0;
+	for (i = 0; i < cnt; i++) {
+		int fd = loop->epevents[i].data.fd;
+		struct evloop_event *ev;
+		if (fd >= loop->fdtab_size || !loop->fdtab[fd].used)
+			continue;
+		if (fd == loop->wakeup_fds[0]) {
+			evloop_drain_wakeup(loop);
+			continue;
+		}
+		if (loop->fdtab[fd].owner == FD_URING)
+			continue; // completions are reaped after waiting
+		ev = &loop->ready[loop->ready_count++];
+		ev->fd = fd;
+		ev->owner = loop->fdtab[fd].owner;
+		ev->data = loop->fdtab[fd].data;
+		ev->revents = epoll_to_poll(loop->epevents[i].events);
+	}
+	mutex_unlock(&loop->mutex);
+
+	return loop->ready_count;
+}
+#endif
+
+static int evloop_wait_ppoll(struct evloop *loop, int timeout, const sigset_t *sigmask)
+{
+	struct timespec tspec;
+	int count, cnt, i;
+
+	// work on a copy so other threads can safely update event masks
+	mutex_lock(&loop->mutex);
+	count = loop->pollfds.count;
+	if (count > loop->pollfds_scratch_capacity) {
+		struct pollfd *new_scratch = realloc(loop->pollfds_scratch, sizeof(struct pollfd) * loop->pollfds.capacity);
+		if (!new_scratch) {
+			usbmuxd_log(LL_FATAL, "%s: Failed to realloc.", __func__);
+			mutex_unlock(&loop->mutex);
+			errno = ENOMEM;
+			return -1;
+		}
+		loop->pollfds_scratch = new_scratch;
+		loop->pollfds_scratch_capacity = loop->pollfds.capacity;
+	}
+	memcpy(loop->pollfds_scratch, loop->pollfds.fds, sizeof(struct pollfd) * count);
+	mutex_unlock(&loop->mutex);
+
+	tspec.tv_sec = timeout / 1000;
+	tspec.tv_nsec = (timeout % 1000) * 1000000;
+	cnt = ppoll(loop->pollfds_scratch, count, &tspec, sigmask);
+	if (cnt <= 0)
+		return cnt;
+
+	mutex_lock(&loop->mutex);
+	if (ready_reserve(loop, cnt) < 0) {
+		mutex_unlock(&loop->mutex);
+		errno = ENOMEM;
+		return -1;
+	}
+	loop->ready_count = 0;
+	for (i = 0; i < count && loop->ready_count < cnt; i++) {
+		struct pollfd *pfd = &loop->pollfds_scratch[i];
+		struct evloop_event *ev;
+		if (!pfd->revents)
+			continue;
+		if (pfd->fd >= loop->fdtab_size || !loop->fdtab[pfd->fd].used)
+			continue;
+		if (pfd->fd == loop->wakeup_fds[0]) {
+			evloop_drain_wakeup(loop);
+			continue;
+		}
+		if (loop->fdtab[pfd->fd].owner == FD_URING)
+			continue; // completions are reaped after waiting
+		ev = &loop->ready[loop->ready_count++];
+		ev->fd = pfd->fd;
+		ev->owner = loop->fdtab[pfd->fd].owner;
+		ev->data = loop->fdtab[pfd->fd].data;
+		ev->revents = pfd->revents;
+	}
+	mutex_unlock(&loop->mutex);
+
+	return loop->ready_count;
+}
+
+#ifdef HAVE_LIBURING
+// append events of sockets handled by io_uring to the ready list
+static int evloop_collect_uring(struct evloop *loop)
+{
+	int i, first, cnt;
+
+	mutex_lock(&loop->mutex);
+	uring_reap(loop->uring);
+	cnt = uring_get_ready_count(loop->uring);
+	if (cnt > 0 && ready_reserve(loop, loop->ready_count + cnt) == 0) {
+		first = loop->ready_count;
+		loop->ready_count += uring_collect(loop->uring, loop->ready + first, cnt);
+		for (i = first; i < loop->ready_count; i++) {
+			loop->ready[i].owner = loop->fdtab[loop->ready[i].fd].owner;
+			loop->ready[i].data = loop->fdtab[loop->ready[i].fd].data;
+		}
+	}
+	cnt = loop->ready_count;
+	mutex_unlock(&loop->mutex);
+
+	return cnt;
+}
+#endif
+
+/**
+ * Wait for events on the registered file descriptors.
+ *
+ * @param loop The event loop to wait on.
+ * @param timeout Maximum time to wait in milliseconds.
+ * @param sigmask Signal mask to apply while waiting, like ppoll().
+ * @param events Will point to the array of ready events. Entries with
+ *   revents == 0 have been invalidated by evloop_remove() and must be
+ *   skipped. The array is valid until the next call.
+ * @return The number of entries in the events array, 0 on timeout or
+ *   -1 on error in which case errno will be set.
+ */
+int evloop_wait(struct evloop *loop, int timeout, const sigset_t *sigmask, struct evloop_event **events)
+{
+	int cnt;
+
+	mutex_lock(&loop->mutex);
+	loop->ready_count = 0;
+	loop->waiting = 1;
+#ifdef HAVE_LIBURING
+	if (loop->uring) {
+		// one submission for everything queued since the last iteration
+		uring_submit(loop->uring);
+		if (uring_get_ready_count(loop->uring) > 0)
+			timeout = 0;
+	}
+#endif
+	mutex_unlock(&loop->mutex);
+#ifdef HAVE_SYS_EPOLL_H
+	if (loop->backend == EVLOOP_BACKEND_EPOLL) {
+		cnt = evloop_wait_epoll(loop, timeout, sigmask);
+	} else
+#endif
+	{
+		cnt = evloop_wait_ppoll(loop, timeout, sigmask);
+	}
+	mutex_lock(&loop->mutex);
+	loop->waiting = 0;
+	mutex_unlock(&loop->mutex);
+#ifdef HAVE_LIBURING
+	if (loop->uring && cnt >= 0)
+		cnt = evloop_collect_uring(loop);
+#endif
+	*events = loop->ready;
+	return cnt;
+}
@@ -0,0 +1,70 @@
+/*
+ * evloop.h
+ *
+ * Copyright (C) 2026 usbmuxd contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef EVLOOP_H
+#define EVLOOP_H
+
+#include <signal.h>
+#include <sys/types.h>
+#include "utils.h"
+
+// selects the event backend at runtime ("epoll" or "ppoll")
+#define ENV_EVENT_BACKEND "USBMUXD_EVENT_BACKEND"
+// set to 1 to use io_uring for connected client sockets (if built with liburing)
+#define ENV_IO_URING "USBMUXD_IO_URING"
+
+enum evloop_backend {
+	EVLOOP_BACKEND_PPOLL,
+	EVLOOP_BACKEND_EPOLL
+};
+
+struct evloop_event {
+	enum fdowner owner;
+	int fd;
+	short revents;
+	void *data;
+};
+
+struct evloop;
+
+// event loop of the main thread, created by evloop_init()
+extern struct evloop *main_evloop;
+
+int evloop_init(void);
+void evloop_shutdown(void);
+const char *evloop_get_backend_name(void);
+
+struct evloop *evloop_new(void);
+void evloop_free(struct evloop *loop);
+
+int evloop_add(struct evloop *loop, int fd, enum fdowner owner, short events, void *data);
+int evloop_modify(struct evloop *loop, int fd, short events);
+void evloop_remove(struct evloop *loop, int fd);
+int evloop_get_count(struct evloop *loop);
+void evloop_wakeup(struct evloop *loop);
+
+int evloop_attach_uring(struct evloop *loop, int fd);
+ssize_t evloop_recv(struct evloop *loop, int fd, void *buf, size_t len);
+ssize_t evloop_send(struct evloop *loop, int fd, const void *buf, size_t len);
+ssize_t evloop_sendv(struct evloop *loop, int fd, const struct iovec *iov, int iovcnt);
+size_t evloop_get_queued(struct evloop *loop, int fd);
+
+int evloop_wait(struct evloop *loop, int timeout, const sigset_t *sigmask, struct evloop_event **events);
+
+#endif
@@ -52,6 +52,9 @@
 #include "device.h"
 #include "client.h"
 #include "conf.h"
+#include "evloop.h"
+#include "worker.h"
+#include "bufpool.h"
 
 static const char *socket_path = "/var/run/usbmuxd";
 #define DEFAULT_LOCKFILE "/var/run/usbmuxd.pid"
@@ -282,7 +285,7 @@ static void set_signal_handlers(void)
 	struct sigaction sa;
 	sigset_t set;
 
-	// Mask all signals we handle. They will be unmasked by ppoll().
+	// Mask all signals we handle. They will be unmasked while waiting for events.
 	sigemptyset(&set);
 	sigaddset(&set, SIGINT);
 	sigaddset(&set, SIGQUIT);
@@ -300,31 +303,19 @@ static void set_signal_handlers(void)
 	sigaction(SIGUSR2, &sa, NULL);
 }
 
-#ifndef HAVE_PPOLL
-static int ppoll(struct pollfd *fds, nfds_t nfds, const struct timespec *timeout, const sigset_t *sigmask)
-{
-	int ready;
-	sigset_t origmask;
-	int to = timeout->tv_sec*1000 + timeout->tv_nsec/1000000;
-
-	sigprocmask(SIG_SETMASK, sigmask, &origmask);
-	ready = poll(fds, nfds, to);
-	sigprocmask(SIG_SETMASK, &origmask, NULL);
-
-	return ready;
-}
-#endif
-
 static int main_loop(int listenfd)
 {
 	int to, cnt, i, dto;
-	struct fdlist pollfds;
-	struct timespec tspec;
+	struct evloop_event *events = NULL;
 
 	sigset_t empty_sigset;
 	sigemptyset(&empty_sigset); // unmask all signals
 
-	fdlist_create(&pollfds);
+	if(evloop_add(main_evloop, listenfd, FD_LISTEN, POLLIN, NULL) < 0) {
+		usbmuxd_log(LL_FATAL, "Could not add listening socket to event loop");
+		return -1;
+	}
+
 	while(!should_exit) {
 		usbmuxd_log(LL_FLOOD, "main_loop iteration");
 		to = usb_get_timeout();
@@ -334,15 +325,9 @@ static int main_loop(int listenfd)
 		if(dto < to)
 			to = dto;
 
-		fdlist_reset(&pollfds);
-		fdlist_add(&pollfds, FD_LISTEN, listenfd, POLLIN);
-		usb_get_fds(&pollfds);
-		client_get_fds(&pollfds);
-		usbmuxd_log(LL_FLOOD, "fd count is %d", pollfds.count);
+		usbmuxd_log(LL_FLOOD, "fd count is %d", evloop_get_count(main_evloop));
 
-		tspec.tv_sec = to / 1000;
-		tspec.tv_nsec = (to % 1000) * 1000000;
-		cnt = ppoll(pollfds.fds, pollfds.count, &tspec, &empty_sigset);
+		cnt = evloop_wait(main_evloop, to, &empty_sigset, &events);
 		usbmuxd_log(LL_FLOOD, "poll() returned %d", cnt);
 		if(cnt == -1) {
 			if(errno == EINTR) {
@@ -359,37 +344,40 @@ static int main_loop(int listenfd)
 		} else if(cnt == 0) {
 			if(usb_process() < 0) {
 				usbmuxd_log(LL_FATAL, "usb_process() failed");
-				fdlist_free(&pollfds);
+				evloop_remove(main_evloop, listenfd);
 				return -1;
 			}
 			device_check_timeouts();
 		} else {
 			int done_usb = 0;
-			for(i=0; i<pollfds.count; i++) {
-				if(pollfds.fds[i].revents) {
-					if(!done_usb && pollfds.owners[i] == FD_USB) {
-						if(usb_process() < 0) {
-							usbmuxd_log(LL_FATAL, "usb_process() failed");
-							fdlist_free(&pollfds);
-							return -1;
-						}
-						done_usb = 1;
-					}
-					if(pollfds.owners[i] == FD_LISTEN) {
-						if(client_accept(listenfd) < 0) {
-							usbmuxd_log(LL_FATAL, "client_accept() failed");
-							fdlist_free(&pollfds);
-							return -1;
-						}
+			for(i=0; i<cnt; i++) {
+				// events of fds removed while dispatching are cleared
+				if(!events[i].revents)
+					continue;
+				if(!done_usb && events[i].owner == FD_USB) {
+					if(usb_process() < 0) {
+						usbmuxd_log(LL_FATAL, "usb_process() failed");
+						evloop_remove(main_evloop, listenfd);
+						return -1;
 					}
-					if(pollfds.owners[i] == FD_CLIENT) {
-						client_process(pollfds.fds[i].fd, pollfds.fds[i].revents);
+					done_usb = 1;
+				}
+				if(events[i].owner == FD_LISTEN) {
+					if(client_accept(listenfd) < 0) {
+						usbmuxd_log(LL_FATAL, "client_accept() failed");
+						evloop_remove(main_evloop, listenfd);
+						return -1;
 					}
 				}
+				if(events[i].owner == FD_CLIENT) {
+					client_process(events[i].data, events[i].revents);
+				}
 			}
 		}
+		client_process_notifications();
+		usb_write_device_cache();
 	}
-	fdlist_free(&pollfds);
+	evloop_remove(main_evloop, listenfd);
 	return 0;
 }
 
@@ -884,6 +872,12 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if((res = evloop_init()) < 0)
+		goto terminate;
+	if((res = worker_init()) < 0)
+		goto terminate;
+
+	bufpool_init();
 	client_init();
 	device_init();
 	usbmuxd_log(LL_INFO, "Initializing USB");
@@ -914,7 +908,10 @@ int main(int argc, char *argv[])
 	device_kill_connections();
 	usb_shutdown();
 	device_shutdown();
+	worker_shutdown();
 	client_shutdown();
+	bufpool_shutdown();
+	evloop_shutdown();
 	usbmuxd_log(LL_NOTICE, "Shutdown complete");
 
 terminate:
@@ -0,0 +1,218 @@
+/*
+ * timer.c
+ *
+ * Copyright (C) 2026 usbmuxd contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "timer.h"
+#include "log.h"
+
+/*
+ * Timers are kept in a binary min-heap ordered by deadline. The earliest
+ * deadline is always at the root, so querying it is O(1) while arming and
+ * disarming are O(log n). Every timer remembers its heap position, so it
+ * can be removed without searching for it.
+ * A timer_queue does no locking on its own; callers have to serialize
+ * access to it.
+ */
+
+static void heap_set(struct timer_queue *queue, int index, struct timer *timer)
+{
+	queue->heap[index] = timer;
+	timer->index = index;
+}
+
+static void heap_sift_up(struct timer_queue *queue, int index)
+{
+	struct timer *timer = queue->heap[index];
+	while (index > 0) {
+		int parent = (index - 1) / 2;
+		if (queue->heap[parent]->deadline <= timer->deadline)
+			break;
+		heap_set(queue, index, queue->heap[parent]);
+		index = parent;
+	}
+	heap_set(queue, index, timer);
+}
+
+static void heap_sift_down(struct timer_queue *queue, int index)
+{
+	struct timer *timer = queue->heap[index];
+	while (1) {
+		int child = 2 * index + 1;
+		if (child >= queue->count)
+			break;
+		if (child + 1 < queue->count && queue->heap[child + 1]->deadline < queue->heap[child]->deadline)
+			child++;
+		if (timer->deadline <= queue->heap[child]->deadline)
+			break;
+		heap_set(queue, index, queue->heap[child]);
+		index = child;
+	}
+	heap_set(queue, index, timer);
+}
+
+void timer_queue_init(struct timer_queue *queue)
+{
+	queue->heap = NULL;
+	queue->count = 0;
+	queue->capacity = 0;
+}
+
+void timer_queue_free(struct timer_queue *queue)
+{
+	int i;
+	for (i = 0; i < queue->count; i++) {
+		queue->heap[i]->index = -1;
+	}
+	free(queue->heap);
+	timer_queue_init(queue);
+}
+
+/**
+ * Initialize a timer. It has to be initialized before it is armed the
+ * first time.
+ *
+ * @param timer The timer to initialize.
+ * @param cb Function called when the timer expires.
+ * @param data Opaque pointer passed to the callback.
+ */
+void timer_init(struct timer *timer, timer_cb_t cb, void *data)
+{
+	timer->deadline = 0;
+	timer->index = -1;
+	timer->cb = cb;
+	timer->data = data;
+}
+
+/**
+ * Arm a timer, or move its deadline if it is already armed.
+ *
+ * @param queue The queue to add the timer to.
+ * @param timer The timer to arm.
+ * @param deadline Absolute expiry time in milliseconds (see mstime64()).
+ * @return 0 on success, -1 on error.
+ */
+int timer_arm(struct timer_queue *queue, struct timer *timer, uint64_t deadline)
+{
+	if (timer->index >= 0) {
+		uint64_t old_deadline = timer->deadline;
+		if (old_deadline == deadline)
+			return 0;
+		timer->deadline = deadline;
+		if (deadline < old_deadline)
+			heap_sift_up(queue, timer->index);
+		else
+			heap_sift_down(queue, timer->index);
+		return 0;
+	}
+
+	if (queue->count >= queue->capacity) {
+		int new_capacity = (queue->capacity > 0) ? queue->capacity * 2 : 64;
+		struct timer **new_heap = realloc(queue->heap, sizeof(struct timer *) * new_capacity);
+		if (!new_heap) {
+			usbmuxd_log(LL_FATAL, "%s: Failed to realloc.", __func__);
+			return -1;
+		}
+		queue->heap = new_heap;
+		queue->capacity = new_capacity;
+	}
+	timer->deadline = deadline;
+	heap_set(queue, queue->count, timer);
+	queue->count++;
+	heap_sift_up(queue, timer->index);
+	return 0;
+}
+
+/**
+ * Disarm a timer. This is a no-op if the timer is not armed.
+ *
+ * @param queue The queue the timer was armed on.
+ * @param timer The timer to disarm.
+ */
+void timer_disarm(struct timer_queue *queue, struct timer *timer)
+{
+	int index = timer->index;
+	struct timer *last;
+
+	if (index < 0)
+		return;
+
+	timer->index = -1;
+	queue->count--;
+	if (index == queue->count)
+		return;
+
+	last = queue->heap[queue->count];
+	heap_set(queue, index, last);
+	if (index > 0 && queue->heap[(index - 1) / 2]->deadline > last->deadline)
+		heap_sift_up(queue, index);
+	else
+		heap_sift_down(queue, index);
+}
+
+/**
+ * Get the time until the earliest timer of a queue expires.
+ *
+ * @param queue The timer queue.
+ * @param now The current time in milliseconds.
+ * @param max_timeout Value to return if no timer is armed.
+ * @return The number of milliseconds until the next deadline, 0 if a
+ *   timer has already expired, or max_timeout.
+ */
+int timer_queue_get_timeout(struct timer_queue *queue, uint64_t now, int max_timeout)
+{
+	uint64_t deadline;
+
+	if (queue->count == 0)
+		return max_timeout;
+	deadline = queue->heap[0]->deadline;
+	if (deadline <= now)
+		return 0;
+	if (deadline - now > (uint64_t)max_timeout)
+		return max_timeout;
+	return (int)(deadline - now);
+}
+
+/**
+ * Run the callbacks of all expired timers, earliest first. Each timer is
+ * disarmed before its callback is invoked, so callbacks may re-arm it or
+ * free the memory holding it.
+ *
+ * @param queue The timer queue.
+ * @param now The current time in milliseconds.
+ * @return The number of timers that expired.
+ */
+int timer_queue_run(struct timer_queue *queue, uint64_t now)
+{
+	int count = 0;
+
+	while (queue->count > 0 && queue->heap[0]->deadline <= now) {
+		struct timer *timer = queue->heap[0];
+		timer_disarm(queue, timer);
+		count++;
+		if (timer->cb)
+			timer->cb(timer, timer->data);
+	}
+	return count;
+}
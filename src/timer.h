@@ -0,0 +1,53 @@
+/*
+ * timer.h
+ *
+ * Copyright (C) 2026 usbmuxd contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+struct timer;
+
+typedef void (*timer_cb_t)(struct timer *timer, void *data);
+
+struct timer {
+	uint64_t deadline; // absolute time in ms, see mstime64()
+	int index; // position in the queue's heap, -1 if not armed
+	timer_cb_t cb;
+	void *data;
+};
+
+struct timer_queue {
+	struct timer **heap;
+	int count;
+	int capacity;
+};
+
+void timer_queue_init(struct timer_queue *queue);
+void timer_queue_free(struct timer_queue *queue);
+
+void timer_init(struct timer *timer, timer_cb_t cb, void *data);
+int timer_arm(struct timer_queue *queue, struct timer *timer, uint64_t deadline);
+void timer_disarm(struct timer_queue *queue, struct timer *timer);
+#define timer_is_armed(timer) ((timer)->index >= 0)
+
+int timer_queue_get_timeout(struct timer_queue *queue, uint64_t now, int max_timeout);
+int timer_queue_run(struct timer_queue *queue, uint64_t now);
+
+#endif
@@ -0,0 +1,184 @@
+/*
+ * uevent.c
+ *
+ * Copyright (C) 2026 usbmuxd contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <linux/netlink.h>
+#endif
+
+#include "uevent.h"
+#include "log.h"
+
+// multicast group the kernel sends its uevents to
+#define UEVENT_GROUP_KERNEL 1
+#define UEVENT_BUFSIZE 8192
+#define UEVENT_RCVBUF (256 * 1024)
+
+/**
+ * Open a non-blocking netlink socket receiving kernel uevents.
+ *
+ * @return The socket, or -1 if uevents are not available.
+ */
+int uevent_open(void)
+{
+#ifdef __linux__
+	struct sockaddr_nl addr;
+	int size = UEVENT_RCVBUF;
+	int fd;
+
+	fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+	if (fd < 0) {
+		usbmuxd_log(LL_WARNING, "Could not create uevent socket: %s", strerror(errno));
+		return -1;
+	}
+	// a burst of events from a hub must not overflow the socket
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = UEVENT_GROUP_KERNEL;
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		usbmuxd_log(LL_WARNING, "Could not bind uevent socket: %s", strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+#else
+	return -1;
+#endif
+}
+
+void uevent_close(int fd)
+{
+	if (fd >= 0)
+		close(fd);
+}
+
+#ifdef __linux__
+/*
+ * A uevent is "ACTION@DEVPATH" followed by KEY=VALUE pairs, all of them
+ * NUL terminated. Only USB devices with bus and device number are of
+ * interest; interfaces and other subsystems are skipped.
+ */
+static int uevent_parse(char *buf, size_t len, struct uevent *event)
+{
+	const char *action = NULL, *subsystem = NULL, *devtype = NULL;
+	const char *product = NULL, *busnum = NULL, *devnum = NULL;
+	unsigned long vid, pid;
+	char *end;
+	size_t pos;
+
+	for (pos = strlen(buf) + 1; pos < len; pos += strlen(buf + pos) + 1) {
+		char *key = buf + pos;
+		if (!strncmp(key, "ACTION=", 7))
+			action = key + 7;
+		else if (!strncmp(key, "SUBSYSTEM=", 10))
+			subsystem = key + 10;
+		else if (!strncmp(key, "DEVTYPE=", 8))
+			devtype = key + 8;
+		else if (!strncmp(key, "PRODUCT=", 8))
+			product = key + 8;
+		else if (!strncmp(key, "BUSNUM=", 7))
+			busnum = key + 7;
+		else if (!strncmp(key, "DEVNUM=", 7))
+			devnum = key + 7;
+	}
+	if (!action || !subsystem || !devtype || !product || !busnum || !devnum)
+		return -1;
+	if (strcmp(subsystem, "usb") || strcmp(devtype, "usb_device"))
+		return -1;
+
+	if (!strcmp(action, "add"))
+		event->action = UEVENT_ADD;
+	else if (!strcmp(action, "remove"))
+		event->action = UEVENT_REMOVE;
+	else
+		return -1;
+
+	// PRODUCT is "vid/pid/bcdDevice" in hex without leading zeros
+	vid = strtoul(product, &end, 16);
+	if (*end != '/')
+		return -1;
+	pid = strtoul(end + 1, &end, 16);
+	if (*end != '/')
+		return -1;
+	event->vid = (uint16_t)vid;
+	event->pid = (uint16_t)pid;
+	event->bus = (int)strtol(busnum, NULL, 10);
+	event->address = (int)strtol(devnum, NULL, 10);
+	return 0;
+}
+#endif
+
+/**
+ * Read the next USB device event from a uevent socket.
+ *
+ * @param fd The socket returned by uevent_open().
+ * @param event Filled in with the event.
+ * @return 1 if an event was read, 0 if no event is pending, or -1 on
+ *     error. errno is ENOBUFS if events were lost.
+ */
+int uevent_read(int fd, struct uevent *event)
+{
+#ifdef __linux__
+	char buf[UEVENT_BUFSIZE];
+	struct sockaddr_nl addr;
+	struct iovec iov;
+	struct msghdr msg;
+	ssize_t len;
+
+	while (1) {
+		iov.iov_base = buf;
+		iov.iov_len = sizeof(buf) - 1;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_name = &addr;
+		msg.msg_namelen = sizeof(addr);
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+
+		len = recvmsg(fd, &msg, 0);
+		if (len < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		// only trust messages sent by the kernel itself
+		if (addr.nl_pid != 0 || (msg.msg_flags & MSG_TRUNC))
+			continue;
+		buf[len] = '\0';
+		if (uevent_parse(buf, len, event) == 0)
+			return 1;
+	}
+#else
+	errno = ENOTSUP;
+	return -1;
+#endif
+}
@@ -0,0 +1,47 @@
+/*
+ * uevent.h
+ *
+ * Copyright (C) 2026 usbmuxd contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef UEVENT_H
+#define UEVENT_H
+
+#include <stdint.h>
+
+/*
+ * Kernel uevents for USB devices, used for hotplug when libusb cannot
+ * report it. Only available on Linux; uevent_open() fails elsewhere.
+ */
+
+enum uevent_action {
+	UEVENT_ADD,
+	UEVENT_REMOVE
+};
+
+struct uevent {
+	enum uevent_action action;
+	int bus;
+	int address;
+	uint16_t vid;
+	uint16_t pid;
+};
+
+int uevent_open(void);
+void uevent_close(int fd);
+int uevent_read(int fd, struct uevent *event);
+
+#endif
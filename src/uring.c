@@ -0,0 +1,774 @@
+/*
+ * uring.c
+ *
+ * Copyright (C) 2026 usbmuxd contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <liburing.h>
+
+#include "uring.h"
+#include "log.h"
+
+#define URING_ENTRIES 256
+
+// provided buffers shared by all sockets of a ring for multishot receives
+#define URING_BUF_GROUP 0
+#define URING_BUF_COUNT 256
+#define URING_BUF_SIZE 16384
+
+// stop receiving on a socket while this much data waits to be consumed
+#define URING_RECV_HIGH_WATER (4 * URING_BUF_SIZE)
+// report a socket as writable while less than this is queued for sending
+#define URING_SEND_HIGH_WATER 65536
+// maximum number of queued chunks passed to a single sendmsg
+#define URING_SEND_IOV 8
+
+#define CQE_BATCH 64
+
+/*
+ * Sockets attached to a ring are not polled for readiness. A multishot
+ * receive keeps filling provided buffers, and the data is handed out by
+ * uring_sock_recv() without a system call. uring_sock_send() only copies
+ * the data to the socket's send queue, up to URING_SEND_HIGH_WATER, and
+ * the queue is written with one sendmsg operation in flight per socket.
+ * All operations queued during one event loop iteration go to the kernel
+ * with a single io_uring_submit() call. Readiness is then reported to
+ * the event loop from the socket state, so callers see the same
+ * POLLIN/POLLOUT semantics as before.
+ */
+
+enum uring_op_type {
+	URING_OP_RECV,
+	URING_OP_SEND
+};
+
+struct uring_op {
+	enum uring_op_type type;
+	struct uring_sock *sock;
+};
+
+struct uring_rbuf {
+	uint16_t bid;
+	uint32_t len;
+	uint32_t off;
+};
+
+struct uring_chunk {
+	struct uring_chunk *next;
+	size_t len;
+	size_t off;
+	unsigned char data[];
+};
+
+struct uring_sock {
+	struct uring *ring;
+	int fd;		// fd the socket is registered with in the event loop
+	int io_fd;	// private duplicate, closed after the last operation completed
+	short events;
+	int released;
+	int error;
+	int eof;
+
+	struct uring_sock *prev, *next;	// all sockets of the ring
+	struct uring_sock *ready_next;
+	int ready;
+	struct uring_sock *starved_next;
+	int starved;
+	struct uring_sock *send_starved_next;
+	int send_starved;
+
+	struct uring_op recv_op;
+	int recv_armed;
+	int recv_cancelled;
+	struct uring_rbuf *rbufs;
+	int rbuf_head;
+	int rbuf_count;
+	int rbuf_capacity;
+	size_t recv_pending;
+
+	struct uring_op send_op;
+	int send_inflight;
+	struct uring_chunk *send_head;
+	struct uring_chunk *send_tail;
+	size_t send_queued;
+	struct iovec iov[URING_SEND_IOV];
+	struct msghdr msg;
+};
+
+struct uring {
+	struct io_uring ring;
+	struct io_uring_buf_ring *br;
+	unsigned char *bufs;
+	int bufs_held;
+	struct uring_sock *socks;
+	struct uring_sock *ready;
+	int ready_count;
+	struct uring_sock *starved;
+	struct uring_sock *send_starved;
+};
+
+static struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&ring->ring);
+	if (!sqe) {
+		// submission queue is full, flush it and try again
+		io_uring_submit(&ring->ring);
+		sqe = io_uring_get_sqe(&ring->ring);
+		if (!sqe) {
+			usbmuxd_log(LL_ERROR, "%s: io_uring submission queue is full", __func__);
+		}
+	}
+	return sqe;
+}
+
+static void uring_return_buffer(struct uring *ring, uint16_t bid)
+{
+	io_uring_buf_ring_add(ring->br, ring->bufs + (size_t)bid * URING_BUF_SIZE, URING_BUF_SIZE, bid, io_uring_buf_ring_mask(URING_BUF_COUNT), 0);
+	io_uring_buf_ring_advance(ring->br, 1);
+}
+
+static void sock_mark_ready(struct uring_sock *sock)
+{
+	if (sock->ready || sock->released)
+		return;
+	sock->ready = 1;
+	sock->ready_next = sock->ring->ready;
+	sock->ring->ready = sock;
+	sock->ring->ready_count++;
+}
+
+static void sock_unlink_ready(struct uring_sock *sock)
+{
+	struct uring_sock **p;
+	if (!sock->ready)
+		return;
+	for (p = &sock->ring->ready; *p; p = &(*p)->ready_next) {
+		if (*p == sock) {
+			*p = sock->ready_next;
+			sock->ring->ready_count--;
+			break;
+		}
+	}
+	sock->ready = 0;
+	sock->ready_next = NULL;
+}
+
+static void sock_unlink_starved(struct uring_sock *sock)
+{
+	struct uring_sock **p;
+	if (!sock->starved)
+		return;
+	for (p = &sock->ring->starved; *p; p = &(*p)->starved_next) {
+		if (*p == sock) {
+			*p = sock->starved_next;
+			break;
+		}
+	}
+	sock->starved = 0;
+	sock->starved_next = NULL;
+}
+
+static void sock_unlink_send_starved(struct uring_sock *sock)
+{
+	struct uring_sock **p;
+	if (!sock->send_starved)
+		return;
+	for (p = &sock->ring->send_starved; *p; p = &(*p)->send_starved_next) {
+		if (*p == sock) {
+			*p = sock->send_starved_next;
+			break;
+		}
+	}
+	sock->send_starved = 0;
+	sock->send_starved_next = NULL;
+}
+
+static short sock_revents(struct uring_sock *sock)
+{
+	short revents = 0;
+	if ((sock->events & POLLIN) && (sock->recv_pending || sock->eof || sock->error))
+		revents |= POLLIN;
+	if ((sock->events & POLLOUT) && (sock->send_queued < URING_SEND_HIGH_WATER || sock->error))
+		revents |= POLLOUT;
+	return revents;
+}
+
+static void sock_arm_recv(struct uring_sock *sock)
+{
+	struct io_uring_sqe *sqe;
+
+	if (sock->recv_armed || sock->released || sock->eof || sock->error || sock->starved)
+		return;
+	if (sock->recv_pending >= URING_RECV_HIGH_WATER)
+		return;
+
+	sqe = uring_get_sqe(sock->ring);
+	if (!sqe) {
+		// retried from uring_submit()
+		sock->starved = 1;
+		sock->starved_next = sock->ring->starved;
+		sock->ring->starved = sock;
+		return;
+	}
+	io_uring_prep_recv_multishot(sqe, sock->io_fd, NULL, 0, 0);
+	sqe->flags |= IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BUF_GROUP;
+	io_uring_sqe_set_data(sqe, &sock->recv_op);
+	sock->recv_armed = 1;
+	sock->recv_cancelled = 0;
+}
+
+static void sock_cancel_recv(struct uring_sock *sock)
+{
+	struct io_uring_sqe *sqe;
+
+	if (!sock->recv_armed || sock->recv_cancelled)
+		return;
+	sqe = uring_get_sqe(sock->ring);
+	if (!sqe)
+		return;
+	io_uring_prep_cancel(sqe, &sock->recv_op, 0);
+	io_uring_sqe_set_data(sqe, NULL);
+	sock->recv_cancelled = 1;
+}
+
+// apply receive flow control after the amount of pending data changed
+static void sock_update_recv(struct uring_sock *sock)
+{
+	if (sock->recv_pending >= URING_RECV_HIGH_WATER)
+		sock_cancel_recv(sock);
+	else
+		sock_arm_recv(sock);
+}
+
+static void sock_free_send_queue(struct uring_sock *sock)
+{
+	struct uring_chunk *chunk = sock->send_head;
+	while (chunk) {
+		struct uring_chunk *next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+	sock->send_head = sock->send_tail = NULL;
+	sock->send_queued = 0;
+}
+
+static void sock_start_send(struct uring_sock *sock)
+{
+	struct io_uring_sqe *sqe;
+	struct uring_chunk *chunk;
+	int n = 0;
+
+	if (sock->send_inflight || sock->send_starved || !sock->send_head || sock->error)
+		return;
+
+	for (chunk = sock->send_head; chunk && n < URING_SEND_IOV; chunk = chunk->next) {
+		sock->iov[n].iov_base = chunk->data + chunk->off;
+		sock->iov[n].iov_len = chunk->len - chunk->off;
+		n++;
+	}
+	memset(&sock->msg, 0, sizeof(sock->msg));
+	sock->msg.msg_iov = sock->iov;
+	sock->msg.msg_iovlen = n;
+
+	sqe = uring_get_sqe(sock->ring);
+	if (!sqe) {
+		// the data stays queued, retried from uring_submit()
+		sock->send_starved = 1;
+		sock->send_starved_next = sock->ring->send_starved;
+		sock->ring->send_starved = sock;
+		return;
+	}
+	io_uring_prep_sendmsg(sqe, sock->io_fd, &sock->msg, MSG_NOSIGNAL);
+	io_uring_sqe_set_data(sqe, &sock->send_op);
+	sock->send_inflight = 1;
+}
+
+static void sock_return_rbufs(struct uring_sock *sock)
+{
+	int i;
+	for (i = sock->rbuf_head; i < sock->rbuf_count; i++) {
+		uring_return_buffer(sock->ring, sock->rbufs[i].bid);
+		sock->ring->bufs_held--;
+	}
+	sock->rbuf_head = sock->rbuf_count = 0;
+	sock->recv_pending = 0;
+}
+
+static void sock_free(struct uring_sock *sock)
+{
+	struct uring *ring = sock->ring;
+
+	if (sock->prev)
+		sock->prev->next = sock->next;
+	else
+		ring->socks = sock->next;
+	if (sock->next)
+		sock->next->prev = sock->prev;
+
+	sock_unlink_starved(sock);
+	sock_unlink_send_starved(sock);
+	sock_return_rbufs(sock);
+	sock_free_send_queue(sock);
+	close(sock->io_fd);
+	free(sock->rbufs);
+	free(sock);
+}
+
+// a released socket goes away once nothing references it anymore
+static void sock_check_released(struct uring_sock *sock)
+{
+	if (!sock->released || sock->recv_armed || sock->send_inflight)
+		return;
+	if (sock->send_head && !sock->error)
+		return;
+	sock_free(sock);
+}
+
+static int sock_push_rbuf(struct uring_sock *sock, uint16_t bid, uint32_t len)
+{
+	struct uring_rbuf *rb;
+
+	if (sock->rbuf_head > 0 && sock->rbuf_count == sock->rbuf_capacity) {
+		memmove(sock->rbufs, sock->rbufs + sock->rbuf_head, sizeof(struct uring_rbuf) * (sock->rbuf_count - sock->rbuf_head));
+		sock->rbuf_count -= sock->rbuf_head;
+		sock->rbuf_head = 0;
+	}
+	if (sock->rbuf_count == sock->rbuf_capacity) {
+		int new_capacity = sock->rbuf_capacity ? sock->rbuf_capacity * 2 : 8;
+		struct uring_rbuf *new_rbufs = realloc(sock->rbufs, sizeof(struct uring_rbuf) * new_capacity);
+		if (!new_rbufs) {
+			usbmuxd_log(LL_FATAL, "%s: Failed to realloc.", __func__);
+			return -1;
+		}
+		sock->rbufs = new_rbufs;
+		sock->rbuf_capacity = new_capacity;
+	}
+	rb = &sock->rbufs[sock->rbuf_count++];
+	rb->bid = bid;
+	rb->len = len;
+	rb->off = 0;
+	sock->recv_pending += len;
+	sock->ring->bufs_held++;
+	return 0;
+}
+
+static void handle_recv(struct uring_sock *sock, int res, unsigned int flags)
+{
+	if (flags & IORING_CQE_F_BUFFER) {
+		uint16_t bid = flags >> IORING_CQE_BUFFER_SHIFT;
+		if (res <= 0 || sock->released || sock_push_rbuf(sock, bid, res) < 0) {
+			uring_return_buffer(sock->ring, bid);
+		}
+	}
+	if (!(flags & IORING_CQE_F_MORE)) {
+		sock->recv_armed = 0;
+		sock->recv_cancelled = 0;
+	}
+
+	if (res == 0) {
+		sock->eof = 1;
+	} else if (res == -ENOBUFS) {
+		// all provided buffers are in use, rearmed from uring_submit()
+		if (!sock->starved && !sock->released) {
+			sock->starved = 1;
+			sock->starved_next = sock->ring->starved;
+			sock->ring->starved = sock;
+		}
+	} else if (res < 0 && res != -ECANCELED) {
+		sock->error = -res;
+	}
+
+	if (sock->released) {
+		sock_check_released(sock);
+		return;
+	}
+	sock_mark_ready(sock);
+	sock_update_recv(sock);
+}
+
+static void handle_send(struct uring_sock *sock, int res)
+{
+	sock->send_inflight = 0;
+	if (res <= 0) {
+		sock->error = (res < 0) ? -res : EPIPE;
+		sock_free_send_queue(sock);
+	} else {
+		size_t done = res;
+		sock->send_queued -= done;
+		while (done > 0 && sock->send_head) {
+			struct uring_chunk *chunk = sock->send_head;
+			size_t left = chunk->len - chunk->off;
+			if (done < left) {
+				chunk->off += done;
+				break;
+			}
+			done -= left;
+			sock->send_head = chunk->next;
+			free(chunk);
+		}
+		if (!sock->send_head)
+			sock->send_tail = NULL;
+		sock_start_send(sock);
+	}
+
+	if (sock->released) {
+		sock_check_released(sock);
+		return;
+	}
+	sock_mark_ready(sock);
+}
+
+/**
+ * Set up an io_uring instance with a provided buffer ring for receiving.
+ *
+ * @return The new ring, or NULL if io_uring is not usable on this system.
+ */
+struct uring *uring_new(void)
+{
+	struct uring *ring;
+	int res;
+	int i;
+
+	ring = calloc(1, sizeof(struct uring));
+	if (!ring) {
+		usbmuxd_log(LL_FATAL, "%s: Failed to allocate io_uring.", __func__);
+		return NULL;
+	}
+	res = io_uring_queue_init(URING_ENTRIES, &ring->ring, 0);
+	if (res < 0) {
+		usbmuxd_log(LL_WARNING, "io_uring is not available: %s", strerror(-res));
+		free(ring);
+		return NULL;
+	}
+	ring->bufs = malloc((size_t)URING_BUF_COUNT * URING_BUF_SIZE);
+	if (!ring->bufs) {
+		usbmuxd_log(LL_FATAL, "%s: Failed to allocate receive buffers.", __func__);
+		io_uring_queue_exit(&ring->ring);
+		free(ring);
+		return NULL;
+	}
+	ring->br = io_uring_setup_buf_ring(&ring->ring, URING_BUF_COUNT, URING_BUF_GROUP, 0, &res);
+	if (!ring->br) {
+		usbmuxd_log(LL_WARNING, "io_uring provided buffer rings are not available: %s", strerror(-res));
+		free(ring->bufs);
+		io_uring_queue_exit(&ring->ring);
+		free(ring);
+		return NULL;
+	}
+	for (i = 0; i < URING_BUF_COUNT; i++) {
+		io_uring_buf_ring_add(ring->br, ring->bufs + (size_t)i * URING_BUF_SIZE, URING_BUF_SIZE, i, io_uring_buf_ring_mask(URING_BUF_COUNT), i);
+	}
+	io_uring_buf_ring_advance(ring->br, URING_BUF_COUNT);
+
+	return ring;
+}
+
+void uring_free(struct uring *ring)
+{
+	if (!ring)
+		return;
+	while (ring->socks) {
+		sock_free(ring->socks);
+	}
+	io_uring_free_buf_ring(&ring->ring, ring->br, URING_BUF_COUNT, URING_BUF_GROUP);
+	io_uring_queue_exit(&ring->ring);
+	free(ring->bufs);
+	free(ring);
+}
+
+/**
+ * @return The ring's fd, which becomes readable when completions are pending.
+ */
+int uring_get_fd(struct uring *ring)
+{
+	return ring->ring.ring_fd;
+}
+
+/**
+ * Pass all operations queued since the last call to the kernel.
+ *
+ * @return The number of submitted operations, or a negative errno value.
+ */
+int uring_submit(struct uring *ring)
+{
+	int res;
+
+	if (ring->starved && ring->bufs_held < URING_BUF_COUNT) {
+		struct uring_sock *sock = ring->starved;
+		ring->starved = NULL;
+		while (sock) {
+			struct uring_sock *next = sock->starved_next;
+			sock->starved = 0;
+			sock->starved_next = NULL;
+			sock_arm_recv(sock);
+			sock = next;
+		}
+	}
+	if (ring->send_starved) {
+		struct uring_sock *sock = ring->send_starved;
+		ring->send_starved = NULL;
+		while (sock) {
+			struct uring_sock *next = sock->send_starved_next;
+			sock->send_starved = 0;
+			sock->send_starved_next = NULL;
+			sock_start_send(sock);
+			sock = next;
+		}
+	}
+
+	res = io_uring_submit(&ring->ring);
+	if (res < 0 && res != -EBUSY && res != -EINTR) {
+		usbmuxd_log(LL_ERROR, "%s: io_uring_submit failed: %s", __func__, strerror(-res));
+	}
+	return res;
+}
+
+/**
+ * Process all pending completions. This does not enter the kernel.
+ */
+void uring_reap(struct uring *ring)
+{
+	struct io_uring_cqe *cqes[CQE_BATCH];
+	unsigned int count, i;
+
+	do {
+		count = io_uring_peek_batch_cqe(&ring->ring, cqes, CQE_BATCH);
+		for (i = 0; i < count; i++) {
+			struct uring_op *op = io_uring_cqe_get_data(cqes[i]);
+			if (!op)
+				continue;
+			if (op->type == URING_OP_RECV)
+				handle_recv(op->sock, cqes[i]->res, cqes[i]->flags);
+			else
+				handle_send(op->sock, cqes[i]->res);
+		}
+		io_uring_cq_advance(&ring->ring, count);
+	} while (count == CQE_BATCH);
+}
+
+/**
+ * @return Upper bound for the number of events uring_collect() will return.
+ */
+int uring_get_ready_count(struct uring *ring)
+{
+	return ring->ready_count;
+}
+
+/**
+ * Report sockets that became readable or writable. Only fd and revents
+ * of the events are filled in.
+ *
+ * @return The number of events stored.
+ */
+int uring_collect(struct uring *ring, struct evloop_event *events, int max)
+{
+	struct uring_sock *sock = ring->ready;
+	int count = 0;
+
+	ring->ready = NULL;
+	ring->ready_count = 0;
+	while (sock) {
+		struct uring_sock *next = sock->ready_next;
+		short revents = sock_revents(sock);
+		sock->ready = 0;
+		sock->ready_next = NULL;
+		if (revents) {
+			if (count < max) {
+				events[count].fd = sock->fd;
+				events[count].revents = revents;
+				count++;
+			} else {
+				sock_mark_ready(sock);
+			}
+		}
+		sock = next;
+	}
+	return count;
+}
+
+/**
+ * Move I/O of a connected socket to the ring. The socket is duplicated so
+ * queued data can still be sent after the caller closed its fd.
+ *
+ * @param ring The ring to use.
+ * @param fd The socket.
+ * @param events The initial event mask.
+ * @return The new ring socket, or NULL on error.
+ */
+struct uring_sock *uring_sock_new(struct uring *ring, int fd, short events)
+{
+	struct uring_sock *sock;
+	int io_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (io_fd < 0) {
+		usbmuxd_log(LL_ERROR, "%s: Could not duplicate fd %d: %s", __func__, fd, strerror(errno));
+		return NULL;
+	}
+	sock = calloc(1, sizeof(struct uring_sock));
+	if (!sock) {
+		usbmuxd_log(LL_FATAL, "%s: Failed to allocate socket.", __func__);
+		close(io_fd);
+		return NULL;
+	}
+	sock->ring = ring;
+	sock->fd = fd;
+	sock->io_fd = io_fd;
+	sock->events = events;
+	sock->recv_op.type = URING_OP_RECV;
+	sock->recv_op.sock = sock;
+	sock->send_op.type = URING_OP_SEND;
+	sock->send_op.sock = sock;
+
+	sock->next = ring->socks;
+	if (ring->socks)
+		ring->socks->prev = sock;
+	ring->socks = sock;
+
+	sock_arm_recv(sock);
+	sock_mark_ready(sock);
+	return sock;
+}
+
+/**
+ * Detach a socket from its event loop fd. Receiving stops immediately;
+ * data that is still queued is sent before the socket is closed.
+ */
+void uring_sock_release(struct uring_sock *sock)
+{
+	sock_unlink_ready(sock);
+	sock_unlink_starved(sock);
+	sock->released = 1;
+	sock_return_rbufs(sock);
+	sock_cancel_recv(sock);
+	sock_check_released(sock);
+}
+
+void uring_sock_set_events(struct uring_sock *sock, short events)
+{
+	if (events & ~sock->events)
+		sock_mark_ready(sock);
+	sock->events = events;
+}
+
+/**
+ * @return The number of bytes accepted by uring_sock_send() that were not
+ *   written to the socket yet.
+ */
+size_t uring_sock_get_queued(struct uring_sock *sock)
+{
+	return sock->send_queued;
+}
+
+/**
+ * Read received data. Behaves like recv() on a non-blocking socket.
+ */
+ssize_t uring_sock_recv(struct uring_sock *sock, void *buf, size_t len)
+{
+	size_t copied = 0;
+
+	while (copied < len && sock->rbuf_head < sock->rbuf_count) {
+		struct uring_rbuf *rb = &sock->rbufs[sock->rbuf_head];
+		size_t n = rb->len - rb->off;
+		if (n > len - copied)
+			n = len - copied;
+		memcpy((unsigned char*)buf + copied, sock->ring->bufs + (size_t)rb->bid * URING_BUF_SIZE + rb->off, n);
+		rb->off += n;
+		copied += n;
+		sock->recv_pending -= n;
+		if (rb->off == rb->len) {
+			uring_return_buffer(sock->ring, rb->bid);
+			sock->ring->bufs_held--;
+			sock->rbuf_head++;
+		}
+	}
+	if (sock->rbuf_head == sock->rbuf_count)
+		sock->rbuf_head = sock->rbuf_count = 0;
+
+	if (copied == 0) {
+		if (sock->error) {
+			errno = sock->error;
+			return -1;
+		}
+		if (sock->eof)
+			return 0;
+		errno = EAGAIN;
+		return -1;
+	}
+	if (sock->recv_pending || sock->eof || sock->error)
+		sock_mark_ready(sock);
+	sock_update_recv(sock);
+	return copied;
+}
+
+/**
+ * Send data. Behaves like send() on a non-blocking socket, except that
+ * the data is only queued; it is written once the operations of the
+ * current event loop iteration are submitted. Once URING_SEND_HIGH_WATER
+ * bytes are queued, the rest is refused with EAGAIN and POLLOUT is
+ * reported again when the queue got shorter.
+ */
+ssize_t uring_sock_send(struct uring_sock *sock, const void *buf, size_t len)
+{
+	struct uring_chunk *chunk;
+
+	if (sock->error) {
+		errno = sock->error;
+		return -1;
+	}
+	if (len == 0)
+		return 0;
+
+	if (sock->send_queued >= URING_SEND_HIGH_WATER) {
+		errno = EAGAIN;
+		return -1;
+	}
+	if (len > URING_SEND_HIGH_WATER - sock->send_queued)
+		len = URING_SEND_HIGH_WATER - sock->send_queued;
+
+	chunk = malloc(sizeof(struct uring_chunk) + len);
+	if (!chunk) {
+		usbmuxd_log(LL_FATAL, "%s: Failed to allocate send buffer.", __func__);
+		errno = ENOMEM;
+		return -1;
+	}
+	chunk->next = NULL;
+	chunk->len = len;
+	chunk->off = 0;
+	memcpy(chunk->data, buf, len);
+	if (sock->send_tail)
+		sock->send_tail->next = chunk;
+	else
+		sock->send_head = chunk;
+	sock->send_tail = chunk;
+	sock->send_queued += len;
+
+	sock_start_send(sock);
+	return len;
+}
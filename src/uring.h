@@ -0,0 +1,50 @@
+/*
+ * uring.h
+ *
+ * Copyright (C) 2026 usbmuxd contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <sys/types.h>
+#include "evloop.h"
+
+/*
+ * Completion based socket I/O for the event loop. Only used by evloop.c;
+ * all functions must be called with the owning loop's mutex held.
+ */
+
+struct uring;
+struct uring_sock;
+
+struct uring *uring_new(void);
+void uring_free(struct uring *ring);
+int uring_get_fd(struct uring *ring);
+
+int uring_submit(struct uring *ring);
+void uring_reap(struct uring *ring);
+int uring_get_ready_count(struct uring *ring);
+int uring_collect(struct uring *ring, struct evloop_event *events, int max);
+
+struct uring_sock *uring_sock_new(struct uring *ring, int fd, short events);
+void uring_sock_release(struct uring_sock *sock);
+void uring_sock_set_events(struct uring_sock *sock, short events);
+ssize_t uring_sock_recv(struct uring_sock *sock, void *buf, size_t len);
+ssize_t uring_sock_send(struct uring_sock *sock, const void *buf, size_t len);
+size_t uring_sock_get_queued(struct uring_sock *sock);
+
+#endif
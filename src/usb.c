@@ -28,15 +28,28 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/usbdevice_fs.h>
+#endif
 
 #include <libusb.h>
 
 #include <libimobiledevice-glue/collection.h>
+#include <libimobiledevice-glue/thread.h>
 
 #include "usb.h"
 #include "log.h"
 #include "device.h"
 #include "utils.h"
+#include "evloop.h"
+#include "worker.h"
+#include "conf.h"
+#include "uevent.h"
 
 #if (defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000102)) || (defined(LIBUSBX_API_VERSION) && (LIBUSBX_API_VERSION >= 0x01000102))
 #define HAVE_LIBUSB_HOTPLUG_API 1
@@ -45,24 +58,91 @@
 // interval for device connection/disconnection polling, in milliseconds
 // we need this because there is currently no asynchronous device discovery mechanism in libusb
 #define DEVICE_POLL_TIME 1000
+// with kernel uevents the full scan only catches events that were lost
+#define DEVICE_RESCAN_TIME 30000
+// rescan after an add event for a device that could not be opened yet,
+// udev may still be setting up the permissions of the device node
+#define UEVENT_RETRY_TIME 500
+
+// maximum time the USB event thread blocks in libusb without checking for work
+#define USB_THREAD_MAX_WAIT 1000
+
+// Bounds for the number of parallel bulk transfers reading data from the device.
+// Older versions of usbmuxd kept only 1, which leads to a mostly dormant USB port,
+// later a fixed number of 3. Now each device starts with the lower bound and gets
+// another transfer whenever a full round of transfers came back completely filled;
+// after RX_IDLE_TIME without such completions it gives one back again. A device
+// that stopped sending altogether has its extra transfers cancelled.
+#define RX_DEPTH_MIN 2
+#define RX_DEPTH_MAX 16
+// upper limit for the bounds set through the environment
+#define RX_DEPTH_LIMIT 64
+// time in milliseconds without full RX transfers before the depth shrinks
+#define RX_IDLE_TIME 1000
+
+// Number of TX transfers per device that can be in flight at the same time.
+// Transfers and their buffers are allocated once and then recycled.
+#define TX_POOL_SIZE 32
+// slots bulk data may not use, so control packets and ACKs still get through
+#define TX_POOL_RESERVE 4
+
+// transfer buffers start this far into their allocation, behind a usb_buf_header
+#define BUF_OFFSET 64
+
+// default limit for transfer buffers in usbfs device memory, in KiB; usbfs
+// accounts them against the same limit (usbfs_memory_mb, 16 MiB by default)
+// as the buffers of regular transfers in flight, so leave room for those
+#define DEV_MEM_BUDGET 8192
+
+struct usb_device;
+struct usb_tx_slot;
+
+struct usb_buf_header {
+	struct usb_tx_slot *slot; // owning TX pool slot, NULL for RX buffers
+	int size;
+	int dma; // allocated with libusb_dev_mem_alloc
+};
 
-// Number of parallel bulk transfers we have running for reading data from the device.
-// Older versions of usbmuxd kept only 1, which leads to a mostly dormant USB port.
-// 3 seems to be an all round sensible number - giving better read perf than
-// Apples usbmuxd, at least.
-#define NUM_RX_LOOPS 3
+struct usb_tx_slot {
+	struct usb_device *dev;
+	struct libusb_transfer *xfer;
+	unsigned char *buf; // allocated on first use, USB_MTU bytes
+};
 
 struct usb_device {
 	libusb_device_handle *handle;
 	uint8_t bus, address;
-	char serial[256];
+	char serial[USB_SERIAL_MAX];
 	int alive;
 	uint8_t interface, ep_in, ep_out;
 	struct collection rx_xfers;
+	struct collection rx_retiring; // RX transfers cancelled to shrink the queue
 	struct collection tx_xfers;
 	int wMaxPacketSize;
 	uint64_t speed;
 	struct libusb_device_descriptor devdesc;
+	struct mux_device *mux_dev;
+	struct worker *worker;
+	mutex_t xfer_mutex; // protects rx_xfers, tx_xfers, the TX pool, stats and init state
+	int disconnecting;
+	int dev_mem_failed; // device memory is not available for this device
+	struct usb_tx_slot tx_slots[TX_POOL_SIZE];
+	int tx_free[TX_POOL_SIZE]; // ring of free slot indices
+	int tx_free_head;
+	int tx_free_count;
+	int tx_waiting; // a bulk sender found the pool exhausted
+	int worker_jobs; // pending jobs on the worker that use the device
+	uint64_t init_start; // time the device was found
+	int init_running; // configuration thread active
+	int cached; // configuration taken from the device cache
+	int configuration; // value of the configuration with the usbmux interface
+	int configured; // configuration set and interface claimed
+	int serial_done; // serial number read
+	int started; // registered with the mux layer, RX running
+	int rx_size; // size of RX transfers, between USB_MRU and USB_MRU_MAX
+	int rx_full_streak; // back-to-back busy RX transfers
+	uint64_t rx_last_busy; // time of the last full RX transfer or depth change
+	struct usb_stats stats;
 };
 
 struct mode_context {
@@ -80,15 +160,220 @@ static struct timeval next_dev_poll_time;
 static int devlist_failures;
 static int device_polling;
 static int device_hotplug = 1;
+static int dev_poll_interval = DEVICE_POLL_TIME;
+
+// kernel uevent socket, used when libusb does not report hotplug events
+static int uevent_fd = -1;
+static int uevent_registered;
+static THREAD_T uevent_thread;
+static int uevent_thread_running;
+static mutex_t uevent_mutex;
+static cond_t uevent_cond;
+static int uevent_pending;
+
+// dedicated libusb event thread, only used together with worker threads
+static THREAD_T usb_thread;
+static int usb_thread_running;
+static int usb_thread_quit;
+static mutex_t usb_thread_mutex;
+static int usb_discover_requested; // protected by usb_thread_mutex
+
+static int rx_depth_min = RX_DEPTH_MIN;
+static int rx_depth_max = RX_DEPTH_MAX;
+static int rx_size_config; // 0 = detect
+
+// configuration decisions for known devices, see device_cache_lookup();
+// entries are added on the USB event thread and written out by the main loop
+static mutex_t device_cache_mutex;
+static plist_t device_cache;
+static int device_cache_dirty;
+
+// usbfs device memory taken by transfer buffers of all devices
+static mutex_t dev_mem_mutex;
+static size_t dev_mem_used;
+static size_t dev_mem_budget = DEV_MEM_BUDGET * 1024;
+
+/*
+ * Allocate a transfer buffer, preferably from usbfs device memory so the
+ * kernel can use it for the URB directly instead of copying it. Falls back
+ * to the heap where device memory is not supported or over budget.
+ * Caller must hold xfer_mutex.
+ */
+static unsigned char *usb_buf_alloc(struct usb_device *dev, int size)
+{
+	struct usb_buf_header *hdr = NULL;
+	size_t total = BUF_OFFSET + size;
+	int dma = 0;
+
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+	if(dev_mem_budget && !dev->dev_mem_failed) {
+		mutex_lock(&dev_mem_mutex);
+		if(dev_mem_used + total <= dev_mem_budget) {
+			hdr = (struct usb_buf_header *)libusb_dev_mem_alloc(dev->handle, total);
+			if(hdr) {
+				dev_mem_used += total;
+				dma = 1;
+			} else {
+				usbmuxd_log(LL_INFO, "Device memory not available for device %d-%d, using heap buffers", dev->bus, dev->address);
+				dev->dev_mem_failed = 1;
+			}
+		}
+		mutex_unlock(&dev_mem_mutex);
+	}
+#endif
+	if(!hdr)
+		hdr = malloc(total);
+	if(!hdr)
+		return NULL;
+	hdr->slot = NULL;
+	hdr->size = size;
+	hdr->dma = dma;
+	if(dma)
+		dev->stats.dma_buffers++;
+	else
+		dev->stats.heap_buffers++;
+	return (unsigned char *)hdr + BUF_OFFSET;
+}
+
+static struct usb_buf_header *usb_buf_header(unsigned char *buf)
+{
+	return (struct usb_buf_header *)(buf - BUF_OFFSET);
+}
+
+// caller must hold xfer_mutex, and the device must still be open
+static void usb_buf_free(struct usb_device *dev, unsigned char *buf)
+{
+	struct usb_buf_header *hdr = usb_buf_header(buf);
+	if(hdr->dma) {
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+		size_t total = BUF_OFFSET + hdr->size;
+		dev->stats.dma_buffers--;
+		libusb_dev_mem_free(dev->handle, (unsigned char *)hdr, total);
+		mutex_lock(&dev_mem_mutex);
+		dev_mem_used -= total;
+		mutex_unlock(&dev_mem_mutex);
+#endif
+	} else {
+		dev->stats.heap_buffers--;
+		free(hdr);
+	}
+}
+
+static int tx_pool_init(struct usb_device *dev)
+{
+	int i;
+	for(i = 0; i < TX_POOL_SIZE; i++) {
+		dev->tx_slots[i].dev = dev;
+		dev->tx_slots[i].buf = NULL;
+		dev->tx_slots[i].xfer = libusb_alloc_transfer(0);
+		if(!dev->tx_slots[i].xfer) {
+			usbmuxd_log(LL_ERROR, "Could not allocate TX transfers for device %d-%d", dev->bus, dev->address);
+			return -1;
+		}
+		dev->tx_free[i] = i;
+	}
+	dev->tx_free_head = 0;
+	dev->tx_free_count = TX_POOL_SIZE;
+	return 0;
+}
+
+// caller must hold xfer_mutex
+static void tx_pool_free(struct usb_device *dev)
+{
+	int i;
+	for(i = 0; i < TX_POOL_SIZE; i++) {
+		if(dev->tx_slots[i].xfer)
+			libusb_free_transfer(dev->tx_slots[i].xfer);
+		if(dev->tx_slots[i].buf)
+			usb_buf_free(dev, dev->tx_slots[i].buf);
+		dev->tx_slots[i].xfer = NULL;
+		dev->tx_slots[i].buf = NULL;
+	}
+}
+
+// take a slot off the free ring, keeping reserve slots free; caller must hold xfer_mutex
+static struct usb_tx_slot *tx_slot_get(struct usb_device *dev, int reserve)
+{
+	struct usb_tx_slot *slot;
+	if(dev->tx_free_count <= reserve)
+		return NULL;
+	slot = &dev->tx_slots[dev->tx_free[dev->tx_free_head]];
+	dev->tx_free_head = (dev->tx_free_head + 1) % TX_POOL_SIZE;
+	dev->tx_free_count--;
+	return slot;
+}
+
+// caller must hold xfer_mutex
+static void tx_slot_put(struct usb_device *dev, struct usb_tx_slot *slot)
+{
+	dev->tx_free[(dev->tx_free_head + dev->tx_free_count) % TX_POOL_SIZE] = slot - dev->tx_slots;
+	dev->tx_free_count++;
+}
+
+static struct usb_tx_slot *tx_slot_from_buffer(unsigned char *buf)
+{
+	return usb_buf_header(buf)->slot;
+}
+
+// caller must hold xfer_mutex
+static int usb_drained(struct usb_device *dev)
+{
+	return dev->disconnecting && !collection_count(&dev->rx_xfers) && !collection_count(&dev->rx_retiring) && !collection_count(&dev->tx_xfers) && !dev->worker_jobs;
+}
+
+// Let the context handling USB events look at the device list, so work
+// finished on another thread does not wait for its next timeout
+static void usb_wake_event_handler(void)
+{
+#if LIBUSB_API_VERSION >= 0x01000105
+	libusb_interrupt_event_handler(NULL);
+#endif
+}
+
+/*
+ * Final stage of the teardown: all transfers are done, so close the
+ * device and free it. Only called from the USB event context, which
+ * owns the device list.
+ */
+static void usb_release(struct usb_device *dev)
+{
+	usbmuxd_log(LL_DEBUG, "usb_release: closing device %d-%d", dev->bus, dev->address);
+	collection_free(&dev->tx_xfers);
+	collection_free(&dev->rx_xfers);
+	collection_free(&dev->rx_retiring);
+	mutex_lock(&dev->xfer_mutex);
+	tx_pool_free(dev);
+	mutex_unlock(&dev->xfer_mutex);
+	mutex_destroy(&dev->xfer_mutex);
+	libusb_release_interface(dev->handle, dev->interface);
+	libusb_close(dev->handle);
+	dev->handle = NULL;
+	collection_remove(&device_list, dev);
+	free(dev);
+}
 
+/*
+ * Start tearing down a device: cancel all of its transfers and mark it as
+ * draining. The device is released from the completion callback of its
+ * last transfer, or right away if none are in flight, so this never
+ * waits for the transfers to finish.
+ */
 static void usb_disconnect(struct usb_device *dev)
 {
-	if(!dev->handle) {
+	int drained;
+
+	if(!dev->handle || dev->disconnecting) {
 		return;
 	}
 
-	// kill the rx xfer and tx xfers and try to make sure the callbacks
-	// get called before we free the device
+	mutex_lock(&dev->xfer_mutex);
+	if(dev->init_running) {
+		// the configuration thread still uses the handle, reap it afterwards
+		dev->alive = 0;
+		mutex_unlock(&dev->xfer_mutex);
+		return;
+	}
+	dev->disconnecting = 1;
 	FOREACH(struct libusb_transfer *xfer, &dev->rx_xfers) {
 		usbmuxd_log(LL_DEBUG, "usb_disconnect: cancelling RX xfer %p", xfer);
 		libusb_cancel_transfer(xfer);
@@ -98,42 +383,55 @@ static void usb_disconnect(struct usb_device *dev)
 		usbmuxd_log(LL_DEBUG, "usb_disconnect: cancelling TX xfer %p", xfer);
 		libusb_cancel_transfer(xfer);
 	} ENDFOREACH
+	drained = usb_drained(dev);
+	mutex_unlock(&dev->xfer_mutex);
 
-	// Busy-wait until all xfers are closed
-	while(collection_count(&dev->rx_xfers) || collection_count(&dev->tx_xfers)) {
-		struct timeval tv;
-		int res;
+	if(drained)
+		usb_release(dev);
+	else
+		usbmuxd_log(LL_DEBUG, "usb_disconnect: device %d-%d draining", dev->bus, dev->address);
+}
 
-		tv.tv_sec = 0;
-		tv.tv_usec = 1000;
-		if((res = libusb_handle_events_timeout(NULL, &tv)) < 0) {
-			usbmuxd_log(LL_ERROR, "libusb_handle_events_timeout for usb_disconnect failed: %s", libusb_error_name(res));
-			break;
-		}
-	}
+static void usb_device_start(struct usb_device *usbdev);
+static void usb_device_remove(struct usb_device *usbdev);
+static void rx_reclaim_idle(struct usb_device *dev);
+static int get_desired_mode(void);
 
-	collection_free(&dev->tx_xfers);
-	collection_free(&dev->rx_xfers);
-	libusb_release_interface(dev->handle, dev->interface);
-	libusb_close(dev->handle);
-	dev->handle = NULL;
-	collection_remove(&device_list, dev);
-	free(dev);
+// caller must hold xfer_mutex
+static int usb_init_ready(struct usb_device *dev)
+{
+	return dev->alive && !dev->started && !dev->init_running && dev->configured && dev->serial_done;
 }
 
+// Remove dead devices, release drained ones and start devices whose
+// initialization steps all finished
 static void reap_dead_devices(void) {
 	FOREACH(struct usb_device *usbdev, &device_list) {
-		if(!usbdev->alive) {
-			device_remove(usbdev);
+		int running, drained, ready;
+		mutex_lock(&usbdev->xfer_mutex);
+		running = usbdev->init_running;
+		drained = usb_drained(usbdev);
+		ready = usb_init_ready(usbdev);
+		mutex_unlock(&usbdev->xfer_mutex);
+		if(running)
+			continue;
+		if(usbdev->disconnecting) {
+			// the last transfer may have completed on a worker thread
+			if(drained)
+				usb_release(usbdev);
+		} else if(!usbdev->alive) {
+			usb_device_remove(usbdev);
 			usb_disconnect(usbdev);
+		} else if(ready) {
+			usb_device_start(usbdev);
+		} else if(usbdev->started) {
+			rx_reclaim_idle(usbdev);
 		}
 	} ENDFOREACH
 }
 
-// Callback from write operation
-static void tx_callback(struct libusb_transfer *xfer)
+static void tx_check_status(struct usb_device *dev, struct libusb_transfer *xfer)
 {
-	struct usb_device *dev = xfer->user_data;
 	usbmuxd_log(LL_SPEW, "TX callback dev %d-%d len %d -> %d status %d", dev->bus, dev->address, xfer->length, xfer->actual_length, xfer->status);
 	if(xfer->status != LIBUSB_TRANSFER_COMPLETED) {
 		switch(xfer->status) {
@@ -167,10 +465,148 @@ static void tx_callback(struct libusb_transfer *xfer)
 		// we'll do device_remove there too
 		dev->alive = 0;
 	}
+}
+
+// Callback from write operation
+static void tx_callback(struct libusb_transfer *xfer)
+{
+	struct usb_device *dev = xfer->user_data;
+	int drained;
+	tx_check_status(dev, xfer);
 	if(xfer->buffer)
 		free(xfer->buffer);
+	mutex_lock(&dev->xfer_mutex);
 	collection_remove(&dev->tx_xfers, xfer);
+	drained = usb_drained(dev);
+	mutex_unlock(&dev->xfer_mutex);
 	libusb_free_transfer(xfer);
+	if(drained)
+		usb_release(dev);
+}
+
+static void tx_resume_job(void *data)
+{
+	struct usb_device *dev = data;
+	int drained;
+	device_tx_resume(dev);
+	mutex_lock(&dev->xfer_mutex);
+	dev->worker_jobs--;
+	drained = usb_drained(dev);
+	mutex_unlock(&dev->xfer_mutex);
+	// dev may be gone from here on
+	if(drained)
+		usb_wake_event_handler();
+}
+
+// Callback from write operation using a pooled transfer
+static void tx_pool_callback(struct libusb_transfer *xfer)
+{
+	struct usb_tx_slot *slot = xfer->user_data;
+	struct usb_device *dev = slot->dev;
+	int resume = 0;
+	int drained;
+
+	tx_check_status(dev, xfer);
+
+	mutex_lock(&dev->xfer_mutex);
+	collection_remove(&dev->tx_xfers, xfer);
+	tx_slot_put(dev, slot);
+	if(dev->tx_waiting && !dev->disconnecting) {
+		dev->tx_waiting = 0;
+		resume = 1;
+		if(dev->worker)
+			dev->worker_jobs++;
+	}
+	drained = usb_drained(dev);
+	mutex_unlock(&dev->xfer_mutex);
+
+	if(drained) {
+		usb_release(dev);
+		return;
+	}
+	if(!resume)
+		return;
+	if(!dev->worker) {
+		device_tx_resume(dev);
+	} else if(worker_post(dev->worker, tx_resume_job, dev) < 0) {
+		usbmuxd_log(LL_ERROR, "Could not notify worker of free TX transfers for device %d-%d", dev->bus, dev->address);
+		mutex_lock(&dev->xfer_mutex);
+		dev->worker_jobs--;
+		dev->tx_waiting = 1;
+		mutex_unlock(&dev->xfer_mutex);
+	}
+}
+
+static void usb_remove_job(void *data)
+{
+	struct usb_device *dev = data;
+	int drained;
+	device_remove(dev);
+	mutex_lock(&dev->xfer_mutex);
+	dev->worker_jobs--;
+	drained = usb_drained(dev);
+	mutex_unlock(&dev->xfer_mutex);
+	// dev may be gone from here on
+	if(drained)
+		usb_wake_event_handler();
+}
+
+/*
+ * Remove a device from the mux layer. Its connections belong to its
+ * worker, so the removal is queued there behind the RX data still
+ * waiting to be processed. The device is not released before the job
+ * ran, and the USB event thread does not wait for it.
+ */
+static void usb_device_remove(struct usb_device *dev)
+{
+	if(!dev->worker) {
+		device_remove(dev);
+		return;
+	}
+	mutex_lock(&dev->xfer_mutex);
+	dev->worker_jobs++;
+	mutex_unlock(&dev->xfer_mutex);
+	if(worker_post(dev->worker, usb_remove_job, dev) < 0) {
+		usbmuxd_log(LL_ERROR, "Could not queue removal of device %d-%d, waiting for its worker", dev->bus, dev->address);
+		worker_call(dev->worker, usb_remove_job, dev);
+	}
+}
+
+/**
+ * Submit a transfer and keep track of it in the given collection.
+ * The transfer is added before submitting it, because with a separate
+ * event thread its callback might run before libusb_submit_transfer()
+ * returns.
+ */
+static int submit_tracked_transfer(struct usb_device *dev, struct collection *xfers, struct libusb_transfer *xfer)
+{
+	int res;
+	mutex_lock(&dev->xfer_mutex);
+	collection_add(xfers, xfer);
+	mutex_unlock(&dev->xfer_mutex);
+	res = libusb_submit_transfer(xfer);
+	if(res < 0) {
+		mutex_lock(&dev->xfer_mutex);
+		collection_remove(xfers, xfer);
+		mutex_unlock(&dev->xfer_mutex);
+	}
+	return res;
+}
+
+// Send a Zero Length Packet using a dedicated transfer
+static int send_zlp(struct usb_device *dev)
+{
+	int res;
+	struct libusb_transfer *xfer = libusb_alloc_transfer(0);
+	void *buffer = malloc(1);
+	libusb_fill_bulk_transfer(xfer, dev->handle, dev->ep_out, buffer, 0, tx_callback, dev, 0);
+	if((res = submit_tracked_transfer(dev, &dev->tx_xfers, xfer)) < 0) {
+		usbmuxd_log(LL_ERROR, "Failed to submit TX ZLP transfer to device %d-%d: %s", dev->bus, dev->address, libusb_error_name(res));
+		free(buffer);
+		libusb_free_transfer(xfer);
+		return res;
+	}
+	return 0;
 }
 
 int usb_send(struct usb_device *dev, const unsigned char *buf, int length)
@@ -178,38 +614,330 @@ int usb_send(struct usb_device *dev, const unsigned char *buf, int length)
 	int res;
 	struct libusb_transfer *xfer = libusb_alloc_transfer(0);
 	libusb_fill_bulk_transfer(xfer, dev->handle, dev->ep_out, (void*)buf, length, tx_callback, dev, 0);
-	if((res = libusb_submit_transfer(xfer)) < 0) {
+	if((res = submit_tracked_transfer(dev, &dev->tx_xfers, xfer)) < 0) {
 		usbmuxd_log(LL_ERROR, "Failed to submit TX transfer %p len %d to device %d-%d: %s", buf, length, dev->bus, dev->address, libusb_error_name(res));
 		libusb_free_transfer(xfer);
 		return res;
 	}
-	collection_add(&dev->tx_xfers, xfer);
 	if (length % dev->wMaxPacketSize == 0) {
 		usbmuxd_log(LL_DEBUG, "Send ZLP");
-		// Send Zero Length Packet
-		xfer = libusb_alloc_transfer(0);
-		void *buffer = malloc(1);
-		libusb_fill_bulk_transfer(xfer, dev->handle, dev->ep_out, buffer, 0, tx_callback, dev, 0);
-		if((res = libusb_submit_transfer(xfer)) < 0) {
+		return send_zlp(dev);
+	}
+	return 0;
+}
+
+/**
+ * Get a buffer of USB_MTU bytes from the device's TX pool.
+ *
+ * @param dev The USB device.
+ * @param bulk Nonzero for bulk data. Bulk data leaves a few transfers
+ *   free for control packets, and when it finds the pool exhausted
+ *   device_tx_resume() is called once transfers complete.
+ * @return The buffer, or NULL if all transfers are in flight.
+ */
+unsigned char *usb_get_tx_buffer(struct usb_device *dev, int bulk)
+{
+	struct usb_tx_slot *slot;
+
+	mutex_lock(&dev->xfer_mutex);
+	slot = tx_slot_get(dev, bulk ? TX_POOL_RESERVE : 0);
+	if(!slot && bulk)
+		dev->tx_waiting = 1;
+	if(slot && !slot->buf) {
+		slot->buf = usb_buf_alloc(dev, USB_MTU);
+		if(!slot->buf) {
+			usbmuxd_log(LL_FATAL, "%s: Failed to allocate TX buffer.", __func__);
+			tx_slot_put(dev, slot);
+			slot = NULL;
+		} else {
+			usb_buf_header(slot->buf)->slot = slot;
+		}
+	}
+	mutex_unlock(&dev->xfer_mutex);
+	if(!slot)
+		return NULL;
+	return slot->buf;
+}
+
+/**
+ * Return a buffer obtained with usb_get_tx_buffer() without sending it.
+ */
+void usb_release_tx_buffer(struct usb_device *dev, unsigned char *buf)
+{
+	mutex_lock(&dev->xfer_mutex);
+	tx_slot_put(dev, tx_slot_from_buffer(buf));
+	mutex_unlock(&dev->xfer_mutex);
+}
+
+/**
+ * Send a buffer obtained with usb_get_tx_buffer(). The buffer goes back
+ * to the pool once the transfer completed, or right away on error.
+ *
+ * @param dev The USB device.
+ * @param buf The pool buffer.
+ * @param length Number of bytes to send, at most USB_MTU.
+ * @return 0 on success or a negative libusb error code.
+ */
+int usb_send_tx_buffer(struct usb_device *dev, unsigned char *buf, int length)
+{
+	static unsigned char zlp_buffer[1];
+	struct usb_tx_slot *slot = tx_slot_from_buffer(buf);
+	int res;
+
+	libusb_fill_bulk_transfer(slot->xfer, dev->handle, dev->ep_out, buf, length, tx_pool_callback, slot, 0);
+	if((res = submit_tracked_transfer(dev, &dev->tx_xfers, slot->xfer)) < 0) {
+		usbmuxd_log(LL_ERROR, "Failed to submit TX transfer %p len %d to device %d-%d: %s", buf, length, dev->bus, dev->address, libusb_error_name(res));
+		usb_release_tx_buffer(dev, buf);
+		return res;
+	}
+	if (length % dev->wMaxPacketSize == 0) {
+		usbmuxd_log(LL_DEBUG, "Send ZLP");
+		mutex_lock(&dev->xfer_mutex);
+		slot = tx_slot_get(dev, 0);
+		mutex_unlock(&dev->xfer_mutex);
+		if(!slot) {
+			// pool exhausted, use a dedicated transfer
+			return send_zlp(dev);
+		}
+		libusb_fill_bulk_transfer(slot->xfer, dev->handle, dev->ep_out, zlp_buffer, 0, tx_pool_callback, slot, 0);
+		if((res = submit_tracked_transfer(dev, &dev->tx_xfers, slot->xfer)) < 0) {
 			usbmuxd_log(LL_ERROR, "Failed to submit TX ZLP transfer to device %d-%d: %s", dev->bus, dev->address, libusb_error_name(res));
-			libusb_free_transfer(xfer);
+			mutex_lock(&dev->xfer_mutex);
+			tx_slot_put(dev, slot);
+			mutex_unlock(&dev->xfer_mutex);
 			return res;
 		}
-		collection_add(&dev->tx_xfers, xfer);
 	}
 	return 0;
 }
 
+static void rx_callback(struct libusb_transfer *xfer);
+
+// caller must hold xfer_mutex
+static struct libusb_transfer *rx_transfer_new(struct usb_device *dev)
+{
+	struct libusb_transfer *xfer = libusb_alloc_transfer(0);
+	unsigned char *buf = xfer ? usb_buf_alloc(dev, dev->rx_size) : NULL;
+	if(!buf) {
+		usbmuxd_log(LL_ERROR, "Failed to allocate RX transfer for device %d-%d", dev->bus, dev->address);
+		libusb_free_transfer(xfer);
+		return NULL;
+	}
+	libusb_fill_bulk_transfer(xfer, dev->handle, dev->ep_in, buf, dev->rx_size, rx_callback, dev, 0);
+	return xfer;
+}
+
+// caller must hold xfer_mutex
+static void rx_transfer_free(struct usb_device *dev, struct libusb_transfer *xfer)
+{
+	usb_buf_free(dev, xfer->buffer);
+	libusb_free_transfer(xfer);
+}
+
+// caller must hold xfer_mutex
+static void rx_update_depth(struct usb_device *dev)
+{
+	dev->stats.rx_depth = collection_count(&dev->rx_xfers);
+	if(dev->stats.rx_depth > dev->stats.rx_depth_peak)
+		dev->stats.rx_depth_peak = dev->stats.rx_depth;
+}
+
+/*
+ * Decide how the RX queue of a device changes after a completed transfer.
+ * Caller must hold xfer_mutex.
+ *
+ * @return 1 to add a transfer, -1 to retire the completed one, 0 otherwise.
+ */
+static int rx_adapt_depth(struct usb_device *dev, struct libusb_transfer *xfer)
+{
+	int depth = collection_count(&dev->rx_xfers);
+	uint64_t now = mstime64();
+
+	dev->stats.rx_transfers++;
+	if(xfer->actual_length == xfer->length)
+		dev->stats.rx_full_transfers++;
+	// large transfers mostly end short at a packet boundary, so anything
+	// of USB_MRU or more counts as busy too
+	if(xfer->actual_length == xfer->length || xfer->actual_length >= USB_MRU) {
+		dev->rx_last_busy = now;
+		if(++dev->rx_full_streak >= depth && depth < rx_depth_max) {
+			dev->rx_full_streak = 0;
+			return 1;
+		}
+		return 0;
+	}
+	dev->rx_full_streak = 0;
+	if(depth > rx_depth_min && now - dev->rx_last_busy >= RX_IDLE_TIME) {
+		dev->rx_last_busy = now;
+		return -1;
+	}
+	return 0;
+}
+
+// caller must hold xfer_mutex
+static int rx_is_retiring(struct usb_device *dev, struct libusb_transfer *xfer)
+{
+	FOREACH(struct libusb_transfer *r, &dev->rx_retiring) {
+		if(r == xfer)
+			return 1;
+	} ENDFOREACH
+	return 0;
+}
+
+/*
+ * Shrink the RX queue of a device that stopped sending. Transfers only
+ * give their slot back when they complete, so without this a device that
+ * goes silent after a burst keeps all of them queued. The transfers above
+ * the lower bound are cancelled and freed when their cancellation
+ * completes. Only called from the USB event context.
+ */
+static void rx_reclaim_idle(struct usb_device *dev)
+{
+	int depth;
+
+	mutex_lock(&dev->xfer_mutex);
+	depth = collection_count(&dev->rx_xfers);
+	if(dev->disconnecting || depth <= rx_depth_min || mstime64() - dev->rx_last_busy < RX_IDLE_TIME) {
+		mutex_unlock(&dev->xfer_mutex);
+		return;
+	}
+	FOREACH(struct libusb_transfer *xfer, &dev->rx_xfers) {
+		if(depth <= rx_depth_min)
+			break;
+		// fails for transfers that completed and wait for processing
+		if(libusb_cancel_transfer(xfer) == 0) {
+			collection_remove(&dev->rx_xfers, xfer);
+			collection_add(&dev->rx_retiring, xfer);
+			depth--;
+		}
+	} ENDFOREACH
+	dev->rx_last_busy = mstime64();
+	rx_update_depth(dev);
+	mutex_unlock(&dev->xfer_mutex);
+	usbmuxd_log(LL_DEBUG, "Device %d-%d RX idle, queue depth now %d", dev->bus, dev->address, depth);
+}
+
+// whether any device has more RX transfers queued than the lower bound
+static int rx_above_min(void)
+{
+	int above = 0;
+	FOREACH(struct usb_device *usbdev, &device_list) {
+		mutex_lock(&usbdev->xfer_mutex);
+		if(usbdev->started && !usbdev->disconnecting && collection_count(&usbdev->rx_xfers) > rx_depth_min)
+			above = 1;
+		mutex_unlock(&usbdev->xfer_mutex);
+		if(above)
+			break;
+	} ENDFOREACH
+	return above;
+}
+
+// Resubmit a completed RX transfer, adjusting the number of transfers in flight
+static void rx_continue(struct usb_device *dev, struct libusb_transfer *xfer)
+{
+	struct libusb_transfer *extra = NULL;
+	int res = LIBUSB_ERROR_NO_DEVICE;
+	int adapt = 0;
+	int drained = 0;
+
+	mutex_lock(&dev->xfer_mutex);
+	if(rx_is_retiring(dev, xfer)) {
+		// completed before the cancellation took effect
+		collection_remove(&dev->rx_retiring, xfer);
+		rx_transfer_free(dev, xfer);
+		drained = usb_drained(dev);
+		mutex_unlock(&dev->xfer_mutex);
+		if(drained)
+			usb_wake_event_handler();
+		return;
+	}
+	if(!dev->disconnecting) {
+		adapt = rx_adapt_depth(dev, xfer);
+		if(adapt < 0) {
+			collection_remove(&dev->rx_xfers, xfer);
+			rx_transfer_free(dev, xfer);
+			rx_update_depth(dev);
+			usbmuxd_log(LL_DEBUG, "Device %d-%d RX idle, queue depth now %d", dev->bus, dev->address, dev->stats.rx_depth);
+			mutex_unlock(&dev->xfer_mutex);
+			return;
+		}
+		res = libusb_submit_transfer(xfer);
+	}
+	if(res < 0) {
+		if(!dev->disconnecting) {
+			usbmuxd_log(LL_ERROR, "Failed to resubmit RX transfer to device %d-%d: %s", dev->bus, dev->address, libusb_error_name(res));
+			dev->alive = 0;
+		}
+		collection_remove(&dev->rx_xfers, xfer);
+		// buffers in device memory must be freed while the device is open
+		rx_transfer_free(dev, xfer);
+		drained = usb_drained(dev);
+	} else if(adapt > 0 && (extra = rx_transfer_new(dev)) != NULL) {
+		// submitted with xfer_mutex held, usb_disconnect could free dev otherwise
+		collection_add(&dev->rx_xfers, extra);
+		if(libusb_submit_transfer(extra) < 0) {
+			collection_remove(&dev->rx_xfers, extra);
+			rx_transfer_free(dev, extra);
+		} else {
+			usbmuxd_log(LL_DEBUG, "Device %d-%d RX busy, queue depth now %d", dev->bus, dev->address, collection_count(&dev->rx_xfers));
+		}
+	}
+	rx_update_depth(dev);
+	mutex_unlock(&dev->xfer_mutex);
+	// dev may be gone from here on
+	if(drained)
+		usb_wake_event_handler();
+}
+
+// Process a completed RX transfer on the device's worker thread and
+// resubmit it, unless the device is going away in the meantime
+static void rx_worker_job(void *data)
+{
+	struct libusb_transfer *xfer = data;
+	struct usb_device *dev = xfer->user_data;
+
+	device_data_input(dev, xfer->buffer, xfer->actual_length);
+	rx_continue(dev, xfer);
+}
+
 // Callback from read operation
 // Under normal operation this issues a new read transfer request immediately,
 // doing a kind of read-callback loop
 static void rx_callback(struct libusb_transfer *xfer)
 {
 	struct usb_device *dev = xfer->user_data;
+	int drained;
+	int retired_data = 0;
 	usbmuxd_log(LL_SPEW, "RX callback dev %d-%d len %d status %d", dev->bus, dev->address, xfer->actual_length, xfer->status);
-	if(xfer->status == LIBUSB_TRANSFER_COMPLETED) {
-		device_data_input(dev, xfer->buffer, xfer->actual_length);
-		libusb_submit_transfer(xfer);
+	if(xfer->status == LIBUSB_TRANSFER_CANCELLED) {
+		mutex_lock(&dev->xfer_mutex);
+		if(rx_is_retiring(dev, xfer)) {
+			if(xfer->actual_length > 0) {
+				// cancelled by rx_reclaim_idle() while data was arriving, which must not be lost;
+				// rx_continue() retires it once the data is processed
+				retired_data = 1;
+			} else {
+				// cancelled by rx_reclaim_idle(), the device is fine
+				collection_remove(&dev->rx_retiring, xfer);
+				rx_transfer_free(dev, xfer);
+				drained = usb_drained(dev);
+				mutex_unlock(&dev->xfer_mutex);
+				if(drained)
+					usb_release(dev);
+				return;
+			}
+		}
+		mutex_unlock(&dev->xfer_mutex);
+	}
+	if(xfer->status == LIBUSB_TRANSFER_COMPLETED || retired_data) {
+		if(!dev->worker) {
+			device_data_input(dev, xfer->buffer, xfer->actual_length);
+			rx_continue(dev, xfer);
+			return;
+		}
+		if(worker_post(dev->worker, rx_worker_job, xfer) == 0)
+			return;
+		usbmuxd_log(LL_ERROR, "Could not pass RX data of device %d-%d to its worker", dev->bus, dev->address);
 	} else {
 		switch(xfer->status) {
 			case LIBUSB_TRANSFER_COMPLETED: //shut up compiler
@@ -238,36 +966,172 @@ static void rx_callback(struct libusb_transfer *xfer)
 				// this should never be reached.
 				break;
 		}
+	}
 
-		free(xfer->buffer);
-		collection_remove(&dev->rx_xfers, xfer);
-		libusb_free_transfer(xfer);
+	// we can't usb_disconnect here due to a deadlock, so instead mark it as dead and reap it after processing events
+	// we'll do device_remove there too
+	dev->alive = 0;
 
-		// we can't usb_disconnect here due to a deadlock, so instead mark it as dead and reap it after processing events
-		// we'll do device_remove there too
-		dev->alive = 0;
-	}
+	mutex_lock(&dev->xfer_mutex);
+	// a transfer cancelled by rx_reclaim_idle() can still fail, e.g. on unplug
+	if(rx_is_retiring(dev, xfer))
+		collection_remove(&dev->rx_retiring, xfer);
+	else
+		collection_remove(&dev->rx_xfers, xfer);
+	rx_transfer_free(dev, xfer);
+	rx_update_depth(dev);
+	drained = usb_drained(dev);
+	mutex_unlock(&dev->xfer_mutex);
+	if(drained)
+		usb_release(dev);
 }
 
 // Start a read-callback loop for this device
 static int start_rx_loop(struct usb_device *dev)
 {
 	int res;
-	void *buf;
-	struct libusb_transfer *xfer = libusb_alloc_transfer(0);
-	buf = malloc(USB_MRU);
-	libusb_fill_bulk_transfer(xfer, dev->handle, dev->ep_in, buf, USB_MRU, rx_callback, dev, 0);
-	if((res = libusb_submit_transfer(xfer)) != 0) {
+	struct libusb_transfer *xfer;
+
+	mutex_lock(&dev->xfer_mutex);
+	xfer = rx_transfer_new(dev);
+	mutex_unlock(&dev->xfer_mutex);
+	if(!xfer)
+		return LIBUSB_ERROR_NO_MEM;
+	res = submit_tracked_transfer(dev, &dev->rx_xfers, xfer);
+	mutex_lock(&dev->xfer_mutex);
+	if(res != 0) {
 		usbmuxd_log(LL_ERROR, "Failed to submit RX transfer to device %d-%d: %s", dev->bus, dev->address, libusb_error_name(res));
-		libusb_free_transfer(xfer);
-		return res;
+		rx_transfer_free(dev, xfer);
 	}
+	rx_update_depth(dev);
+	mutex_unlock(&dev->xfer_mutex);
+	if(res != 0)
+		return res;
+
+	return 0;
+}
 
-	collection_add(&dev->rx_xfers, xfer);
 
+// Devices of the same model and firmware share their configuration, so
+// the serial number is not part of the key and need not be read first
+static void device_cache_key(struct usb_device *dev, char *key, size_t size)
+{
+	snprintf(key, size, "%04x:%04x:%04x:%d", dev->devdesc.idVendor, dev->devdesc.idProduct, dev->devdesc.bcdDevice, dev->devdesc.bNumConfigurations);
+}
+
+static int device_cache_get_uint(plist_t entry, const char *key, uint64_t *val)
+{
+	plist_t node = plist_dict_get_item(entry, key);
+	if(!node || plist_get_node_type(node) != PLIST_UINT)
+		return -1;
+	plist_get_uint_val(node, val);
 	return 0;
 }
 
+/*
+ * Look up the configuration used for this kind of device the last time.
+ * The key includes the number of configurations, which changes with the
+ * device mode, so a device in a different mode than before is probed again.
+ */
+static int device_cache_lookup(struct usb_device *dev)
+{
+	char key[32];
+	uint64_t mode, configuration, interface, ep_in, ep_out;
+	plist_t entry;
+
+	if(!device_cache)
+		return 0;
+	device_cache_key(dev, key, sizeof(key));
+	mutex_lock(&device_cache_mutex);
+	entry = plist_dict_get_item(device_cache, key);
+	if(!entry || plist_get_node_type(entry) != PLIST_DICT ||
+	   device_cache_get_uint(entry, "DesiredMode", &mode) < 0 || (int)mode != get_desired_mode() ||
+	   device_cache_get_uint(entry, "Configuration", &configuration) < 0 ||
+	   device_cache_get_uint(entry, "Interface", &interface) < 0 ||
+	   device_cache_get_uint(entry, "EndpointIn", &ep_in) < 0 ||
+	   device_cache_get_uint(entry, "EndpointOut", &ep_out) < 0) {
+		mutex_unlock(&device_cache_mutex);
+		return 0;
+	}
+	mutex_unlock(&device_cache_mutex);
+	dev->configuration = (int)configuration;
+	dev->interface = (uint8_t)interface;
+	dev->ep_in = (uint8_t)ep_in;
+	dev->ep_out = (uint8_t)ep_out;
+	dev->cached = 1;
+	return 1;
+}
+
+static int device_cache_has_uint(plist_t entry, const char *key, uint64_t val)
+{
+	uint64_t cur;
+	return device_cache_get_uint(entry, key, &cur) == 0 && cur == val;
+}
+
+/*
+ * Remember the configuration of a probed device for its next attach.
+ * This only updates the cache in memory; the main loop writes it to disk
+ * with usb_write_device_cache(), so a burst of new devices neither blocks
+ * the USB event handling nor causes a write per device.
+ */
+static void device_cache_store(struct usb_device *dev)
+{
+	char key[32];
+	plist_t entry;
+
+	if(!device_cache || dev->cached)
+		return;
+	device_cache_key(dev, key, sizeof(key));
+	mutex_lock(&device_cache_mutex);
+	entry = plist_dict_get_item(device_cache, key);
+	if(entry && plist_get_node_type(entry) == PLIST_DICT &&
+	   device_cache_has_uint(entry, "DesiredMode", get_desired_mode()) &&
+	   device_cache_has_uint(entry, "Configuration", dev->configuration) &&
+	   device_cache_has_uint(entry, "Interface", dev->interface) &&
+	   device_cache_has_uint(entry, "EndpointIn", dev->ep_in) &&
+	   device_cache_has_uint(entry, "EndpointOut", dev->ep_out)) {
+		// another device of the same kind stored it already
+		mutex_unlock(&device_cache_mutex);
+		return;
+	}
+	entry = plist_new_dict();
+	plist_dict_set_item(entry, "DesiredMode", plist_new_uint(get_desired_mode()));
+	plist_dict_set_item(entry, "Configuration", plist_new_uint(dev->configuration));
+	plist_dict_set_item(entry, "Interface", plist_new_uint(dev->interface));
+	plist_dict_set_item(entry, "EndpointIn", plist_new_uint(dev->ep_in));
+	plist_dict_set_item(entry, "EndpointOut", plist_new_uint(dev->ep_out));
+	plist_dict_set_item(device_cache, key, entry);
+	device_cache_dirty = 1;
+	mutex_unlock(&device_cache_mutex);
+	evloop_wakeup(main_evloop);
+}
+
+/**
+ * Write the device cache to disk if entries were added since the last
+ * time. Must be called from the main loop.
+ */
+void usb_write_device_cache(void)
+{
+	plist_t cache;
+
+	if(!device_cache)
+		return;
+	mutex_lock(&device_cache_mutex);
+	if(!device_cache_dirty) {
+		mutex_unlock(&device_cache_mutex);
+		return;
+	}
+	device_cache_dirty = 0;
+	cache = plist_copy(device_cache);
+	mutex_unlock(&device_cache_mutex);
+
+	if(config_set_usb_device_cache(cache) < 0)
+		usbmuxd_log(LL_WARNING, "Could not store USB device cache");
+	plist_free(cache);
+}
+
+static void usb_serial_done(struct usb_device *usbdev);
+
 static void get_serial_callback(struct libusb_transfer *transfer)
 {
 	unsigned int di, si;
@@ -295,43 +1159,66 @@ static void get_serial_callback(struct libusb_transfer *transfer)
 
 	libusb_free_transfer(transfer);
 
+	usb_serial_done(usbdev);
+}
+
+static void usb_serial_done(struct usb_device *usbdev)
+{
 	/* new style UDID: add hyphen between first 8 and following 16 digits */
-	if (di == 24) {
+	if (strlen(usbdev->serial) == 24) {
 		memmove(&usbdev->serial[9], &usbdev->serial[8], 16);
 		usbdev->serial[8] = '-';
-		usbdev->serial[di+1] = '\0';
+		usbdev->serial[25] = '\0';
 	}
 
+	usb_set_init_stage(usbdev, USB_INIT_SERIAL);
+	mutex_lock(&usbdev->xfer_mutex);
+	usbdev->serial_done = 1;
+	int ready = usb_init_ready(usbdev);
+	mutex_unlock(&usbdev->xfer_mutex);
+	if(ready)
+		usb_device_start(usbdev);
+}
+
+// Last initialization step, once the device is configured and its serial is known
+static void usb_device_start(struct usb_device *usbdev)
+{
+	usbdev->started = 1;
+	usb_set_init_stage(usbdev, USB_INIT_STARTED);
+	device_cache_store(usbdev);
+
 	/* Finish setup now */
 	if(device_add(usbdev) < 0) {
 		usb_disconnect(usbdev);
 		return;
 	}
 
-	// Spin up NUM_RX_LOOPS parallel usb data retrieval loops
+	// Spin up rx_depth_min parallel usb data retrieval loops, more are
+	// added while the device keeps them busy
 	// Old usbmuxds used only 1 rx loop, but that leaves the
 	// USB port sleeping most of the time
-	int rx_loops = NUM_RX_LOOPS;
-	for (rx_loops = NUM_RX_LOOPS; rx_loops > 0; rx_loops--) {
+	usbdev->rx_last_busy = mstime64();
+	int rx_loops;
+	for (rx_loops = rx_depth_min; rx_loops > 0; rx_loops--) {
 		if(start_rx_loop(usbdev) < 0) {
-			usbmuxd_log(LL_WARNING, "Failed to start RX loop number %d", NUM_RX_LOOPS - rx_loops);
+			usbmuxd_log(LL_WARNING, "Failed to start RX loop number %d", rx_depth_min - rx_loops);
 			break;
 		}
 	}
 
 	// Ensure we have at least 1 RX loop going
-	if (rx_loops == NUM_RX_LOOPS) {
+	if (rx_loops == rx_depth_min) {
 		usbmuxd_log(LL_FATAL, "Failed to start any RX loop for device %d-%d",
 					usbdev->bus, usbdev->address);
-		device_remove(usbdev);
+		usb_device_remove(usbdev);
 		usb_disconnect(usbdev);
 		return;
 	} else if (rx_loops > 0) {
 		usbmuxd_log(LL_WARNING, "Failed to start all %d RX loops. Going on with %d loops. "
 					"This may have negative impact on device read speed.",
-					NUM_RX_LOOPS, NUM_RX_LOOPS - rx_loops);
+					rx_depth_min, rx_depth_min - rx_loops);
 	} else {
-		usbmuxd_log(LL_DEBUG, "All %d RX loops started successfully", NUM_RX_LOOPS);
+		usbmuxd_log(LL_DEBUG, "All %d RX loops started successfully", rx_depth_min);
 	}
 }
 
@@ -365,6 +1252,90 @@ static void get_langid_callback(struct libusb_transfer *transfer)
 	}
 }
 
+/*
+ * The kernel reads the serial number string when the device is enumerated
+ * and exposes it in sysfs, so there is no need to ask the device again.
+ */
+static int read_sysfs_serial(struct usb_device *usbdev)
+{
+#ifdef __linux__
+	uint8_t ports[7];
+	char path[64];
+	size_t len;
+	int count, i, pos;
+	FILE *f;
+
+	count = libusb_get_port_numbers(libusb_get_device(usbdev->handle), ports, sizeof(ports));
+	if(count <= 0)
+		return -1;
+	pos = snprintf(path, sizeof(path), "/sys/bus/usb/devices/%d-%d", usbdev->bus, ports[0]);
+	for(i = 1; i < count; i++)
+		pos += snprintf(path + pos, sizeof(path) - pos, ".%d", ports[i]);
+	snprintf(path + pos, sizeof(path) - pos, "/serial");
+
+	f = fopen(path, "r");
+	if(!f)
+		return -1;
+	if(!fgets(usbdev->serial, sizeof(usbdev->serial), f)) {
+		fclose(f);
+		usbdev->serial[0] = '\0';
+		return -1;
+	}
+	fclose(f);
+
+	len = strcspn(usbdev->serial, "\r\n");
+	usbdev->serial[len] = '\0';
+	if(len == 0)
+		return -1;
+	for(i = 0; i < (int)len; i++) {
+		if(usbdev->serial[i] < 0x20 || usbdev->serial[i] > 0x7e)
+			usbdev->serial[i] = '?';
+	}
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+// Request the serial number, first reading the language ID it is stored with
+static int request_serial(struct usb_device *usbdev)
+{
+	int res;
+
+	if(usbdev->devdesc.iSerialNumber && read_sysfs_serial(usbdev) == 0) {
+		usbmuxd_log(LL_INFO, "Got serial '%s' for device %d-%d from sysfs", usbdev->serial, usbdev->bus, usbdev->address);
+		usb_serial_done(usbdev);
+		return 0;
+	}
+
+	struct libusb_transfer *transfer = libusb_alloc_transfer(0);
+	unsigned char *transfer_buffer = malloc(1024 + LIBUSB_CONTROL_SETUP_SIZE + 8);
+	if(!transfer || !transfer_buffer) {
+		usbmuxd_log(LL_WARNING, "Failed to allocate transfer for device %d-%d", usbdev->bus, usbdev->address);
+		libusb_free_transfer(transfer);
+		free(transfer_buffer);
+		return -1;
+	}
+	memset(transfer_buffer, '\0', 1024 + LIBUSB_CONTROL_SETUP_SIZE + 8);
+
+	/**
+	 * From libusb:
+	 * 	Asking for the zero'th index is special - it returns a string
+	 * 	descriptor that contains all the language IDs supported by the
+	 * 	device.
+	 **/
+	libusb_fill_control_setup(transfer_buffer, LIBUSB_ENDPOINT_IN, LIBUSB_REQUEST_GET_DESCRIPTOR, LIBUSB_DT_STRING << 8, 0, 1024 + LIBUSB_CONTROL_SETUP_SIZE);
+	libusb_fill_control_transfer(transfer, usbdev->handle, transfer_buffer, get_langid_callback, usbdev, 1000);
+
+	if((res = libusb_submit_transfer(transfer)) < 0) {
+		usbmuxd_log(LL_ERROR, "Could not request transfer for device %d-%d: %s", usbdev->bus, usbdev->address, libusb_error_name(res));
+		libusb_free_transfer(transfer);
+		free(transfer_buffer);
+		return -1;
+	}
+	return 0;
+}
+
 static int submit_vendor_specific(struct libusb_device_handle *handle, struct mode_context *context, libusb_transfer_cb_fn callback) 
 {
 	struct libusb_transfer* ctrl_transfer = libusb_alloc_transfer(0);
@@ -465,6 +1436,26 @@ static int guess_mode(struct libusb_device* dev, struct usb_device *usbdev)
 	return 0;
 }
 
+// Detach kernel drivers from the interfaces of a configuration, so it can be changed
+static void detach_kernel_drivers(struct libusb_device_handle *handle, struct libusb_config_descriptor *config, int bus, int address)
+{
+	int k, res;
+	for(k=0 ; k < config->bNumInterfaces ; k++) {
+		const struct libusb_interface_descriptor *intf1 = &config->interface[k].altsetting[0];
+		if((res = libusb_kernel_driver_active(handle, intf1->bInterfaceNumber)) < 0) {
+			usbmuxd_log(LL_NOTICE, "Could not check kernel ownership of interface %d for device %d-%d: %s", intf1->bInterfaceNumber, bus, address, libusb_error_name(res));
+			continue;
+		}
+		if(res == 1) {
+			usbmuxd_log(LL_INFO, "Detaching kernel driver for device %d-%d, interface %d", bus, address, intf1->bInterfaceNumber);
+			if((res = libusb_detach_kernel_driver(handle, intf1->bInterfaceNumber)) < 0) {
+				usbmuxd_log(LL_WARNING, "Could not detach kernel driver, configuration change will probably fail! %s", libusb_error_name(res));
+				continue;
+			}
+		}
+	}
+}
+
 /// @brief Finds and sets the valid configuration, interface and endpoints on the usb_device
 static int set_valid_configuration(struct libusb_device* dev, struct usb_device *usbdev, struct libusb_device_handle *handle)
 {
@@ -527,20 +1518,7 @@ static int set_valid_configuration(struct libusb_device* dev, struct usb_device
 		}
 		if(current_config == 0 || config->bConfigurationValue != current_config) {
 			usbmuxd_log(LL_NOTICE, "Changing configuration of device %i-%i: %i -> %i", bus, address, current_config, config->bConfigurationValue);
-			for(k=0 ; k < config->bNumInterfaces ; k++) {
-				const struct libusb_interface_descriptor *intf1 = &config->interface[k].altsetting[0];
-				if((res = libusb_kernel_driver_active(handle, intf1->bInterfaceNumber)) < 0) {
-					usbmuxd_log(LL_NOTICE, "Could not check kernel ownership of interface %d for device %d-%d: %s", intf1->bInterfaceNumber, bus, address, libusb_error_name(res));
-					continue;
-				}
-				if(res == 1) {
-					usbmuxd_log(LL_INFO, "Detaching kernel driver for device %d-%d, interface %d", bus, address, intf1->bInterfaceNumber);
-					if((res = libusb_detach_kernel_driver(handle, intf1->bInterfaceNumber)) < 0) {
-						usbmuxd_log(LL_WARNING, "Could not detach kernel driver, configuration change will probably fail! %s", libusb_error_name(res));
-						continue;
-					}
-				}
-			}
+			detach_kernel_drivers(handle, config, bus, address);
 			if((res = libusb_set_configuration(handle, j)) != 0) {
 				usbmuxd_log(LL_WARNING, "Could not set configuration %d for device %d-%d: %s", j, bus, address, libusb_error_name(res));
 				libusb_free_config_descriptor(config);
@@ -548,6 +1526,7 @@ static int set_valid_configuration(struct libusb_device* dev, struct usb_device
 			}
 		}
 		
+		usbdev->configuration = config->bConfigurationValue;
 		libusb_free_config_descriptor(config);
 		break;
 	}
@@ -560,53 +1539,63 @@ static int set_valid_configuration(struct libusb_device* dev, struct usb_device
 	return 0;
 }
 
-static void device_complete_initialization(struct mode_context *context, struct libusb_device_handle *handle) 
+// Apply a configuration from the device cache without walking the descriptors
+static int usb_configure_cached(struct usb_device *usbdev)
 {
-	struct usb_device *usbdev = find_device(context->bus, context->address);
-	if(!usbdev) {
-		usbmuxd_log(LL_ERROR, "Device %d-%d is missing from device list, aborting initialization", context->bus, context->address);
-		return;
-	}
-	struct libusb_device *dev = context->dev;
-	struct libusb_device_descriptor devdesc = usbdev->devdesc;
-	int bus = context->bus;
-	int address = context->address;
+	struct libusb_device_handle *handle = usbdev->handle;
+	struct libusb_config_descriptor *active;
+	int current_config = 0;
 	int res;
-	struct libusb_transfer *transfer;
 
-	if((res = set_valid_configuration(dev, usbdev, handle)) != 0) {
-		usbdev->alive = 0;
-		return;
+	if((res = libusb_get_configuration(handle, &current_config)) != 0) {
+		return -1;
 	}
+	if(current_config != usbdev->configuration) {
+		usbmuxd_log(LL_NOTICE, "Changing configuration of device %i-%i: %i -> %i", usbdev->bus, usbdev->address, current_config, usbdev->configuration);
+		if(current_config != 0 && libusb_get_active_config_descriptor(libusb_get_device(handle), &active) == 0) {
+			detach_kernel_drivers(handle, active, usbdev->bus, usbdev->address);
+			libusb_free_config_descriptor(active);
+		}
+		if((res = libusb_set_configuration(handle, usbdev->configuration)) != 0) {
+			usbmuxd_log(LL_WARNING, "Could not set cached configuration %d for device %d-%d: %s", usbdev->configuration, usbdev->bus, usbdev->address, libusb_error_name(res));
+			return -1;
+		}
+	}
+	return libusb_claim_interface(handle, usbdev->interface);
+}
 
-	if((res = libusb_claim_interface(handle, usbdev->interface)) != 0) {
-		usbmuxd_log(LL_WARNING, "Could not claim interface %d for device %d-%d: %s", usbdev->interface, bus, address, libusb_error_name(res));
-		usbdev->alive = 0;
-		return;
+/*
+ * Select the configuration and claim the usbmux interface. This issues
+ * synchronous requests to the device, so it usually runs on a thread of
+ * its own instead of holding up the USB event handling for all devices.
+ */
+static int usb_configure(struct usb_device *usbdev)
+{
+	struct libusb_device_handle *handle = usbdev->handle;
+	struct libusb_device *dev = libusb_get_device(handle);
+	int bus = usbdev->bus;
+	int address = usbdev->address;
+	int res;
+
+	if(usbdev->cached) {
+		if(usb_configure_cached(usbdev) == 0) {
+			usbmuxd_log(LL_INFO, "Using cached configuration %d, interface %d with endpoints %02x/%02x for device %d-%d", usbdev->configuration, usbdev->interface, usbdev->ep_out, usbdev->ep_in, bus, address);
+			goto configured;
+		}
+		usbmuxd_log(LL_NOTICE, "Cached configuration failed for device %d-%d, probing it again", bus, address);
+		usbdev->cached = 0;
 	}
 
-	transfer = libusb_alloc_transfer(0);
-	if(!transfer) {
-		usbmuxd_log(LL_WARNING, "Failed to allocate transfer for device %d-%d: %s", bus, address, libusb_error_name(res));
-		usbdev->alive = 0;
-		return;
+	if((res = set_valid_configuration(dev, usbdev, handle)) != 0) {
+		return -1;
 	}
 
-	unsigned char *transfer_buffer = malloc(1024 + LIBUSB_CONTROL_SETUP_SIZE + 8);
-	if (!transfer_buffer) {
-		usbmuxd_log(LL_WARNING, "Failed to allocate transfer buffer for device %d-%d: %s", bus, address, libusb_error_name(res));
-		usbdev->alive = 0;
-		return;
+	if((res = libusb_claim_interface(handle, usbdev->interface)) != 0) {
+		usbmuxd_log(LL_WARNING, "Could not claim interface %d for device %d-%d: %s", usbdev->interface, bus, address, libusb_error_name(res));
+		return -1;
 	}
-	memset(transfer_buffer, '\0', 1024 + LIBUSB_CONTROL_SETUP_SIZE + 8);
 
-	usbdev->serial[0] = 0;
-	usbdev->bus = bus;
-	usbdev->address = address;
-	usbdev->devdesc = devdesc;
-	usbdev->speed = 480000000;
-	usbdev->handle = handle;
-	usbdev->alive = 1;
+configured:
 	usbdev->wMaxPacketSize = libusb_get_max_packet_size(dev, usbdev->ep_out);
 	if (usbdev->wMaxPacketSize <= 0) {
 		usbmuxd_log(LL_ERROR, "Could not determine wMaxPacketSize for device %d-%d, setting to 64", usbdev->bus, usbdev->address);
@@ -635,24 +1624,65 @@ static void device_complete_initialization(struct mode_context *context, struct
 			break;
 	}
 
-	usbmuxd_log(LL_INFO, "USB Speed is %g MBit/s for device %d-%d", (double)(usbdev->speed / 1000000.0), usbdev->bus, usbdev->address);
+	usbmuxd_log(LL_INFO, "USB Speed is %g MBit/s for device %d-%d", (double)(usbdev->speed / 1000000.0), usbdev->bus, usbdev->address);
+	return 0;
+}
+
+static void usb_configure_done(struct usb_device *usbdev, int res)
+{
+	mutex_lock(&usbdev->xfer_mutex);
+	usbdev->init_running = 0;
+	if(res == 0)
+		usbdev->configured = 1;
+	else
+		usbdev->alive = 0;
+	mutex_unlock(&usbdev->xfer_mutex);
+	if(res == 0)
+		usb_set_init_stage(usbdev, USB_INIT_CONFIGURED);
+}
+
+static void *usb_configure_thread(void *data)
+{
+	struct usb_device *usbdev = data;
+	usb_configure_done(usbdev, usb_configure(usbdev));
+	// the event context picks up the device from here on
+	usb_wake_event_handler();
+	return NULL;
+}
+
+static void usb_start_configure(struct usb_device *usbdev)
+{
+	usb_set_init_stage(usbdev, USB_INIT_MODE);
 
-	/**
-	 * From libusb:
-	 * 	Asking for the zero'th index is special - it returns a string
-	 * 	descriptor that contains all the language IDs supported by the
-	 * 	device.
-	 **/
-	libusb_fill_control_setup(transfer_buffer, LIBUSB_ENDPOINT_IN, LIBUSB_REQUEST_GET_DESCRIPTOR, LIBUSB_DT_STRING << 8, 0, 1024 + LIBUSB_CONTROL_SETUP_SIZE);
-	libusb_fill_control_transfer(transfer, handle, transfer_buffer, get_langid_callback, usbdev, 1000);
+	mutex_lock(&usbdev->xfer_mutex);
+	usbdev->init_running = 1;
+	mutex_unlock(&usbdev->xfer_mutex);
 
-	if((res = libusb_submit_transfer(transfer)) < 0) {
-		usbmuxd_log(LL_ERROR, "Could not request transfer for device %d-%d: %s", usbdev->bus, usbdev->address, libusb_error_name(res));
-		libusb_free_transfer(transfer);
-		free(transfer_buffer);
-		usbdev->alive = 0;
-		return;	
+#if LIBUSB_API_VERSION >= 0x01000105
+	// finishing on a thread needs libusb_interrupt_event_handler() to hand the device back
+	THREAD_T th;
+	if(thread_new(&th, usb_configure_thread, usbdev) == 0) {
+		thread_detach(th);
+		return;
 	}
+	usbmuxd_log(LL_WARNING, "Could not start configuration thread for device %d-%d, configuring it inline", usbdev->bus, usbdev->address);
+#endif
+	usb_configure_done(usbdev, usb_configure(usbdev));
+	mutex_lock(&usbdev->xfer_mutex);
+	int ready = usb_init_ready(usbdev);
+	mutex_unlock(&usbdev->xfer_mutex);
+	if(ready)
+		usb_device_start(usbdev);
+}
+
+static void device_complete_initialization(struct mode_context *context, struct libusb_device_handle *handle) 
+{
+	struct usb_device *usbdev = find_device(context->bus, context->address);
+	if(!usbdev) {
+		usbmuxd_log(LL_ERROR, "Device %d-%d is missing from device list, aborting initialization", context->bus, context->address);
+		return;
+	}
+	usb_start_configure(usbdev);
 }
 
 static void switch_mode_cb(struct libusb_transfer* transfer) 
@@ -681,6 +1711,12 @@ static void switch_mode_cb(struct libusb_transfer* transfer)
 		free(transfer->buffer);
 }
 
+static int get_desired_mode(void)
+{
+	char* desired_mode_char = getenv(ENV_DEVICE_MODE);
+	return desired_mode_char ? atoi(desired_mode_char) : 1;
+}
+
 static void get_mode_cb(struct libusb_transfer* transfer) 
 {
 	// For old devices not supporting mode swtich, if anything goes wrong - continue in current mode
@@ -703,8 +1739,7 @@ static void get_mode_cb(struct libusb_transfer* transfer)
 
 	unsigned char *data = libusb_control_transfer_get_data(transfer);
 
-	char* desired_mode_char = getenv(ENV_DEVICE_MODE);
-	int desired_mode = desired_mode_char ? atoi(desired_mode_char) : 1;
+	int desired_mode = get_desired_mode();
 	int guessed_mode = guess_mode(context->dev, dev);
 
 	// Response is 3:3:3:0 for initial mode, 5:3:3:0 otherwise.
@@ -734,16 +1769,75 @@ static void get_mode_cb(struct libusb_transfer* transfer)
 		free(transfer->buffer);
 }
 
+/*
+ * Choose the RX transfer size for a device. Older Linux kernels limit
+ * usbfs URBs to 16 KiB, in which case libusb splits larger transfers,
+ * so larger transfers are only used when the kernel reports that
+ * limit is gone, or when configured explicitly.
+ */
+static int usb_get_rx_size(struct usb_device *dev)
+{
+	int size = USB_MRU;
+	if(rx_size_config)
+		return rx_size_config;
+#if defined(__linux__) && defined(USBDEVFS_CAP_NO_PACKET_SIZE_LIM)
+	char path[32];
+	uint32_t caps = 0;
+	int fd;
+	snprintf(path, sizeof(path), "/dev/bus/usb/%03d/%03d", dev->bus, dev->address);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if(fd >= 0) {
+		if(ioctl(fd, USBDEVFS_GET_CAPABILITIES, &caps) == 0 && (caps & USBDEVFS_CAP_NO_PACKET_SIZE_LIM))
+			size = USB_MRU_MAX;
+		close(fd);
+	}
+#endif
+	usbmuxd_log(LL_DEBUG, "Using RX transfers of %d bytes for device %d-%d", size, dev->bus, dev->address);
+	return size;
+}
+
+static int request_mode(struct usb_device *usbdev)
+{
+	int bus = usbdev->bus;
+	int address = usbdev->address;
+
+	// On top of configurations, Apple have multiple "modes" for devices, namely:
+	// 1: An "initial" mode with 4 configurations
+	// 2: "Valeria" mode, where configuration 5 is included with interface for H.265 video capture (activated when recording screen with QuickTime in macOS)
+	// 3: "CDC NCM" mode, where configuration 5 is included with interface for Ethernet/USB (activated using internet-sharing feature in macOS)
+	// Request current mode asynchroniously, so it can be changed in callback if needed
+	usbmuxd_log(LL_INFO, "Requesting current mode from device %i-%i", bus, address);
+	struct mode_context* context = malloc(sizeof(struct mode_context));
+	context->dev = libusb_get_device(usbdev->handle);
+	context->bus = bus;
+	context->address = address;
+	context->bRequest = APPLE_VEND_SPECIFIC_GET_MODE;
+	context->wValue = 0;
+	context->wIndex = 0;
+	context->wLength = 4;
+	context->timeout = 1000;
+
+	if(submit_vendor_specific(usbdev->handle, context, get_mode_cb) != 0) {
+		usbmuxd_log(LL_WARNING, "Could not request current mode from device %d-%d", bus, address);
+		free(context);
+		return -1;
+	}
+	return 0;
+}
+
+
 static int usb_device_add(libusb_device* dev)
 {
-	int res;
+	int res, i;
 	// the following are non-blocking operations on the device list
 	uint8_t bus = libusb_get_bus_number(dev);
 	uint8_t address = libusb_get_device_address(dev);
 	struct libusb_device_descriptor devdesc;
 	struct usb_device *usbdev = find_device(bus, address);
 	if(usbdev) {
-		usbdev->alive = 1;
+		// a draining device is picked up again once it is released
+		if(!usbdev->disconnecting)
+			usbdev->alive = 1;
 		return 0; //device already found
 	}
 
@@ -779,38 +1873,54 @@ static int usb_device_add(libusb_device* dev)
 	usbdev->speed = 0;
 	usbdev->handle = handle;
 	usbdev->alive = 1;
+	usbdev->init_start = mstime64();
+	for(i = 0; i < USB_INIT_STAGES; i++)
+		usbdev->stats.init_ms[i] = -1;
+	usbdev->stats.init_ms[USB_INIT_FOUND] = 0;
+	usbdev->rx_size = usb_get_rx_size(usbdev);
+	usbdev->stats.rx_transfer_size = usbdev->rx_size;
 
 	collection_init(&usbdev->tx_xfers);
 	collection_init(&usbdev->rx_xfers);
+	collection_init(&usbdev->rx_retiring);
+	mutex_init(&usbdev->xfer_mutex);
 
 	collection_add(&device_list, usbdev);
 
-	// On top of configurations, Apple have multiple "modes" for devices, namely:
-	// 1: An "initial" mode with 4 configurations
-	// 2: "Valeria" mode, where configuration 5 is included with interface for H.265 video capture (activated when recording screen with QuickTime in macOS)
-	// 3: "CDC NCM" mode, where configuration 5 is included with interface for Ethernet/USB (activated using internet-sharing feature in macOS)
-	// Request current mode asynchroniously, so it can be changed in callback if needed
-	usbmuxd_log(LL_INFO, "Requesting current mode from device %i-%i", bus, address);
-	struct mode_context* context = malloc(sizeof(struct mode_context));
-	context->dev = dev;
-	context->bus = bus;
-	context->address = address;
-	context->bRequest = APPLE_VEND_SPECIFIC_GET_MODE;
-	context->wValue = 0;
-	context->wIndex = 0;
-	context->wLength = 4;
-	context->timeout = 1000;
+	if(tx_pool_init(usbdev) < 0) {
+		// Schedule device for close and cleanup
+		usbdev->alive = 0;
+		return -1;
+	}
 
-	if(submit_vendor_specific(handle, context, get_mode_cb) != 0) {
-		usbmuxd_log(LL_WARNING, "Could not request current mode from device %d-%d", bus, address);
+	// A device model seen before goes straight to claiming its interface
+	if(device_cache_lookup(usbdev)) {
+		usbmuxd_log(LL_INFO, "Found device %d-%d in the device cache, skipping mode detection", bus, address);
+		usb_start_configure(usbdev);
+	} else if(request_mode(usbdev) < 0) {
 		// Schedule device for close and cleanup
 		usbdev->alive = 0;
 		return -1;
 	}
+
+	// String descriptors are available in any configuration, so read the
+	// serial number while the mode is determined and the device configured
+	if(request_serial(usbdev) < 0) {
+		usbdev->alive = 0;
+		return -1;
+	}
 	return 0;
 }
 
-int usb_discover(void)
+static void schedule_dev_poll(int msec)
+{
+	get_tick_count(&next_dev_poll_time);
+	next_dev_poll_time.tv_usec += msec * 1000;
+	next_dev_poll_time.tv_sec += next_dev_poll_time.tv_usec / 1000000;
+	next_dev_poll_time.tv_usec = next_dev_poll_time.tv_usec % 1000000;
+}
+
+static int usb_discover_devices(void)
 {
 	int cnt, i;
 	int valid_count = 0;
@@ -825,10 +1935,7 @@ int usb_discover(void)
 			usbmuxd_log(LL_FATAL, "Too many errors getting device list");
 			return cnt;
 		} else {
-			get_tick_count(&next_dev_poll_time);
-			next_dev_poll_time.tv_usec += DEVICE_POLL_TIME * 1000;
-			next_dev_poll_time.tv_sec += next_dev_poll_time.tv_usec / 1000000;
-			next_dev_poll_time.tv_usec = next_dev_poll_time.tv_usec % 1000000;
+			schedule_dev_poll(dev_poll_interval);
 			return 0;
 		}
 	}
@@ -857,14 +1964,92 @@ int usb_discover(void)
 
 	libusb_free_device_list(devs, 1);
 
-	get_tick_count(&next_dev_poll_time);
-	next_dev_poll_time.tv_usec += DEVICE_POLL_TIME * 1000;
-	next_dev_poll_time.tv_sec += next_dev_poll_time.tv_usec / 1000000;
-	next_dev_poll_time.tv_usec = next_dev_poll_time.tv_usec % 1000000;
+	schedule_dev_poll(dev_poll_interval);
 
 	return valid_count;
 }
 
+static void usb_device_left(uint8_t bus, uint8_t address)
+{
+	FOREACH(struct usb_device *usbdev, &device_list) {
+		if(usbdev->bus == bus && usbdev->address == address && !usbdev->disconnecting) {
+			usbdev->alive = 0;
+			usb_device_remove(usbdev);
+			break;
+		}
+	} ENDFOREACH
+}
+
+// Add the device the kernel just reported, without scanning the whole tree
+static void usb_uevent_add(uint8_t bus, uint8_t address)
+{
+	libusb_device **devs;
+	int cnt, i;
+
+	cnt = libusb_get_device_list(NULL, &devs);
+	if(cnt < 0) {
+		schedule_dev_poll(0);
+		return;
+	}
+	for(i = 0; i < cnt; i++) {
+		if(libusb_get_bus_number(devs[i]) == bus && libusb_get_device_address(devs[i]) == address)
+			break;
+	}
+	if(i == cnt || usb_device_add(devs[i]) < 0)
+		schedule_dev_poll(UEVENT_RETRY_TIME);
+	libusb_free_device_list(devs, 1);
+}
+
+/*
+ * Handle all pending kernel uevents. Must run where the device list is
+ * owned, i.e. on the USB event thread if there is one.
+ */
+static void usb_uevent_process(void)
+{
+	struct uevent event;
+	int res;
+
+	if(uevent_fd < 0)
+		return;
+	while((res = uevent_read(uevent_fd, &event)) > 0) {
+		if(event.vid != VID_APPLE)
+			continue;
+		usbmuxd_log(LL_DEBUG, "uevent: %s device %04x:%04x at %d-%d", event.action == UEVENT_ADD ? "add" : "remove", event.vid, event.pid, event.bus, event.address);
+		if(event.action == UEVENT_ADD) {
+			if(device_hotplug)
+				usb_uevent_add(event.bus, event.address);
+		} else {
+			usb_device_left(event.bus, event.address);
+		}
+	}
+	if(res < 0) {
+		// events were lost, find out what changed with a full scan
+		usbmuxd_log(LL_WARNING, "Could not read uevents: %s", strerror(errno));
+		if(device_hotplug)
+			schedule_dev_poll(0);
+	}
+
+	if(uevent_thread_running) {
+		mutex_lock(&uevent_mutex);
+		uevent_pending = 0;
+		cond_signal(&uevent_cond);
+		mutex_unlock(&uevent_mutex);
+	}
+}
+
+int usb_discover(void)
+{
+	if(usb_thread_running) {
+		// the device list is owned by the USB event thread
+		mutex_lock(&usb_thread_mutex);
+		usb_discover_requested = 1;
+		mutex_unlock(&usb_thread_mutex);
+		usb_wake_event_handler();
+		return 0;
+	}
+	return usb_discover_devices();
+}
+
 const char *usb_get_serial(struct usb_device *dev)
 {
 	if(!dev->handle) {
@@ -897,7 +2082,95 @@ uint64_t usb_get_speed(struct usb_device *dev)
 	return dev->speed;
 }
 
-void usb_get_fds(struct fdlist *list)
+/**
+ * Get the transfer statistics of a device.
+ *
+ * @param dev The USB device.
+ * @param stats Filled with a snapshot of the statistics.
+ */
+void usb_get_stats(struct usb_device *dev, struct usb_stats *stats)
+{
+	mutex_lock(&dev->xfer_mutex);
+	*stats = dev->stats;
+	mutex_unlock(&dev->xfer_mutex);
+}
+
+static const char *init_stage_names[USB_INIT_STAGES] = {
+	"found", "mode", "configured", "serial", "started", "connected", "visible"
+};
+
+/**
+ * Record the time a device reached an initialization stage.
+ *
+ * @param dev The USB device.
+ * @param stage The stage that was just completed.
+ */
+void usb_set_init_stage(struct usb_device *dev, enum usb_init_stage stage)
+{
+	char times[256];
+	int i, len = 0;
+
+	mutex_lock(&dev->xfer_mutex);
+	dev->stats.init_ms[stage] = (int)(mstime64() - dev->init_start);
+	if(stage == USB_INIT_VISIBLE) {
+		times[0] = '\0';
+		for(i = USB_INIT_FOUND + 1; i < USB_INIT_STAGES && len < (int)sizeof(times); i++) {
+			if(dev->stats.init_ms[i] >= 0)
+				len += snprintf(times + len, sizeof(times) - len, " %s %dms", init_stage_names[i], dev->stats.init_ms[i]);
+		}
+	}
+	mutex_unlock(&dev->xfer_mutex);
+
+	if(stage == USB_INIT_VISIBLE)
+		usbmuxd_log(LL_INFO, "Device %d-%d initialization:%s", dev->bus, dev->address, times);
+}
+
+/**
+ * Attach the mux device to a USB device so that incoming data can be
+ * dispatched without looking it up.
+ *
+ * @param dev The USB device.
+ * @param mux_dev The mux device handling this USB device, or NULL to detach.
+ */
+void usb_set_mux_device(struct usb_device *dev, struct mux_device *mux_dev)
+{
+	dev->mux_dev = mux_dev;
+}
+
+struct mux_device *usb_get_mux_device(struct usb_device *dev)
+{
+	return dev->mux_dev;
+}
+
+/**
+ * Set the worker thread that processes data received from the device.
+ * This has to be done before the RX loops are started.
+ *
+ * @param dev The USB device.
+ * @param worker The worker, or NULL to process data on the event thread.
+ */
+void usb_set_worker(struct usb_device *dev, struct worker *worker)
+{
+	dev->worker = worker;
+}
+
+static void usb_pollfd_added(int fd, short events, void *user_data)
+{
+	usbmuxd_log(LL_DEBUG, "Adding libusb fd %d (events %d) to event loop", fd, events);
+	evloop_add(main_evloop, fd, FD_USB, events, NULL);
+}
+
+static void usb_pollfd_removed(int fd, void *user_data)
+{
+	usbmuxd_log(LL_DEBUG, "Removing libusb fd %d from event loop", fd);
+	evloop_remove(main_evloop, fd);
+}
+
+/**
+ * Register the file descriptors libusb currently uses with the event loop
+ * and keep track of fds that libusb adds or removes later on.
+ */
+static void usb_register_pollfds(void)
 {
 	const struct libusb_pollfd **usbfds;
 	const struct libusb_pollfd **p;
@@ -908,10 +2181,15 @@ void usb_get_fds(struct fdlist *list)
 	}
 	p = usbfds;
 	while(*p) {
-		fdlist_add(list, FD_USB, (*p)->fd, (*p)->events);
+		evloop_add(main_evloop, (*p)->fd, FD_USB, (*p)->events, NULL);
 		p++;
 	}
+#if LIBUSB_API_VERSION >= 0x01000104
+	libusb_free_pollfds(usbfds);
+#else
 	free(usbfds);
+#endif
+	libusb_set_pollfd_notifiers(NULL, usb_pollfd_added, usb_pollfd_removed, NULL);
 }
 
 void usb_autodiscover(int enable)
@@ -935,13 +2213,16 @@ static int dev_poll_remain_ms(void)
 	return msecs;
 }
 
-int usb_get_timeout(void)
+static int usb_get_next_timeout(void)
 {
 	struct timeval tv;
 	int msec;
 	int res;
 	int pollrem;
 	pollrem = dev_poll_remain_ms();
+	// check idle devices for RX transfers to give back, see rx_reclaim_idle()
+	if(pollrem > RX_IDLE_TIME && rx_above_min())
+		pollrem = RX_IDLE_TIME;
 	res = libusb_get_next_timeout(NULL, &tv);
 	if(res == 0)
 		return pollrem;
@@ -956,10 +2237,19 @@ int usb_get_timeout(void)
 	return msec;
 }
 
+int usb_get_timeout(void)
+{
+	if(usb_thread_running)
+		return 100000; // USB events are handled on their own thread
+	return usb_get_next_timeout();
+}
+
 int usb_process(void)
 {
 	int res;
 	struct timeval tv;
+	if(usb_thread_running)
+		return 0;
 	tv.tv_sec = tv.tv_usec = 0;
 	res = libusb_handle_events_timeout(NULL, &tv);
 	if(res < 0) {
@@ -967,6 +2257,8 @@ int usb_process(void)
 		return res;
 	}
 
+	usb_uevent_process();
+
 	// reap devices marked dead due to an RX error
 	reap_dead_devices();
 
@@ -984,6 +2276,11 @@ int usb_process_timeout(int msec)
 {
 	int res;
 	struct timeval tleft, tcur, tfin;
+	if(usb_thread_running) {
+		// the event thread keeps processing, just give it the time
+		usleep(msec * 1000);
+		return 0;
+	}
 	get_tick_count(&tcur);
 	tfin.tv_sec = tcur.tv_sec + (msec / 1000);
 	tfin.tv_usec = tcur.tv_usec + (msec % 1000) * 1000;
@@ -1008,6 +2305,117 @@ int usb_process_timeout(int msec)
 	return 0;
 }
 
+static void *usb_event_thread(void *data)
+{
+	usbmuxd_log(LL_DEBUG, "USB event thread started");
+	while(!usb_thread_quit) {
+		struct timeval tv;
+		int res, discover;
+		int msec = usb_get_next_timeout();
+		if(msec > USB_THREAD_MAX_WAIT)
+			msec = USB_THREAD_MAX_WAIT;
+		tv.tv_sec = msec / 1000;
+		tv.tv_usec = (msec % 1000) * 1000;
+		res = libusb_handle_events_timeout_completed(NULL, &tv, &usb_thread_quit);
+		if(res < 0 && res != LIBUSB_ERROR_INTERRUPTED) {
+			usbmuxd_log(LL_ERROR, "libusb_handle_events_timeout_completed failed: %s", libusb_error_name(res));
+		}
+
+		usb_uevent_process();
+
+		// reap devices marked dead due to an RX error
+		reap_dead_devices();
+
+		mutex_lock(&usb_thread_mutex);
+		discover = usb_discover_requested;
+		usb_discover_requested = 0;
+		mutex_unlock(&usb_thread_mutex);
+		if(discover || dev_poll_remain_ms() <= 0) {
+			res = usb_discover_devices();
+			if(res < 0) {
+				usbmuxd_log(LL_ERROR, "usb_discover failed: %s", libusb_error_name(res));
+			}
+		}
+	}
+	usbmuxd_log(LL_DEBUG, "USB event thread stopped");
+	return NULL;
+}
+
+/*
+ * libusb cannot wait for the uevent socket, so with an event thread this
+ * thread watches it and interrupts libusb when events arrive. It waits
+ * until the event thread read them before polling again.
+ */
+static void *usb_uevent_thread(void *data)
+{
+	struct pollfd pfd;
+	pfd.fd = uevent_fd;
+	pfd.events = POLLIN;
+	while(!usb_thread_quit) {
+		pfd.revents = 0;
+		if(poll(&pfd, 1, USB_THREAD_MAX_WAIT) <= 0)
+			continue;
+		mutex_lock(&uevent_mutex);
+		uevent_pending = 1;
+		usb_wake_event_handler();
+		while(uevent_pending && !usb_thread_quit)
+			cond_wait_timeout(&uevent_cond, &uevent_mutex, USB_THREAD_MAX_WAIT);
+		mutex_unlock(&uevent_mutex);
+	}
+	return NULL;
+}
+
+static void usb_start_event_thread(void)
+{
+	usb_thread_quit = 0;
+	usb_thread_running = 1;
+	mutex_init(&usb_thread_mutex);
+	if(thread_new(&usb_thread, usb_event_thread, NULL) != 0) {
+		usbmuxd_log(LL_ERROR, "Could not start USB event thread, handling USB events on the main thread");
+		usb_thread_running = 0;
+		mutex_destroy(&usb_thread_mutex);
+		usb_register_pollfds();
+		return;
+	}
+#if LIBUSB_API_VERSION >= 0x01000105
+	if(uevent_fd >= 0) {
+		mutex_init(&uevent_mutex);
+		cond_init(&uevent_cond);
+		uevent_thread_running = 1;
+		if(thread_new(&uevent_thread, usb_uevent_thread, NULL) != 0) {
+			usbmuxd_log(LL_WARNING, "Could not start uevent thread, device events are handled with a delay");
+			uevent_thread_running = 0;
+			cond_destroy(&uevent_cond);
+			mutex_destroy(&uevent_mutex);
+		}
+	}
+#endif
+}
+
+static void usb_stop_event_thread(void)
+{
+	if(!usb_thread_running)
+		return;
+	usb_thread_quit = 1;
+#if LIBUSB_API_VERSION >= 0x01000105
+	libusb_interrupt_event_handler(NULL);
+#endif
+	thread_join(usb_thread);
+	thread_free(usb_thread);
+	usb_thread_running = 0;
+	mutex_destroy(&usb_thread_mutex);
+	if(uevent_thread_running) {
+		mutex_lock(&uevent_mutex);
+		cond_signal(&uevent_cond);
+		mutex_unlock(&uevent_mutex);
+		thread_join(uevent_thread);
+		thread_free(uevent_thread);
+		uevent_thread_running = 0;
+		cond_destroy(&uevent_cond);
+		mutex_destroy(&uevent_mutex);
+	}
+}
+
 #ifdef HAVE_LIBUSB_HOTPLUG_API
 static libusb_hotplug_callback_handle usb_hotplug_cb_handle;
 
@@ -1018,15 +2426,7 @@ static int usb_hotplug_cb(libusb_context *ctx, libusb_device *device, libusb_hot
 			usb_device_add(device);
 		}
 	} else if (LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT == event) {
-		uint8_t bus = libusb_get_bus_number(device);
-		uint8_t address = libusb_get_device_address(device);
-		FOREACH(struct usb_device *usbdev, &device_list) {
-			if(usbdev->bus == bus && usbdev->address == address) {
-				usbdev->alive = 0;
-				device_remove(usbdev);
-				break;
-			}
-		} ENDFOREACH
+		usb_device_left(libusb_get_bus_number(device), libusb_get_device_address(device));
 	} else {
 		usbmuxd_log(LL_ERROR, "Unhandled event %d", event);
 	}
@@ -1034,6 +2434,52 @@ static int usb_hotplug_cb(libusb_context *ctx, libusb_device *device, libusb_hot
 }
 #endif
 
+static int parse_rx_depth(const char *name, int def)
+{
+	const char *env = getenv(name);
+	int val;
+	if(!env)
+		return def;
+	val = atoi(env);
+	if(val < 1 || val > RX_DEPTH_LIMIT) {
+		usbmuxd_log(LL_WARNING, "Ignoring invalid value '%s' for %s (1-%d)", env, name, RX_DEPTH_LIMIT);
+		return def;
+	}
+	return val;
+}
+
+static void usb_read_config(void)
+{
+	const char *env_size = getenv(ENV_RX_TRANSFER_SIZE);
+	const char *env_dev_mem = getenv(ENV_DEVICE_MEMORY);
+
+	rx_depth_min = parse_rx_depth(ENV_RX_DEPTH_MIN, RX_DEPTH_MIN);
+	rx_depth_max = parse_rx_depth(ENV_RX_DEPTH_MAX, RX_DEPTH_MAX);
+	if(rx_depth_max < rx_depth_min)
+		rx_depth_max = rx_depth_min;
+	usbmuxd_log(LL_INFO, "RX queue depth between %d and %d transfers", rx_depth_min, rx_depth_max);
+
+	if(env_dev_mem) {
+		int kib = atoi(env_dev_mem);
+		dev_mem_budget = (kib > 0) ? (size_t)kib * 1024 : 0;
+	}
+	if(dev_mem_budget)
+		usbmuxd_log(LL_INFO, "Using up to %zu KiB of device memory for transfer buffers", dev_mem_budget / 1024);
+	else
+		usbmuxd_log(LL_INFO, "Not using device memory for transfer buffers");
+
+	rx_size_config = 0;
+	if(env_size) {
+		int size = atoi(env_size);
+		if(size >= USB_PACKET_SIZE && size <= USB_MRU_MAX && (size % USB_PACKET_SIZE) == 0) {
+			rx_size_config = size;
+			usbmuxd_log(LL_INFO, "Using RX transfers of %d bytes", rx_size_config);
+		} else if(size != 0) {
+			usbmuxd_log(LL_WARNING, "Ignoring invalid value '%s' for %s (multiple of %d up to %d)", env_size, ENV_RX_TRANSFER_SIZE, USB_PACKET_SIZE, USB_MRU_MAX);
+		}
+	}
+}
+
 int usb_init(void)
 {
 	int res;
@@ -1057,6 +2503,18 @@ int usb_init(void)
 
 	collection_init(&device_list);
 
+	usb_read_config();
+	mutex_init(&dev_mem_mutex);
+
+	mutex_init(&device_cache_mutex);
+	device_cache = config_get_usb_device_cache();
+	if(!device_cache)
+		device_cache = plist_new_dict();
+
+	// with worker threads, libusb gets a thread of its own instead of the main event loop
+	if(worker_get_count() == 0)
+		usb_register_pollfds();
+
 #ifdef HAVE_LIBUSB_HOTPLUG_API
 	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
 		usbmuxd_log(LL_INFO, "Registering for libusb hotplug events");
@@ -1070,6 +2528,18 @@ int usb_init(void)
 		usbmuxd_log(LL_ERROR, "libusb does not support hotplug events");
 	}
 #endif
+	if (device_polling) {
+		// react to kernel uevents instead of scanning all devices every second
+		uevent_fd = uevent_open();
+		if (uevent_fd >= 0) {
+			usbmuxd_log(LL_INFO, "Using kernel uevents for device discovery");
+			dev_poll_interval = DEVICE_RESCAN_TIME;
+			if (worker_get_count() == 0) {
+				evloop_add(main_evloop, uevent_fd, FD_USB, POLLIN, NULL);
+				uevent_registered = 1;
+			}
+		}
+	}
 	if (device_polling) {
 		res = usb_discover();
 		if (res >= 0) {
@@ -1077,21 +2547,55 @@ int usb_init(void)
 	} else {
 		res = collection_count(&device_list);
 	}
+
+	if(worker_get_count() > 0)
+		usb_start_event_thread();
+
 	return res;
 }
 
 void usb_shutdown(void)
 {
+	int res;
 	usbmuxd_log(LL_DEBUG, "usb_shutdown");
 
+	usb_stop_event_thread();
+
 #ifdef HAVE_LIBUSB_HOTPLUG_API
 	libusb_hotplug_deregister_callback(NULL, usb_hotplug_cb_handle);
 #endif
 
+	if(uevent_registered) {
+		evloop_remove(main_evloop, uevent_fd);
+		uevent_registered = 0;
+	}
+	uevent_close(uevent_fd);
+	uevent_fd = -1;
+	dev_poll_interval = DEVICE_POLL_TIME;
+
 	FOREACH(struct usb_device *usbdev, &device_list) {
-		device_remove(usbdev);
+		if(!usbdev->disconnecting)
+			usb_device_remove(usbdev);
 		usb_disconnect(usbdev);
 	} ENDFOREACH
+
+	// wait for the cancelled transfers, there is nothing else to serve now
+	while(collection_count(&device_list) > 0) {
+		struct timeval tv;
+		tv.tv_sec = 0;
+		tv.tv_usec = 10000;
+		if((res = libusb_handle_events_timeout(NULL, &tv)) < 0) {
+			usbmuxd_log(LL_ERROR, "libusb_handle_events_timeout for usb_shutdown failed: %s", libusb_error_name(res));
+			break;
+		}
+		reap_dead_devices();
+	}
 	collection_free(&device_list);
+	libusb_set_pollfd_notifiers(NULL, NULL, NULL, NULL);
 	libusb_exit(NULL);
+	mutex_destroy(&dev_mem_mutex);
+	usb_write_device_cache();
+	plist_free(device_cache);
+	device_cache = NULL;
+	mutex_destroy(&device_cache_mutex);
 }
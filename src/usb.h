@@ -31,8 +31,12 @@
 
 // libusb fragments packets larger than this (usbfs limitation)
 // on input, this creates race conditions and other issues
+// so RX transfers are only larger where the kernel lifts that limit
 #define USB_MRU 16384
 
+// largest RX transfer, the maximum mux packet size (DEV_MRU)
+#define USB_MRU_MAX 65536
+
 // max transmission packet size
 // libusb fragments these too, but doesn't send ZLPs so we're safe
 // but we need to send a ZLP ourselves at the end (see usb-linux.c)
@@ -43,6 +47,9 @@
 
 #define USB_PACKET_SIZE 512
 
+// space for a serial number string, including the terminating zero
+#define USB_SERIAL_MAX 256
+
 #define VID_APPLE 0x5ac
 #define PID_RANGE_LOW 0x1290
 #define PID_RANGE_MAX 0x12af
@@ -51,10 +58,38 @@
 #define PID_APPLE_SILICON_RESTORE_MAX 0x1905
 
 #define ENV_DEVICE_MODE "USBMUXD_DEFAULT_DEVICE_MODE"
+#define ENV_RX_DEPTH_MIN "USBMUXD_RX_DEPTH_MIN"
+#define ENV_RX_DEPTH_MAX "USBMUXD_RX_DEPTH_MAX"
+#define ENV_RX_TRANSFER_SIZE "USBMUXD_RX_TRANSFER_SIZE"
+#define ENV_DEVICE_MEMORY "USBMUXD_DEVICE_MEMORY"
 #define APPLE_VEND_SPECIFIC_GET_MODE 0x45
 #define APPLE_VEND_SPECIFIC_SET_MODE 0x52
 
 struct usb_device;
+struct mux_device;
+struct worker;
+
+enum usb_init_stage {
+	USB_INIT_FOUND = 0, // device opened
+	USB_INIT_MODE, // mode queried, or switch attempted
+	USB_INIT_CONFIGURED, // configuration set and interface claimed
+	USB_INIT_SERIAL, // serial number read
+	USB_INIT_STARTED, // registered with the mux layer, RX running
+	USB_INIT_CONNECTED, // mux version handshake done
+	USB_INIT_VISIBLE, // preflight done, announced to clients
+	USB_INIT_STAGES
+};
+
+struct usb_stats {
+	int rx_depth; // RX transfers currently in flight
+	int rx_depth_peak; // highest RX depth reached
+	uint64_t rx_transfers; // completed RX transfers
+	uint64_t rx_full_transfers; // completed RX transfers that filled their buffer
+	int rx_transfer_size; // size of each RX transfer
+	int dma_buffers; // transfer buffers in usbfs device memory
+	int heap_buffers; // transfer buffers on the heap
+	int init_ms[USB_INIT_STAGES]; // milliseconds from USB_INIT_FOUND to each stage, -1 if not reached
+};
 
 int usb_init(void);
 void usb_shutdown(void);
@@ -62,12 +97,20 @@ const char *usb_get_serial(struct usb_device *dev);
 uint32_t usb_get_location(struct usb_device *dev);
 uint16_t usb_get_pid(struct usb_device *dev);
 uint64_t usb_get_speed(struct usb_device *dev);
-void usb_get_fds(struct fdlist *list);
+void usb_get_stats(struct usb_device *dev, struct usb_stats *stats);
+void usb_set_init_stage(struct usb_device *dev, enum usb_init_stage stage);
+void usb_set_mux_device(struct usb_device *dev, struct mux_device *mux_dev);
+struct mux_device *usb_get_mux_device(struct usb_device *dev);
+void usb_set_worker(struct usb_device *dev, struct worker *worker);
 int usb_get_timeout(void);
 int usb_send(struct usb_device *dev, const unsigned char *buf, int length);
+unsigned char *usb_get_tx_buffer(struct usb_device *dev, int bulk);
+void usb_release_tx_buffer(struct usb_device *dev, unsigned char *buf);
+int usb_send_tx_buffer(struct usb_device *dev, unsigned char *buf, int length);
 int usb_discover(void);
 void usb_autodiscover(int enable);
 int usb_process(void);
 int usb_process_timeout(int msec);
+void usb_write_device_cache(void);
 
 #endif
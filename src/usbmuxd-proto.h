@@ -44,6 +44,7 @@ enum usbmuxd_result {
 	// ???
 	// ???
 	RESULT_BADVERSION = 6,
+	RESULT_NOMEM = 7, // usbmuxd specific: connection buffer budget exhausted
 };
 
 enum usbmuxd_msgtype {
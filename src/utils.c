@@ -36,6 +36,7 @@
 #endif
 
 #include "utils.h"
+#include "bufpool.h"
 
 #include "log.h"
 #define util_error(...) usbmuxd_log(LL_ERROR, __VA_ARGS__)
@@ -76,6 +77,128 @@ void fdlist_reset(struct fdlist *list)
 	list->count = 0;
 }
 
+int ringbuf_init(struct ringbuf *rb, uint32_t capacity)
+{
+	rb->data = bufpool_alloc(&capacity);
+	rb->capacity = rb->data ? capacity : 0;
+	rb->head = 0;
+	rb->size = 0;
+	return rb->data ? 0 : -1;
+}
+
+/**
+ * Release the storage of a ring buffer. It may be used again afterwards,
+ * ringbuf_reserve() allocates new storage.
+ */
+void ringbuf_free(struct ringbuf *rb)
+{
+	bufpool_free(rb->data, rb->capacity);
+	rb->data = NULL;
+	rb->capacity = 0;
+	rb->head = 0;
+	rb->size = 0;
+}
+
+/**
+ * Change the capacity of a ring buffer. The stored data is kept and
+ * starts at the beginning of the new storage, which comes from the
+ * buffer pool.
+ *
+ * @param rb The ring buffer.
+ * @param capacity The new capacity, at least the number of stored bytes.
+ *     It is rounded up to the size class of the pool.
+ * @return 0 on success, -1 if out of memory. The buffer is unchanged then.
+ */
+int ringbuf_resize(struct ringbuf *rb, uint32_t capacity)
+{
+	struct iovec iov[2];
+	unsigned char *data;
+	int i, n;
+	uint32_t pos = 0;
+
+	if(capacity < rb->size)
+		return -1;
+	data = bufpool_alloc(&capacity);
+	if(!data)
+		return -1;
+	n = ringbuf_get_iov(rb, iov);
+	for(i = 0; i < n; i++) {
+		memcpy(data + pos, iov[i].iov_base, iov[i].iov_len);
+		pos += iov[i].iov_len;
+	}
+	bufpool_free(rb->data, rb->capacity);
+	rb->data = data;
+	rb->capacity = capacity;
+	rb->head = 0;
+	return 0;
+}
+
+/**
+ * Make sure a ring buffer can hold size bytes in total, doubling its
+ * capacity as often as needed.
+ */
+int ringbuf_reserve(struct ringbuf *rb, uint32_t size)
+{
+	uint32_t capacity = rb->capacity ? rb->capacity : 4096;
+	if(size <= rb->capacity)
+		return 0;
+	while(capacity < size)
+		capacity *= 2;
+	return ringbuf_resize(rb, capacity);
+}
+
+/**
+ * Append data to a ring buffer. The caller makes sure it fits.
+ */
+void ringbuf_append(struct ringbuf *rb, const void *data, uint32_t len)
+{
+	uint32_t tail, first;
+	if(!len)
+		return;
+	tail = (rb->head + rb->size) % rb->capacity;
+	first = rb->capacity - tail;
+	if(first > len)
+		first = len;
+	memcpy(rb->data + tail, data, first);
+	memcpy(rb->data, (const unsigned char*)data + first, len - first);
+	rb->size += len;
+}
+
+/**
+ * @return The number of segments holding the stored data (0-2), which are
+ *   filled into iov in order.
+ */
+int ringbuf_get_iov(struct ringbuf *rb, struct iovec iov[2])
+{
+	uint32_t first;
+	if(!rb->size)
+		return 0;
+	first = rb->capacity - rb->head;
+	iov[0].iov_base = rb->data + rb->head;
+	if(first >= rb->size) {
+		iov[0].iov_len = rb->size;
+		return 1;
+	}
+	iov[0].iov_len = first;
+	iov[1].iov_base = rb->data;
+	iov[1].iov_len = rb->size - first;
+	return 2;
+}
+
+/**
+ * Drop len bytes from the front of a ring buffer.
+ */
+void ringbuf_consume(struct ringbuf *rb, uint32_t len)
+{
+	if(len >= rb->size) {
+		rb->head = 0;
+		rb->size = 0;
+		return;
+	}
+	rb->head = (rb->head + len) % rb->capacity;
+	rb->size -= len;
+}
+
 #ifndef HAVE_CLOCK_GETTIME
 typedef int clockid_t;
 #define CLOCK_MONOTONIC 1
@@ -22,13 +22,17 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include <stdint.h>
 #include <poll.h>
+#include <sys/uio.h>
 #include <plist/plist.h>
 
 enum fdowner {
 	FD_LISTEN,
 	FD_CLIENT,
-	FD_USB
+	FD_USB,
+	FD_WAKEUP,
+	FD_URING
 };
 
 struct fdlist {
@@ -43,6 +47,25 @@ void fdlist_add(struct fdlist *list, enum fdowner owner, int fd, short events);
 void fdlist_free(struct fdlist *list);
 void fdlist_reset(struct fdlist *list);
 
+/*
+ * Byte ring buffer. Stored data is at most two segments, which are
+ * written out with writev() so partial writes never move any bytes.
+ */
+struct ringbuf {
+	unsigned char *data;
+	uint32_t capacity;
+	uint32_t head;	// offset of the first stored byte
+	uint32_t size;	// number of stored bytes
+};
+
+int ringbuf_init(struct ringbuf *rb, uint32_t capacity);
+void ringbuf_free(struct ringbuf *rb);
+int ringbuf_resize(struct ringbuf *rb, uint32_t capacity);
+int ringbuf_reserve(struct ringbuf *rb, uint32_t size);
+void ringbuf_append(struct ringbuf *rb, const void *data, uint32_t len);
+int ringbuf_get_iov(struct ringbuf *rb, struct iovec iov[2]);
+void ringbuf_consume(struct ringbuf *rb, uint32_t len);
+
 uint64_t mstime64(void);
 void get_tick_count(struct timeval * tv);
 
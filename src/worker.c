@@ -0,0 +1,329 @@
+/*
+ * worker.c
+ *
+ * Copyright (C) 2026 usbmuxd contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <libimobiledevice-glue/thread.h>
+
+#include "worker.h"
+#include "evloop.h"
+#include "timer.h"
+#include "client.h"
+#include "log.h"
+#include "utils.h"
+
+// upper bound for a worker's wait when no timer is armed
+#define WORKER_IDLE_TIMEOUT 1000
+
+/*
+ * Data plane worker threads.
+ *
+ * Every device is assigned to one worker (see device_add()). The worker
+ * owns the device's connections: it processes the data received from the
+ * device, runs the delayed ACK timers and serves the sockets of the
+ * clients connected through the device, which are moved from the main
+ * event loop to the worker's own event loop for that time.
+ * Other threads never touch this state directly; they hand work over with
+ * worker_post() or worker_call(), which run a function on the worker
+ * thread between two event loop iterations.
+ */
+
+struct worker_job {
+	worker_job_cb_t cb;
+	void *data;
+	int sync;
+	int done;
+	cond_t done_cond; // only used by worker_call()
+	struct worker_job *next;
+};
+
+struct worker {
+	int index;
+	THREAD_T thread;
+	struct evloop *loop;
+	struct timer_queue timers;
+	mutex_t mutex;
+	struct worker_job *jobs_head;
+	struct worker_job *jobs_tail;
+	int quit;
+};
+
+static struct worker *workers = NULL;
+static int worker_count = 0;
+
+// worker of the calling thread, NULL outside of worker threads
+static __thread struct worker *current_worker = NULL;
+
+static void worker_run_jobs(struct worker *worker)
+{
+	struct worker_job *job;
+
+	mutex_lock(&worker->mutex);
+	while ((job = worker->jobs_head) != NULL) {
+		worker->jobs_head = job->next;
+		if (!worker->jobs_head)
+			worker->jobs_tail = NULL;
+		mutex_unlock(&worker->mutex);
+
+		job->cb(job->data);
+
+		mutex_lock(&worker->mutex);
+		if (job->sync) {
+			job->done = 1;
+			cond_signal(&job->done_cond);
+		} else {
+			free(job);
+		}
+	}
+	mutex_unlock(&worker->mutex);
+}
+
+static void *worker_thread(void *data)
+{
+	struct worker *worker = data;
+	struct evloop_event *events = NULL;
+	int cnt, i, to, quit;
+
+	current_worker = worker;
+	usbmuxd_log(LL_DEBUG, "Worker %d started", worker->index);
+
+	while (1) {
+		mutex_lock(&worker->mutex);
+		quit = worker->quit && !worker->jobs_head;
+		to = worker->jobs_head ? 0 : WORKER_IDLE_TIMEOUT;
+		mutex_unlock(&worker->mutex);
+		if (quit)
+			break;
+
+		to = timer_queue_get_timeout(&worker->timers, mstime64(), to);
+		cnt = evloop_wait(worker->loop, to, NULL, &events);
+		if (cnt < 0 && errno != EINTR) {
+			usbmuxd_log(LL_ERROR, "Worker %d: waiting for events failed: %s", worker->index, strerror(errno));
+		}
+		for (i = 0; i < cnt; i++) {
+			// events of fds removed while dispatching are cleared
+			if (!events[i].revents)
+				continue;
+			if (events[i].owner == FD_CLIENT) {
+				client_process(events[i].data, events[i].revents);
+			}
+		}
+
+		worker_run_jobs(worker);
+		timer_queue_run(&worker->timers, mstime64());
+	}
+
+	usbmuxd_log(LL_DEBUG, "Worker %d stopped", worker->index);
+	return NULL;
+}
+
+/**
+ * Start the worker threads. The number of workers is taken from the
+ * USBMUXD_WORKER_THREADS environment variable.
+ *
+ * @return The number of workers started, 0 if disabled or -1 on error.
+ */
+int worker_init(void)
+{
+	const char *env_threads = getenv(ENV_WORKER_THREADS);
+	int count = 0;
+	int i;
+
+	if (env_threads) {
+		count = atoi(env_threads);
+		if (count < 0) {
+			count = 0;
+		} else if (count > WORKER_THREADS_MAX) {
+			usbmuxd_log(LL_WARNING, "Limiting number of worker threads to %d", WORKER_THREADS_MAX);
+			count = WORKER_THREADS_MAX;
+		}
+	}
+	if (count == 0)
+		return 0;
+
+	workers = calloc(count, sizeof(struct worker));
+	if (!workers) {
+		usbmuxd_log(LL_FATAL, "%s: Failed to allocate workers.", __func__);
+		return -1;
+	}
+	for (i = 0; i < count; i++) {
+		struct worker *worker = &workers[i];
+		worker->index = i;
+		worker->loop = evloop_new();
+		if (!worker->loop)
+			break;
+		timer_queue_init(&worker->timers);
+		mutex_init(&worker->mutex);
+		if (thread_new(&worker->thread, worker_thread, worker) != 0) {
+			usbmuxd_log(LL_FATAL, "Could not start worker thread %d", i);
+			mutex_destroy(&worker->mutex);
+			evloop_free(worker->loop);
+			break;
+		}
+		worker_count++;
+	}
+	if (worker_count < count) {
+		worker_shutdown();
+		return -1;
+	}
+
+	usbmuxd_log(LL_INFO, "Started %d worker thread%s", worker_count, (worker_count == 1) ? "" : "s");
+	return worker_count;
+}
+
+/**
+ * Stop all worker threads. Jobs that are still queued are run before a
+ * worker exits.
+ */
+void worker_shutdown(void)
+{
+	int i;
+
+	for (i = 0; i < worker_count; i++) {
+		mutex_lock(&workers[i].mutex);
+		workers[i].quit = 1;
+		mutex_unlock(&workers[i].mutex);
+		evloop_wakeup(workers[i].loop);
+	}
+	for (i = 0; i < worker_count; i++) {
+		struct worker *worker = &workers[i];
+		thread_join(worker->thread);
+		thread_free(worker->thread);
+		timer_queue_free(&worker->timers);
+		evloop_free(worker->loop);
+		mutex_destroy(&worker->mutex);
+	}
+	free(workers);
+	workers = NULL;
+	worker_count = 0;
+}
+
+int worker_get_count(void)
+{
+	return worker_count;
+}
+
+/**
+ * Get the worker responsible for the given index, e.g. a device id.
+ *
+ * @param index Any number; workers are assigned round robin.
+ * @return The worker, or NULL if worker threads are disabled.
+ */
+struct worker *worker_get(unsigned int index)
+{
+	if (worker_count == 0)
+		return NULL;
+	return &workers[index % worker_count];
+}
+
+/**
+ * @return The worker the calling thread belongs to, or NULL when called
+ *   from any other thread.
+ */
+struct worker *worker_get_current(void)
+{
+	return current_worker;
+}
+
+struct evloop *worker_get_evloop(struct worker *worker)
+{
+	return worker->loop;
+}
+
+struct timer_queue *worker_get_timers(struct worker *worker)
+{
+	return &worker->timers;
+}
+
+static void worker_enqueue(struct worker *worker, struct worker_job *job)
+{
+	job->next = NULL;
+	if (worker->jobs_tail)
+		worker->jobs_tail->next = job;
+	else
+		worker->jobs_head = job;
+	worker->jobs_tail = job;
+}
+
+/**
+ * Queue a function to be run on a worker thread and return immediately.
+ * Jobs posted to the same worker run in the order they were posted.
+ *
+ * @param worker The worker to run the job on.
+ * @param cb The function to run.
+ * @param data Argument passed to cb.
+ * @return 0 on success, -1 on error.
+ */
+int worker_post(struct worker *worker, worker_job_cb_t cb, void *data)
+{
+	struct worker_job *job = malloc(sizeof(struct worker_job));
+	if (!job) {
+		usbmuxd_log(LL_ERROR, "%s: Failed to allocate job.", __func__);
+		return -1;
+	}
+	job->cb = cb;
+	job->data = data;
+	job->sync = 0;
+	job->done = 0;
+
+	mutex_lock(&worker->mutex);
+	worker_enqueue(worker, job);
+	mutex_unlock(&worker->mutex);
+	evloop_wakeup(worker->loop);
+	return 0;
+}
+
+/**
+ * Run a function on a worker thread and wait for it to complete. When
+ * called from the worker thread itself the function is run directly.
+ *
+ * @param worker The worker to run the job on.
+ * @param cb The function to run.
+ * @param data Argument passed to cb.
+ */
+void worker_call(struct worker *worker, worker_job_cb_t cb, void *data)
+{
+	struct worker_job job;
+
+	if (worker_get_current() == worker) {
+		cb(data);
+		return;
+	}
+
+	job.cb = cb;
+	job.data = data;
+	job.sync = 1;
+	job.done = 0;
+	cond_init(&job.done_cond);
+
+	mutex_lock(&worker->mutex);
+	worker_enqueue(worker, &job);
+	evloop_wakeup(worker->loop);
+	while (!job.done) {
+		cond_wait(&job.done_cond, &worker->mutex);
+	}
+	mutex_unlock(&worker->mutex);
+	cond_destroy(&job.done_cond);
+}
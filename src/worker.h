@@ -0,0 +1,46 @@
+/*
+ * worker.h
+ *
+ * Copyright (C) 2026 usbmuxd contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef WORKER_H
+#define WORKER_H
+
+// number of data plane worker threads, 0 (default) processes everything on the main thread
+#define ENV_WORKER_THREADS "USBMUXD_WORKER_THREADS"
+
+#define WORKER_THREADS_MAX 64
+
+struct worker;
+struct evloop;
+struct timer_queue;
+
+typedef void (*worker_job_cb_t)(void *data);
+
+int worker_init(void);
+void worker_shutdown(void);
+int worker_get_count(void);
+
+struct worker *worker_get(unsigned int index);
+struct worker *worker_get_current(void);
+struct evloop *worker_get_evloop(struct worker *worker);
+struct timer_queue *worker_get_timers(struct worker *worker);
+
+int worker_post(struct worker *worker, worker_job_cb_t cb, void *data);
+void worker_call(struct worker *worker, worker_job_cb_t cb, void *data);
+
+#endif
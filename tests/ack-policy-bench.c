@@ -0,0 +1,470 @@
+/*
+ * ack-policy-bench.c
+ * Measures the throughput of a download from a device, and the ACKs sent
+ * for it, under each ACK policy, against a simulated USB backend.
+ *
+ * Copyright (C) 2026 usbmuxd contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "usb.h"
+#include "device.h"
+#include "client.h"
+#include "preflight.h"
+#include "worker.h"
+#include "conf.h"
+#include "evloop.h"
+#include "utils.h"
+#include "log.h"
+#include "fake-libusb.h"
+
+#define DEFAULT_MIB 32
+
+// per round, a download that did not finish by then counts as a failure
+#define ROUND_TIMEOUT_MS 30000
+
+// largest TCP payload the simulated device puts in one packet
+#define SEGMENT_SIZE 16384
+
+#define DEVICE_PORT 62078
+
+#define MUX_PROTO_VERSION 0
+#define MUX_PROTO_SETUP 2
+#define MUX_PROTO_TCP IPPROTO_TCP
+
+#define MUX_HEADER_V1 8
+#define MUX_HEADER_V2 16
+
+/*
+ * usbmuxd runs on the main thread, as without worker threads, with its
+ * USB and mux layers unmodified. The client is replaced by the functions
+ * below and reads everything right away, so the USB link is all that
+ * limits the download. The simulated device completes the version and
+ * TCP handshakes and then sends as much as the advertised window allows,
+ * either one packet per USB transfer ("split"), or packets back to back
+ * filling each transfer ("packed"). An ACK-only packet is a TCP packet
+ * with just the ACK flag and no payload, each costing a bulk OUT transfer.
+ */
+static const char *policies[] = { "immediate", "delayed" };
+
+struct sim_device {
+	int packed; // several packets per IN transfer
+	int version_done;
+	uint16_t mux_seq;
+	// control packets waiting to be sent, ahead of any data
+	unsigned char ctl[128];
+	int ctl_len;
+	// the data packet being sent
+	unsigned char pkt[MUX_HEADER_V2 + sizeof(struct tcphdr) + SEGMENT_SIZE];
+	int pkt_len;
+	int pkt_off;
+	// the connection
+	int state; // 0 closed, 1 SYN received, 2 established
+	uint16_t host_port;
+	uint32_t snd_nxt;
+	uint32_t snd_una;
+	uint32_t snd_wnd;
+	uint32_t rcv_nxt;
+	uint64_t to_send;
+	// counters
+	uint64_t out_transfers;
+	uint64_t ack_only;
+};
+
+struct mux_client {
+	struct mux_connection *conn;
+	int connected;
+	int closed;
+	uint64_t received;
+};
+
+static struct sim_device sim;
+static struct mux_client client;
+static int device_id;
+static uint64_t download_size;
+static uint64_t start_time;
+static uint64_t end_time;
+
+static uint64_t ustime(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sim_queue_control(const void *data, int length)
+{
+	if (sim.ctl_len + length > (int)sizeof(sim.ctl))
+		return;
+	memcpy(sim.ctl + sim.ctl_len, data, length);
+	sim.ctl_len += length;
+}
+
+static int sim_mux_header(unsigned char *buf, uint32_t proto, uint32_t length)
+{
+	uint32_t *words = (uint32_t *)buf;
+	uint16_t *seqs = (uint16_t *)(buf + 12);
+
+	words[0] = htonl(proto);
+	words[1] = htonl(length);
+	words[2] = htonl(0xfeedface);
+	seqs[0] = htons(sim.mux_seq++);
+	seqs[1] = htons(0xffff);
+	return MUX_HEADER_V2;
+}
+
+static void sim_tcp_header(struct tcphdr *th, uint8_t flags, uint32_t seq)
+{
+	memset(th, 0, sizeof(*th));
+	th->th_sport = htons(DEVICE_PORT);
+	th->th_dport = htons(sim.host_port);
+	th->th_seq = htonl(seq);
+	th->th_ack = htonl(sim.rcv_nxt);
+	th->th_off = sizeof(struct tcphdr) / 4;
+	th->th_flags = flags;
+	th->th_win = htons(0x1000);
+}
+
+static void sim_tcp_input(const unsigned char *data, int length)
+{
+	const struct tcphdr *th = (const struct tcphdr *)data;
+	unsigned char buf[MUX_HEADER_V2 + sizeof(struct tcphdr)];
+	int payload = length - (int)sizeof(struct tcphdr);
+	int hdr;
+
+	if (payload < 0)
+		return;
+	if (th->th_flags & TH_RST) {
+		sim.state = 0;
+		return;
+	}
+	if (th->th_flags & TH_SYN) {
+		sim.host_port = ntohs(th->th_sport);
+		sim.rcv_nxt = ntohl(th->th_seq) + 1;
+		sim.snd_nxt = sim.snd_una = 1;
+		sim.snd_wnd = ntohs(th->th_win) << 8;
+		sim.state = 1;
+		hdr = sim_mux_header(buf, MUX_PROTO_TCP, sizeof(buf));
+		sim_tcp_header((struct tcphdr *)(buf + hdr), TH_SYN | TH_ACK, 0);
+		sim_queue_control(buf, sizeof(buf));
+		return;
+	}
+	if (!(th->th_flags & TH_ACK) || !sim.state)
+		return;
+	if (sim.state == 2 && th->th_flags == TH_ACK && payload == 0)
+		sim.ack_only++;
+	sim.state = 2;
+	if ((int32_t)(ntohl(th->th_ack) - sim.snd_una) > 0)
+		sim.snd_una = ntohl(th->th_ack);
+	sim.snd_wnd = ntohs(th->th_win) << 8;
+	sim.rcv_nxt += payload;
+}
+
+static void sim_receive(int device, const unsigned char *data, int length)
+{
+	uint32_t proto;
+	int hdr = sim.version_done ? MUX_HEADER_V2 : MUX_HEADER_V1;
+
+	// ZLPs end transfers of a multiple of the packet size
+	if (length == 0)
+		return;
+	sim.out_transfers++;
+	if (length < hdr)
+		return;
+	proto = ntohl(*(const uint32_t *)data);
+	if (proto == MUX_PROTO_VERSION) {
+		uint32_t reply[5] = { htonl(MUX_PROTO_VERSION), htonl(sizeof(reply)), htonl(2), htonl(0), 0 };
+		sim_queue_control(reply, sizeof(reply));
+		sim.version_done = 1;
+	} else if (proto == MUX_PROTO_TCP) {
+		sim_tcp_input(data + hdr, length - hdr);
+	}
+}
+
+// start the next data packet if the window allows it
+static int sim_next_packet(void)
+{
+	uint32_t in_flight = sim.snd_nxt - sim.snd_una;
+	uint32_t seg = SEGMENT_SIZE;
+	int hdr;
+
+	if (sim.state != 2 || !sim.to_send || in_flight >= sim.snd_wnd)
+		return 0;
+	if (seg > sim.snd_wnd - in_flight)
+		seg = sim.snd_wnd - in_flight;
+	if (seg > sim.to_send)
+		seg = sim.to_send;
+	sim.pkt_len = MUX_HEADER_V2 + sizeof(struct tcphdr) + seg;
+	sim.pkt_off = 0;
+	hdr = sim_mux_header(sim.pkt, MUX_PROTO_TCP, sim.pkt_len);
+	sim_tcp_header((struct tcphdr *)(sim.pkt + hdr), TH_ACK, sim.snd_nxt);
+	memset(sim.pkt + hdr + sizeof(struct tcphdr), 0x55, seg);
+	sim.snd_nxt += seg;
+	sim.to_send -= seg;
+	return 1;
+}
+
+static int sim_send(int device, unsigned char *buffer, int length)
+{
+	int len = 0;
+
+	if (sim.ctl_len) {
+		// control packets are small, each goes in a transfer of its own
+		memcpy(buffer, sim.ctl, sim.ctl_len);
+		len = sim.ctl_len;
+		sim.ctl_len = 0;
+		return len;
+	}
+	while (len < length) {
+		int chunk;
+		if (sim.pkt_off == sim.pkt_len) {
+			// without packing, a transfer ends with its packet
+			if ((len && !sim.packed) || !sim_next_packet())
+				break;
+		}
+		chunk = sim.pkt_len - sim.pkt_off;
+		if (chunk > length - len)
+			chunk = length - len;
+		memcpy(buffer + len, sim.pkt + sim.pkt_off, chunk);
+		sim.pkt_off += chunk;
+		len += chunk;
+		if (!sim.packed && sim.pkt_off == sim.pkt_len)
+			break;
+	}
+	return len;
+}
+
+static const struct fake_usb_device_ops sim_ops = { sim_receive, sim_send };
+
+int client_read(struct mux_client *mc, void *buffer, uint32_t len)
+{
+	return 0;
+}
+
+int client_write(struct mux_client *mc, void *buffer, uint32_t len)
+{
+	mc->received += len;
+	if (mc->received >= download_size && !end_time)
+		end_time = ustime();
+	return len;
+}
+
+int client_writev(struct mux_client *mc, const struct iovec *iov, int iovcnt)
+{
+	int i, len = 0;
+	for (i = 0; i < iovcnt; i++) {
+		len += client_write(mc, iov[i].iov_base, iov[i].iov_len);
+	}
+	return len;
+}
+
+int client_is_connected(struct mux_client *mc)
+{
+	return mc->connected;
+}
+
+uint32_t client_get_queued(struct mux_client *mc)
+{
+	return 0;
+}
+
+int client_set_events(struct mux_client *mc, short events)
+{
+	return 0;
+}
+
+void client_close(struct mux_client *mc)
+{
+	mc->connected = 0;
+	mc->closed = 1;
+}
+
+void client_linger(struct mux_client *mc, struct ringbuf *data, struct timer_queue *timers, int timeout)
+{
+	client_close(mc);
+}
+
+int client_notify_connect(struct mux_client *mc, enum usbmuxd_result result)
+{
+	if (result != RESULT_OK) {
+		mc->closed = 1;
+		return 0;
+	}
+	mc->connected = 1;
+	start_time = ustime();
+	return 0;
+}
+
+void client_set_connection(struct mux_client *mc, struct mux_connection *conn)
+{
+	mc->conn = conn;
+}
+
+void client_device_remove(int id)
+{
+}
+
+void client_detach_worker(struct worker *worker)
+{
+}
+
+void preflight_worker_device_add(struct device_info *info)
+{
+	device_id = info->id;
+}
+
+void preflight_device_remove_cb(void *data)
+{
+}
+
+int worker_get_count(void)
+{
+	return 0;
+}
+
+struct worker *worker_get(unsigned int index)
+{
+	return NULL;
+}
+
+struct timer_queue *worker_get_timers(struct worker *worker)
+{
+	return NULL;
+}
+
+int worker_post(struct worker *worker, worker_job_cb_t cb, void *data)
+{
+	return -1;
+}
+
+void worker_call(struct worker *worker, worker_job_cb_t cb, void *data)
+{
+	cb(data);
+}
+
+plist_t config_get_usb_device_cache(void)
+{
+	return NULL;
+}
+
+int config_set_usb_device_cache(plist_t cache)
+{
+	return 0;
+}
+
+static int bench_download(const char *policy, int packed, const struct fake_usb_timing *timing, double *mbps)
+{
+	uint64_t deadline;
+	int connecting = 0;
+	int res = -1;
+
+	memset(&sim, 0, sizeof(sim));
+	sim.packed = packed;
+	sim.to_send = download_size;
+	memset(&client, 0, sizeof(client));
+	device_id = 0;
+	start_time = end_time = 0;
+
+	setenv(ENV_ACK_POLICY, policy, 1);
+	fake_usb_reset(1, timing, &sim_ops);
+	device_init();
+	if (usb_init() < 0) {
+		device_shutdown();
+		return -1;
+	}
+	deadline = ustime() + ROUND_TIMEOUT_MS * 1000;
+	while (!end_time && !client.closed && ustime() < deadline) {
+		if (device_id && !connecting) {
+			if (device_start_connect(device_id, DEVICE_PORT, &client) < 0)
+				break;
+			connecting = 1;
+		}
+		// device timers fire with a delay of up to this
+		if (usb_process_timeout(1) < 0)
+			break;
+		device_check_timeouts();
+	}
+	if (end_time) {
+		*mbps = (double)download_size / (end_time - start_time);
+		res = 0;
+	}
+	usb_shutdown();
+	device_shutdown();
+	return res;
+}
+
+int main(int argc, char **argv)
+{
+	static const char *framings[] = { "split", "packed" };
+	struct fake_usb_timing timing = { 1000, 20000, 50, 40 };
+	unsigned int p, f;
+	int mib = DEFAULT_MIB;
+	int failed = 0;
+
+	if (argc > 1)
+		mib = atoi(argv[1]);
+	if (argc > 2)
+		timing.bulk_us = atoi(argv[2]);
+	if (argc > 3)
+		timing.bulk_bytes_per_us = atoi(argv[3]);
+	if (argc > 4 || mib <= 0 || timing.bulk_us < 0 || timing.bulk_bytes_per_us < 0) {
+		fprintf(stderr, "Usage: %s [MiB [bulk_us [bulk_bytes_per_us]]]\n", argv[0]);
+		return 2;
+	}
+	download_size = (uint64_t)mib << 20;
+
+	// RX transfers as on kernels without the 16 KiB usbfs limit
+	setenv(ENV_RX_TRANSFER_SIZE, "65536", 1);
+	setenv(ENV_DEVICE_MEMORY, "0", 1);
+	// usb_init() reports the missing hotplug support as an error
+	log_level = LL_FATAL;
+	if (evloop_init() < 0) {
+		fprintf(stderr, "evloop_init failed\n");
+		return 1;
+	}
+
+	printf("%d MiB, %d byte segments, bulk %dus + %d bytes/us\n", mib, SEGMENT_SIZE, timing.bulk_us, timing.bulk_bytes_per_us);
+	printf("%10s %7s %10s %10s %10s %10s\n", "policy", "framing", "MB/s", "acks", "acks/MiB", "transfers");
+	for (f = 0; f < sizeof(framings) / sizeof(framings[0]); f++) {
+		for (p = 0; p < sizeof(policies) / sizeof(policies[0]); p++) {
+			double mbps = 0;
+			printf("%10s %7s", policies[p], framings[f]);
+			if (bench_download(policies[p], f, &timing, &mbps) == 0) {
+				printf(" %10.1f %10" PRIu64 " %10.1f %10" PRIu64 "\n", mbps, sim.ack_only,
+					(double)sim.ack_only / mib, sim.out_transfers);
+			} else {
+				printf(" %10s (%" PRIu64 " of %" PRIu64 " bytes)\n", "failed", client.received, download_size);
+				failed = 1;
+			}
+			fflush(stdout);
+		}
+	}
+
+	evloop_shutdown();
+	return failed;
+}
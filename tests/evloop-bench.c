@@ -0,0 +1,240 @@
+/*
+ * evloop-bench.c
+ * Measures the cost of an event loop iteration against the number of
+ * registered, idle sockets.
+ *
+ * Copyright (C) 2026 usbmuxd contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#define _GNU_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+#include "evloop.h"
+#include "utils.h"
+#include "log.h"
+
+#define DEFAULT_ITERATIONS 20000
+
+/*
+ * Each iteration makes one socket readable, waits for it and reads the
+ * byte again, while all other registered sockets stay idle. "rebuild"
+ * is what main_loop() did before the event loop: refill a pollfd list
+ * with every fd and ppoll() it.
+ */
+static const int idle_counts[] = { 0, 16, 128, 512, 2048 };
+
+static uint64_t nstime(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void close_pairs(int *fds, int count)
+{
+	int i;
+	for (i = 0; i < count; i++) {
+		close(fds[i]);
+	}
+}
+
+static int open_pairs(int *fds, int pairs)
+{
+	int i;
+	for (i = 0; i < pairs; i++) {
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds + 2 * i) < 0) {
+			fprintf(stderr, "socketpair: %s\n", strerror(errno));
+			close_pairs(fds, 2 * i);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int bench_evloop(const char *backend, int idle, int iterations, double *ns)
+{
+	struct evloop_event *events;
+	int *fds;
+	int active;
+	int i, res = -1;
+	uint64_t start;
+
+	setenv(ENV_EVENT_BACKEND, backend, 1);
+	if (evloop_init() < 0)
+		return -1;
+	if (strcmp(evloop_get_backend_name(), backend) != 0) {
+		// not available on this platform
+		evloop_shutdown();
+		return 1;
+	}
+
+	fds = malloc(sizeof(int) * 2 * (idle + 1));
+	if (!fds || open_pairs(fds, idle + 1) < 0) {
+		free(fds);
+		evloop_shutdown();
+		return -1;
+	}
+	for (i = 0; i <= idle; i++) {
+		evloop_add(main_evloop, fds[2 * i], FD_CLIENT, POLLIN, NULL);
+	}
+	active = 2 * idle;
+
+	start = nstime();
+	for (i = 0; i < iterations; i++) {
+		char c = 0;
+		int cnt;
+		if (write(fds[active + 1], &c, 1) != 1)
+			break;
+		cnt = evloop_wait(main_evloop, 1000, NULL, &events);
+		if (cnt != 1 || events[0].fd != fds[active] || !(events[0].revents & POLLIN)) {
+			fprintf(stderr, "%s: unexpected events (%d)\n", backend, cnt);
+			break;
+		}
+		if (read(fds[active], &c, 1) != 1)
+			break;
+	}
+	if (i == iterations) {
+		*ns = (double)(nstime() - start) / iterations;
+		res = 0;
+	}
+
+	for (i = 0; i <= idle; i++) {
+		evloop_remove(main_evloop, fds[2 * i]);
+	}
+	close_pairs(fds, 2 * (idle + 1));
+	free(fds);
+	evloop_shutdown();
+	return res;
+}
+
+static int bench_rebuild(int idle, int iterations, double *ns)
+{
+	struct fdlist list;
+	struct timespec tspec = { 1, 0 };
+	int *fds;
+	int active;
+	int i, j, res = -1;
+	uint64_t start;
+
+	fds = malloc(sizeof(int) * 2 * (idle + 1));
+	if (!fds || open_pairs(fds, idle + 1) < 0) {
+		free(fds);
+		return -1;
+	}
+	active = 2 * idle;
+	fdlist_create(&list);
+
+	start = nstime();
+	for (i = 0; i < iterations; i++) {
+		char c = 0;
+		int found = 0;
+		if (write(fds[active + 1], &c, 1) != 1)
+			break;
+		fdlist_reset(&list);
+		for (j = 0; j <= idle; j++) {
+			fdlist_add(&list, FD_CLIENT, fds[2 * j], POLLIN);
+		}
+		if (ppoll(list.fds, list.count, &tspec, NULL) != 1)
+			break;
+		for (j = 0; j < list.count; j++) {
+			if (list.fds[j].revents & POLLIN)
+				found = (list.fds[j].fd == fds[active]);
+		}
+		if (!found || read(fds[active], &c, 1) != 1)
+			break;
+	}
+	if (i == iterations) {
+		*ns = (double)(nstime() - start) / iterations;
+		res = 0;
+	}
+
+	fdlist_free(&list);
+	close_pairs(fds, 2 * (idle + 1));
+	free(fds);
+	return res;
+}
+
+int main(int argc, char **argv)
+{
+	static const char *backends[] = { "epoll", "ppoll" };
+	struct rlimit rl;
+	int iterations = DEFAULT_ITERATIONS;
+	unsigned int i, b;
+	int failed = 0;
+
+	if (argc > 1)
+		iterations = atoi(argv[1]);
+	if (iterations <= 0) {
+		fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+		return 2;
+	}
+
+	// two fds per socket pair
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+	log_level = LL_ERROR;
+
+	printf("%8s %10s %10s %10s\n", "idle", "epoll", "ppoll", "rebuild");
+	for (i = 0; i < sizeof(idle_counts) / sizeof(idle_counts[0]); i++) {
+		int idle = idle_counts[i];
+		if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY && (rlim_t)(2 * idle + 16) > rl.rlim_cur) {
+			printf("%8d (skipped, open file limit is %lu)\n", idle, (unsigned long)rl.rlim_cur);
+			continue;
+		}
+		printf("%8d", idle);
+		for (b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+			double ns = 0;
+			int res = bench_evloop(backends[b], idle, iterations, &ns);
+			if (res == 0) {
+				printf(" %8.0fns", ns);
+			} else if (res > 0) {
+				printf(" %10s", "n/a");
+			} else {
+				printf(" %10s", "failed");
+				failed = 1;
+			}
+		}
+		{
+			double ns = 0;
+			if (bench_rebuild(idle, iterations, &ns) == 0) {
+				printf(" %8.0fns", ns);
+			} else {
+				printf(" %10s", "failed");
+				failed = 1;
+			}
+		}
+		printf("\n");
+		fflush(stdout);
+	}
+
+	return failed;
+}
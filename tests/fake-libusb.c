@@ -0,0 +1,769 @@
+/*
+ * fake-libusb.c
+ * Simulated USB backend implementing the parts of the libusb API usbmuxd uses
+ *
+ * Copyright (C) 2026 usbmuxd contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// the parameter types of this one changed between libusb versions
+#define libusb_hotplug_register_callback fake_libusb_hotplug_register_callback_hidden
+#include <libusb.h>
+#undef libusb_hotplug_register_callback
+
+#include <libimobiledevice-glue/thread.h>
+
+#include "fake-libusb.h"
+
+/*
+ * All devices are iPhones in the initial mode: four configurations, the
+ * usbmux interface in the last one, and the kernel selected the first.
+ * Control requests of a device are handled one after the other, each
+ * taking control_us; libusb_set_configuration() blocks the caller and
+ * the control pipe for set_config_us. Bulk transfers of a device share
+ * its bus time in both directions, each taking bulk_us plus its length
+ * at bulk_bytes_per_us. Unless device operations are set, whatever is
+ * sent to the bulk OUT endpoint comes back on the bulk IN endpoint,
+ * which is enough for a request/response handshake.
+ */
+
+#define FAKE_VID 0x05ac
+#define FAKE_PID 0x12a8
+#define FAKE_BUS 1
+#define FAKE_EP_OUT 0x04
+#define FAKE_EP_IN 0x85
+#define FAKE_NUM_CONFIGS 4
+#define FAKE_SERIAL_INDEX 3
+
+#define APPLE_GET_MODE 0x45
+#define APPLE_SET_MODE 0x52
+
+struct fake_packet {
+	struct fake_packet *next;
+	int len;
+	unsigned char data[];
+};
+
+struct libusb_device {
+	uint8_t address;
+	int configuration;
+	uint64_t ctrl_free; // time the control pipe is idle again
+	uint64_t bulk_free; // time the bulk pipes are idle again
+	struct fake_packet *echo_head;
+	struct fake_packet *echo_tail;
+};
+
+struct libusb_device_handle {
+	struct libusb_device *dev;
+};
+
+// private part, allocated in front of each struct libusb_transfer
+struct fake_transfer {
+	struct fake_transfer *next;
+	uint64_t due; // completion time, 0 if waiting for data
+	int pending;
+	int cancelled;
+	enum libusb_transfer_status status;
+	int actual_length;
+};
+
+static struct libusb_device devices[FAKE_USB_MAX_DEVICES];
+static int device_count;
+static struct fake_usb_timing timing = { 1000, 20000, 500, 0 };
+static struct fake_usb_device_ops ops;
+
+static mutex_t fake_mutex;
+static cond_t fake_cond;
+static thread_once_t fake_once = THREAD_ONCE_INIT;
+// in submission order, transfers of a device complete in that order
+static struct fake_transfer *pending;
+static struct fake_transfer **pending_tail = &pending;
+static int interrupted;
+
+static const struct libusb_endpoint_descriptor mux_endpoints[] = {
+	{ .bLength = 7, .bDescriptorType = LIBUSB_DT_ENDPOINT, .bEndpointAddress = FAKE_EP_OUT, .bmAttributes = LIBUSB_TRANSFER_TYPE_BULK, .wMaxPacketSize = 512 },
+	{ .bLength = 7, .bDescriptorType = LIBUSB_DT_ENDPOINT, .bEndpointAddress = FAKE_EP_IN, .bmAttributes = LIBUSB_TRANSFER_TYPE_BULK, .wMaxPacketSize = 512 }
+};
+
+static const struct libusb_interface_descriptor ptp_altsetting = {
+	.bLength = 9, .bDescriptorType = LIBUSB_DT_INTERFACE, .bInterfaceNumber = 0,
+	.bInterfaceClass = 6, .bInterfaceSubClass = 1, .bInterfaceProtocol = 1
+};
+
+static const struct libusb_interface_descriptor mux_altsetting = {
+	.bLength = 9, .bDescriptorType = LIBUSB_DT_INTERFACE, .bInterfaceNumber = 1,
+	.bNumEndpoints = 2, .bInterfaceClass = 255, .bInterfaceSubClass = 254, .bInterfaceProtocol = 2,
+	.endpoint = mux_endpoints
+};
+
+static const struct libusb_interface plain_interfaces[] = {
+	{ .altsetting = &ptp_altsetting, .num_altsetting = 1 }
+};
+
+static const struct libusb_interface mux_interfaces[] = {
+	{ .altsetting = &ptp_altsetting, .num_altsetting = 1 },
+	{ .altsetting = &mux_altsetting, .num_altsetting = 1 }
+};
+
+static struct libusb_config_descriptor configs[FAKE_NUM_CONFIGS] = {
+	{ .bLength = 9, .bDescriptorType = LIBUSB_DT_CONFIG, .bNumInterfaces = 1, .bConfigurationValue = 1, .interface = plain_interfaces },
+	{ .bLength = 9, .bDescriptorType = LIBUSB_DT_CONFIG, .bNumInterfaces = 1, .bConfigurationValue = 2, .interface = plain_interfaces },
+	{ .bLength = 9, .bDescriptorType = LIBUSB_DT_CONFIG, .bNumInterfaces = 1, .bConfigurationValue = 3, .interface = plain_interfaces },
+	{ .bLength = 9, .bDescriptorType = LIBUSB_DT_CONFIG, .bNumInterfaces = 2, .bConfigurationValue = 4, .interface = mux_interfaces }
+};
+
+static const struct libusb_version version = { 1, 0, 0, 0, "", "simulated" };
+
+static void fake_init(void)
+{
+	mutex_init(&fake_mutex);
+	cond_init(&fake_cond);
+}
+
+static uint64_t fake_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static struct fake_transfer *fake_transfer(struct libusb_transfer *transfer)
+{
+	return (struct fake_transfer *)transfer - 1;
+}
+
+static struct libusb_transfer *fake_libusb_transfer(struct fake_transfer *ft)
+{
+	return (struct libusb_transfer *)(ft + 1);
+}
+
+static void free_echo(struct libusb_device *dev)
+{
+	while (dev->echo_head) {
+		struct fake_packet *pkt = dev->echo_head;
+		dev->echo_head = pkt->next;
+		free(pkt);
+	}
+	dev->echo_tail = NULL;
+}
+
+/**
+ * Replace the simulated devices by a new set, as after a reboot of the
+ * host. Must not be called while transfers are pending.
+ *
+ * @param count Number of devices, at most FAKE_USB_MAX_DEVICES.
+ * @param new_timing Latencies to simulate, or NULL to keep the current ones.
+ * @param device_ops Device side of the bulk pipes, or NULL to echo.
+ */
+void fake_usb_reset(int count, const struct fake_usb_timing *new_timing, const struct fake_usb_device_ops *device_ops)
+{
+	int i;
+
+	thread_once(&fake_once, fake_init);
+	mutex_lock(&fake_mutex);
+	for (i = 0; i < device_count; i++) {
+		free_echo(&devices[i]);
+	}
+	if (count > FAKE_USB_MAX_DEVICES)
+		count = FAKE_USB_MAX_DEVICES;
+	memset(devices, 0, sizeof(devices));
+	for (i = 0; i < count; i++) {
+		devices[i].address = i + 2;
+		devices[i].configuration = 1;
+	}
+	device_count = count;
+	if (new_timing)
+		timing = *new_timing;
+	if (device_ops)
+		ops = *device_ops;
+	else
+		memset(&ops, 0, sizeof(ops));
+	interrupted = 0;
+	mutex_unlock(&fake_mutex);
+}
+
+static int string_descriptor(struct libusb_device *dev, int index, unsigned char *data, int max)
+{
+	char serial[32];
+	int i, len;
+
+	if (index == 0) {
+		// supported languages: en-US
+		unsigned char langids[4] = { 4, LIBUSB_DT_STRING, 0x09, 0x04 };
+		len = (max < 4) ? max : 4;
+		memcpy(data, langids, len);
+		return len;
+	}
+	if (index != FAKE_SERIAL_INDEX)
+		return -1;
+	snprintf(serial, sizeof(serial), "00008101%016X", dev->address);
+	len = 2 + 2 * strlen(serial);
+	if (len > max)
+		len = max;
+	memset(data, 0, len);
+	data[0] = 2 + 2 * strlen(serial);
+	if (len > 1)
+		data[1] = LIBUSB_DT_STRING;
+	for (i = 2; i + 1 < len; i += 2) {
+		data[i] = serial[(i - 2) / 2];
+	}
+	return len;
+}
+
+// caller must hold fake_mutex
+static void control_request(struct libusb_device *dev, struct libusb_transfer *transfer)
+{
+	struct fake_transfer *ft = fake_transfer(transfer);
+	struct libusb_control_setup *setup = (struct libusb_control_setup *)transfer->buffer;
+	unsigned char *data = transfer->buffer + LIBUSB_CONTROL_SETUP_SIZE;
+	int max = transfer->length - LIBUSB_CONTROL_SETUP_SIZE;
+	int len = -1;
+
+	if ((setup->bmRequestType & 0x60) == LIBUSB_REQUEST_TYPE_VENDOR) {
+		if (setup->bRequest == APPLE_GET_MODE && max >= 4) {
+			// initial mode
+			data[0] = 3;
+			data[1] = 3;
+			data[2] = 3;
+			data[3] = 0;
+			len = 4;
+		} else if (setup->bRequest == APPLE_SET_MODE && max >= 1) {
+			data[0] = 0;
+			len = 1;
+		}
+	} else if (setup->bRequest == LIBUSB_REQUEST_GET_DESCRIPTOR && (setup->wValue >> 8) == LIBUSB_DT_STRING) {
+		len = string_descriptor(dev, setup->wValue & 0xff, data, max);
+	}
+
+	if (len < 0) {
+		ft->status = LIBUSB_TRANSFER_STALL;
+		ft->actual_length = 0;
+	} else {
+		ft->status = LIBUSB_TRANSFER_COMPLETED;
+		ft->actual_length = len;
+	}
+	if (dev->ctrl_free < ft->due)
+		dev->ctrl_free = ft->due;
+	ft->due = dev->ctrl_free + timing.control_us;
+	dev->ctrl_free = ft->due;
+}
+
+// caller must hold fake_mutex
+static uint64_t bulk_schedule(struct libusb_device *dev, uint64_t now, int length)
+{
+	if (dev->bulk_free < now)
+		dev->bulk_free = now;
+	dev->bulk_free += timing.bulk_us;
+	if (timing.bulk_bytes_per_us > 0)
+		dev->bulk_free += length / timing.bulk_bytes_per_us;
+	return dev->bulk_free;
+}
+
+int LIBUSB_CALL libusb_init(libusb_context **ctx)
+{
+	thread_once(&fake_once, fake_init);
+	if (ctx)
+		*ctx = NULL;
+	return LIBUSB_SUCCESS;
+}
+
+void LIBUSB_CALL libusb_exit(libusb_context *ctx)
+{
+}
+
+#if LIBUSB_API_VERSION >= 0x01000106
+int LIBUSB_CALL libusb_set_option(libusb_context *ctx, enum libusb_option option, ...)
+{
+	return LIBUSB_SUCCESS;
+}
+#else
+void LIBUSB_CALL libusb_set_debug(libusb_context *ctx, int level)
+{
+}
+#endif
+
+const struct libusb_version * LIBUSB_CALL libusb_get_version(void)
+{
+	return &version;
+}
+
+int LIBUSB_CALL libusb_has_capability(uint32_t capability)
+{
+	// no hotplug, devices are found by scanning
+	return 0;
+}
+
+const char * LIBUSB_CALL libusb_error_name(int errcode)
+{
+	switch (errcode) {
+		case LIBUSB_SUCCESS:
+			return "LIBUSB_SUCCESS";
+		case LIBUSB_ERROR_NOT_FOUND:
+			return "LIBUSB_ERROR_NOT_FOUND";
+		case LIBUSB_ERROR_NO_MEM:
+			return "LIBUSB_ERROR_NO_MEM";
+		case LIBUSB_ERROR_NOT_SUPPORTED:
+			return "LIBUSB_ERROR_NOT_SUPPORTED";
+		default:
+			return "LIBUSB_ERROR_OTHER";
+	}
+}
+
+ssize_t LIBUSB_CALL libusb_get_device_list(libusb_context *ctx, libusb_device ***list)
+{
+	int i;
+
+	mutex_lock(&fake_mutex);
+	*list = calloc(device_count + 1, sizeof(libusb_device *));
+	if (!*list) {
+		mutex_unlock(&fake_mutex);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+	for (i = 0; i < device_count; i++) {
+		(*list)[i] = &devices[i];
+	}
+	mutex_unlock(&fake_mutex);
+	return i;
+}
+
+void LIBUSB_CALL libusb_free_device_list(libusb_device **list, int unref_devices)
+{
+	free(list);
+}
+
+int LIBUSB_CALL libusb_get_device_descriptor(libusb_device *dev, struct libusb_device_descriptor *desc)
+{
+	memset(desc, 0, sizeof(*desc));
+	desc->bLength = LIBUSB_DT_DEVICE_SIZE;
+	desc->bDescriptorType = LIBUSB_DT_DEVICE;
+	desc->bcdUSB = 0x0200;
+	desc->bMaxPacketSize0 = 64;
+	desc->idVendor = FAKE_VID;
+	desc->idProduct = FAKE_PID;
+	desc->bcdDevice = 0x1500;
+	desc->iSerialNumber = FAKE_SERIAL_INDEX;
+	desc->bNumConfigurations = FAKE_NUM_CONFIGS;
+	return LIBUSB_SUCCESS;
+}
+
+int LIBUSB_CALL libusb_get_config_descriptor_by_value(libusb_device *dev, uint8_t bConfigurationValue, struct libusb_config_descriptor **config)
+{
+	if (bConfigurationValue < 1 || bConfigurationValue > FAKE_NUM_CONFIGS)
+		return LIBUSB_ERROR_NOT_FOUND;
+	*config = &configs[bConfigurationValue - 1];
+	return LIBUSB_SUCCESS;
+}
+
+int LIBUSB_CALL libusb_get_active_config_descriptor(libusb_device *dev, struct libusb_config_descriptor **config)
+{
+	int configuration;
+
+	mutex_lock(&fake_mutex);
+	configuration = dev->configuration;
+	mutex_unlock(&fake_mutex);
+	return libusb_get_config_descriptor_by_value(dev, configuration, config);
+}
+
+void LIBUSB_CALL libusb_free_config_descriptor(struct libusb_config_descriptor *config)
+{
+	// descriptors are static
+}
+
+uint8_t LIBUSB_CALL libusb_get_bus_number(libusb_device *dev)
+{
+	return FAKE_BUS;
+}
+
+uint8_t LIBUSB_CALL libusb_get_device_address(libusb_device *dev)
+{
+	return dev->address;
+}
+
+int LIBUSB_CALL libusb_get_port_numbers(libusb_device *dev, uint8_t *port_numbers, int port_numbers_len)
+{
+	// no sysfs entries to read the serial number from
+	return 0;
+}
+
+int LIBUSB_CALL libusb_get_device_speed(libusb_device *dev)
+{
+	return LIBUSB_SPEED_HIGH;
+}
+
+int LIBUSB_CALL libusb_get_max_packet_size(libusb_device *dev, unsigned char endpoint)
+{
+	return 512;
+}
+
+int LIBUSB_CALL libusb_open(libusb_device *dev, libusb_device_handle **dev_handle)
+{
+	*dev_handle = malloc(sizeof(struct libusb_device_handle));
+	if (!*dev_handle)
+		return LIBUSB_ERROR_NO_MEM;
+	(*dev_handle)->dev = dev;
+	return LIBUSB_SUCCESS;
+}
+
+void LIBUSB_CALL libusb_close(libusb_device_handle *dev_handle)
+{
+	free(dev_handle);
+}
+
+libusb_device * LIBUSB_CALL libusb_get_device(libusb_device_handle *dev_handle)
+{
+	return dev_handle->dev;
+}
+
+int LIBUSB_CALL libusb_get_configuration(libusb_device_handle *dev_handle, int *config)
+{
+	mutex_lock(&fake_mutex);
+	*config = dev_handle->dev->configuration;
+	mutex_unlock(&fake_mutex);
+	return LIBUSB_SUCCESS;
+}
+
+int LIBUSB_CALL libusb_set_configuration(libusb_device_handle *dev_handle, int configuration)
+{
+	struct libusb_device *dev = dev_handle->dev;
+	uint64_t now, done;
+
+	if (configuration < 1 || configuration > FAKE_NUM_CONFIGS)
+		return LIBUSB_ERROR_NOT_FOUND;
+	mutex_lock(&fake_mutex);
+	now = fake_now();
+	if (dev->ctrl_free < now)
+		dev->ctrl_free = now;
+	done = dev->ctrl_free + timing.set_config_us;
+	dev->ctrl_free = done;
+	mutex_unlock(&fake_mutex);
+
+	usleep(done - now);
+
+	mutex_lock(&fake_mutex);
+	dev->configuration = configuration;
+	mutex_unlock(&fake_mutex);
+	return LIBUSB_SUCCESS;
+}
+
+int LIBUSB_CALL libusb_claim_interface(libusb_device_handle *dev_handle, int interface_number)
+{
+	return LIBUSB_SUCCESS;
+}
+
+int LIBUSB_CALL libusb_release_interface(libusb_device_handle *dev_handle, int interface_number)
+{
+	return LIBUSB_SUCCESS;
+}
+
+int LIBUSB_CALL libusb_kernel_driver_active(libusb_device_handle *dev_handle, int interface_number)
+{
+	return 0;
+}
+
+int LIBUSB_CALL libusb_detach_kernel_driver(libusb_device_handle *dev_handle, int interface_number)
+{
+	return LIBUSB_ERROR_NOT_FOUND;
+}
+
+#if LIBUSB_API_VERSION >= 0x01000105
+unsigned char * LIBUSB_CALL libusb_dev_mem_alloc(libusb_device_handle *dev_handle, size_t length)
+{
+	// like a kernel without usbfs device memory
+	return NULL;
+}
+
+int LIBUSB_CALL libusb_dev_mem_free(libusb_device_handle *dev_handle, unsigned char *buffer, size_t length)
+{
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+#endif
+
+struct libusb_transfer * LIBUSB_CALL libusb_alloc_transfer(int iso_packets)
+{
+	struct fake_transfer *ft = calloc(1, sizeof(struct fake_transfer) + sizeof(struct libusb_transfer) + sizeof(struct libusb_iso_packet_descriptor) * iso_packets);
+	if (!ft)
+		return NULL;
+	fake_libusb_transfer(ft)->num_iso_packets = iso_packets;
+	return fake_libusb_transfer(ft);
+}
+
+void LIBUSB_CALL libusb_free_transfer(struct libusb_transfer *transfer)
+{
+	if (!transfer)
+		return;
+	if ((transfer->flags & LIBUSB_TRANSFER_FREE_BUFFER) && transfer->buffer)
+		free(transfer->buffer);
+	free(fake_transfer(transfer));
+}
+
+int LIBUSB_CALL libusb_submit_transfer(struct libusb_transfer *transfer)
+{
+	struct fake_transfer *ft = fake_transfer(transfer);
+	struct libusb_device *dev = transfer->dev_handle->dev;
+
+	mutex_lock(&fake_mutex);
+	if (ft->pending) {
+		mutex_unlock(&fake_mutex);
+		return LIBUSB_ERROR_BUSY;
+	}
+	ft->cancelled = 0;
+	ft->due = fake_now();
+	if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL) {
+		control_request(dev, transfer);
+	} else if (transfer->endpoint & LIBUSB_ENDPOINT_IN) {
+		// completes once the device has data
+		ft->due = 0;
+	} else {
+		ft->due = bulk_schedule(dev, ft->due, transfer->length);
+		ft->status = LIBUSB_TRANSFER_COMPLETED;
+		ft->actual_length = transfer->length;
+	}
+	ft->pending = 1;
+	ft->next = NULL;
+	*pending_tail = ft;
+	pending_tail = &ft->next;
+	cond_signal(&fake_cond);
+	mutex_unlock(&fake_mutex);
+	return LIBUSB_SUCCESS;
+}
+
+int LIBUSB_CALL libusb_cancel_transfer(struct libusb_transfer *transfer)
+{
+	struct fake_transfer *ft = fake_transfer(transfer);
+	int res = LIBUSB_ERROR_NOT_FOUND;
+
+	mutex_lock(&fake_mutex);
+	if (ft->pending && !ft->cancelled) {
+		ft->cancelled = 1;
+		cond_signal(&fake_cond);
+		res = LIBUSB_SUCCESS;
+	}
+	mutex_unlock(&fake_mutex);
+	return res;
+}
+
+// caller must hold fake_mutex
+static void bulk_output(struct libusb_device *dev, struct libusb_transfer *transfer)
+{
+	struct fake_packet *pkt;
+
+	if (ops.receive) {
+		ops.receive(dev - devices, transfer->buffer, transfer->length);
+		return;
+	}
+	if (transfer->length <= 0)
+		return;
+	// the device answers what it was sent
+	pkt = malloc(sizeof(struct fake_packet) + transfer->length);
+	if (!pkt)
+		return;
+	pkt->next = NULL;
+	pkt->len = transfer->length;
+	memcpy(pkt->data, transfer->buffer, transfer->length);
+	if (dev->echo_tail)
+		dev->echo_tail->next = pkt;
+	else
+		dev->echo_head = pkt;
+	dev->echo_tail = pkt;
+}
+
+// caller must hold fake_mutex
+static int bulk_input(struct libusb_device *dev, struct libusb_transfer *transfer)
+{
+	struct fake_packet *pkt;
+	int len;
+
+	if (ops.send)
+		return ops.send(dev - devices, transfer->buffer, transfer->length);
+	pkt = dev->echo_head;
+	if (!pkt)
+		return 0;
+	dev->echo_head = pkt->next;
+	if (!dev->echo_head)
+		dev->echo_tail = NULL;
+	len = (pkt->len < transfer->length) ? pkt->len : transfer->length;
+	memcpy(transfer->buffer, pkt->data, len);
+	free(pkt);
+	return len;
+}
+
+// caller must hold fake_mutex
+static int bulk_input_next(struct fake_transfer *ft)
+{
+	struct libusb_transfer *transfer = fake_libusb_transfer(ft);
+	struct fake_transfer *p;
+
+	// IN transfers of an endpoint take data in the order they were submitted
+	for (p = pending; p != ft; p = p->next) {
+		struct libusb_transfer *t = fake_libusb_transfer(p);
+		if (!p->due && !p->cancelled && t->dev_handle->dev == transfer->dev_handle->dev && t->endpoint == transfer->endpoint)
+			return 0;
+	}
+	return 1;
+}
+
+// caller must hold fake_mutex
+static int transfer_ready(struct fake_transfer *ft, uint64_t now)
+{
+	struct libusb_transfer *transfer = fake_libusb_transfer(ft);
+	struct libusb_device *dev = transfer->dev_handle->dev;
+
+	if (ft->cancelled) {
+		// a bulk IN transfer keeps what it received before the cancellation
+		ft->status = LIBUSB_TRANSFER_CANCELLED;
+		if (!ft->due || transfer->type != LIBUSB_TRANSFER_TYPE_BULK || !(transfer->endpoint & LIBUSB_ENDPOINT_IN))
+			ft->actual_length = 0;
+		return 1;
+	}
+	if (!ft->due) {
+		// a bulk IN transfer takes its bus time once the device has data
+		if (!bulk_input_next(ft))
+			return 0;
+		ft->actual_length = bulk_input(dev, transfer);
+		if (ft->actual_length <= 0)
+			return 0;
+		ft->status = LIBUSB_TRANSFER_COMPLETED;
+		ft->due = bulk_schedule(dev, now, ft->actual_length);
+	}
+	if (ft->due > now)
+		return 0;
+	if (transfer->type == LIBUSB_TRANSFER_TYPE_BULK && !(transfer->endpoint & LIBUSB_ENDPOINT_IN))
+		bulk_output(dev, transfer);
+	return 1;
+}
+
+int LIBUSB_CALL libusb_handle_events_timeout_completed(libusb_context *ctx, struct timeval *tv, int *completed)
+{
+	struct fake_transfer *done = NULL;
+	struct fake_transfer **done_tail = &done;
+	struct fake_transfer **p;
+	uint64_t deadline = fake_now() + (uint64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+
+	mutex_lock(&fake_mutex);
+	while (!done && !(completed && *completed)) {
+		uint64_t now = fake_now();
+		uint64_t wake = deadline;
+		int progress;
+
+		// bulk OUT completions feed bulk IN transfers, so repeat until nothing changes
+		do {
+			progress = 0;
+			p = &pending;
+			while (*p) {
+				struct fake_transfer *ft = *p;
+				if (transfer_ready(ft, now)) {
+					*p = ft->next;
+					if (!*p)
+						pending_tail = p;
+					ft->pending = 0;
+					ft->next = NULL;
+					*done_tail = ft;
+					done_tail = &ft->next;
+					progress = 1;
+				} else {
+					if (ft->due && ft->due < wake)
+						wake = ft->due;
+					p = &ft->next;
+				}
+			}
+		} while (progress);
+
+		if (done)
+			break;
+		if (interrupted) {
+			interrupted = 0;
+			break;
+		}
+		if (now >= deadline)
+			break;
+		cond_wait_timeout(&fake_cond, &fake_mutex, (wake - now + 999) / 1000);
+	}
+	mutex_unlock(&fake_mutex);
+
+	while (done) {
+		struct fake_transfer *next = done->next;
+		struct libusb_transfer *transfer = fake_libusb_transfer(done);
+		done->next = NULL;
+		transfer->status = done->status;
+		transfer->actual_length = done->actual_length;
+		transfer->callback(transfer);
+		if (transfer->flags & LIBUSB_TRANSFER_FREE_TRANSFER)
+			libusb_free_transfer(transfer);
+		done = next;
+	}
+	return LIBUSB_SUCCESS;
+}
+
+int LIBUSB_CALL libusb_handle_events_timeout(libusb_context *ctx, struct timeval *tv)
+{
+	return libusb_handle_events_timeout_completed(ctx, tv, NULL);
+}
+
+#if LIBUSB_API_VERSION >= 0x01000105
+void LIBUSB_CALL libusb_interrupt_event_handler(libusb_context *ctx)
+{
+	mutex_lock(&fake_mutex);
+	interrupted = 1;
+	cond_signal(&fake_cond);
+	mutex_unlock(&fake_mutex);
+}
+#endif
+
+int LIBUSB_CALL libusb_get_next_timeout(libusb_context *ctx, struct timeval *tv)
+{
+	// transfers are completed from libusb_handle_events_timeout() only
+	return 0;
+}
+
+const struct libusb_pollfd ** LIBUSB_CALL libusb_get_pollfds(libusb_context *ctx)
+{
+	// there is nothing to poll, events are handled in the calling thread
+	return calloc(1, sizeof(struct libusb_pollfd *));
+}
+
+#if LIBUSB_API_VERSION >= 0x01000104
+void LIBUSB_CALL libusb_free_pollfds(const struct libusb_pollfd **pollfds)
+{
+	free(pollfds);
+}
+#endif
+
+void LIBUSB_CALL libusb_set_pollfd_notifiers(libusb_context *ctx, libusb_pollfd_added_cb added_cb, libusb_pollfd_removed_cb removed_cb, void *user_data)
+{
+}
+
+#if LIBUSB_API_VERSION >= 0x01000102
+int LIBUSB_CALL libusb_hotplug_register_callback(libusb_context *ctx, int events, int flags, int vendor_id, int product_id, int dev_class, libusb_hotplug_callback_fn cb_fn, void *user_data, libusb_hotplug_callback_handle *callback_handle);
+
+int LIBUSB_CALL libusb_hotplug_register_callback(libusb_context *ctx, int events, int flags, int vendor_id, int product_id, int dev_class, libusb_hotplug_callback_fn cb_fn, void *user_data, libusb_hotplug_callback_handle *callback_handle)
+{
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+void LIBUSB_CALL libusb_hotplug_deregister_callback(libusb_context *ctx, libusb_hotplug_callback_handle callback_handle)
+{
+}
+#endif
@@ -0,0 +1,48 @@
+/*
+ * fake-libusb.h
+ * Simulated USB backend implementing the parts of the libusb API usbmuxd uses
+ *
+ * Copyright (C) 2026 usbmuxd contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef FAKE_LIBUSB_H
+#define FAKE_LIBUSB_H
+
+#define FAKE_USB_MAX_DEVICES 128
+
+// simulated latencies, in microseconds
+struct fake_usb_timing {
+	int control_us; // each control request, a device handles one at a time
+	int set_config_us; // libusb_set_configuration(), on the control pipe too
+	int bulk_us; // each bulk transfer, in either direction
+	int bulk_bytes_per_us; // bulk payload rate, 0 for unlimited
+};
+
+/*
+ * Device side of the bulk pipes. The callbacks run on the thread handling
+ * libusb events, with the simulated backend locked, and must not call
+ * into libusb.
+ */
+struct fake_usb_device_ops {
+	// a bulk OUT transfer to the device completed
+	void (*receive)(int device, const unsigned char *data, int length);
+	// fill a bulk IN transfer, returns its length, 0 if there is nothing to send yet
+	int (*send)(int device, unsigned char *buffer, int length);
+};
+
+void fake_usb_reset(int count, const struct fake_usb_timing *timing, const struct fake_usb_device_ops *ops);
+
+#endif
@@ -0,0 +1,252 @@
+/*
+ * usb-startup-bench.c
+ * Measures how long it takes until all devices attached at startup are
+ * visible, against a simulated USB backend.
+ *
+ * Copyright (C) 2026 usbmuxd contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "usb.h"
+#include "device.h"
+#include "worker.h"
+#include "conf.h"
+#include "evloop.h"
+#include "utils.h"
+#include "log.h"
+#include "fake-libusb.h"
+
+// per round, a device that is not visible by then counts as a failure
+#define ROUND_TIMEOUT_MS 10000
+
+#define HELLO_SIZE 16
+
+/*
+ * usb.c runs unmodified on the main thread, as without worker threads.
+ * The mux layer is replaced by the functions below: device_add() sends a
+ * request and the device counts as visible once the answer arrives,
+ * which stands in for the version handshake. Preflight is not simulated.
+ * "cold" starts without a device cache, "warm" with the one the cold
+ * round left behind.
+ */
+static const int device_counts[] = { 1, 16, 64 };
+
+static struct usb_device *devices[FAKE_USB_MAX_DEVICES];
+static int visible[FAKE_USB_MAX_DEVICES];
+static int visible_count;
+static uint64_t last_visible;
+static int stage_max[USB_INIT_STAGES];
+
+static plist_t stored_cache;
+
+static uint64_t ustime(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int device_index(struct usb_device *dev)
+{
+	int i;
+	for (i = 0; i < FAKE_USB_MAX_DEVICES; i++) {
+		if (devices[i] == dev)
+			return i;
+	}
+	return -1;
+}
+
+int device_add(struct usb_device *dev)
+{
+	unsigned char *hello;
+	int i = device_index(NULL);
+
+	if (i < 0)
+		return -1;
+	// usb_send() takes ownership of the buffer
+	hello = calloc(1, HELLO_SIZE);
+	if (!hello)
+		return -1;
+	devices[i] = dev;
+	visible[i] = 0;
+	if (usb_send(dev, hello, HELLO_SIZE) < 0) {
+		free(hello);
+		devices[i] = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+void device_remove(struct usb_device *dev)
+{
+	int i = device_index(dev);
+	if (i >= 0)
+		devices[i] = NULL;
+}
+
+void device_data_input(struct usb_device *dev, unsigned char *buf, uint32_t length)
+{
+	struct usb_stats stats;
+	int i = device_index(dev);
+	int j;
+
+	if (i < 0 || visible[i] || length != HELLO_SIZE)
+		return;
+	usb_set_init_stage(dev, USB_INIT_CONNECTED);
+	usb_set_init_stage(dev, USB_INIT_VISIBLE);
+	visible[i] = 1;
+	visible_count++;
+	last_visible = ustime();
+
+	usb_get_stats(dev, &stats);
+	for (j = 0; j < USB_INIT_STAGES; j++) {
+		if (stats.init_ms[j] > stage_max[j])
+			stage_max[j] = stats.init_ms[j];
+	}
+}
+
+void device_tx_resume(struct usb_device *dev)
+{
+}
+
+int worker_get_count(void)
+{
+	return 0;
+}
+
+int worker_post(struct worker *worker, worker_job_cb_t cb, void *data)
+{
+	return -1;
+}
+
+void worker_call(struct worker *worker, worker_job_cb_t cb, void *data)
+{
+	cb(data);
+}
+
+plist_t config_get_usb_device_cache(void)
+{
+	return stored_cache ? plist_copy(stored_cache) : NULL;
+}
+
+int config_set_usb_device_cache(plist_t cache)
+{
+	plist_free(stored_cache);
+	stored_cache = plist_copy(cache);
+	return 0;
+}
+
+static void print_stage(enum usb_init_stage stage)
+{
+	if (stage_max[stage] >= 0)
+		printf(" %6dms", stage_max[stage]);
+	else
+		printf(" %8s", "-");
+}
+
+static int bench_startup(int count, const struct fake_usb_timing *timing, double *ms)
+{
+	uint64_t start, deadline;
+	int i, res = -1;
+
+	memset(devices, 0, sizeof(devices));
+	visible_count = 0;
+	for (i = 0; i < USB_INIT_STAGES; i++) {
+		stage_max[i] = -1;
+	}
+	fake_usb_reset(count, timing, NULL);
+
+	start = ustime();
+	deadline = start + ROUND_TIMEOUT_MS * 1000;
+	if (usb_init() < 0)
+		return -1;
+	while (visible_count < count && ustime() < deadline) {
+		if (usb_process_timeout(10) < 0)
+			break;
+	}
+	if (visible_count == count) {
+		*ms = (double)(last_visible - start) / 1000;
+		res = 0;
+	}
+	usb_shutdown();
+	return res;
+}
+
+int main(int argc, char **argv)
+{
+	static const char *rounds[] = { "cold", "warm" };
+	struct fake_usb_timing timing = { 1000, 20000, 500, 0 };
+	unsigned int i, r;
+	int failed = 0;
+
+	if (argc > 1)
+		timing.control_us = atoi(argv[1]);
+	if (argc > 2)
+		timing.set_config_us = atoi(argv[2]);
+	if (argc > 3)
+		timing.bulk_us = atoi(argv[3]);
+	if (argc > 4 || timing.control_us < 0 || timing.set_config_us < 0 || timing.bulk_us < 0) {
+		fprintf(stderr, "Usage: %s [control_us [set_config_us [bulk_us]]]\n", argv[0]);
+		return 2;
+	}
+
+	// one small RX transfer per device is enough for the handshake
+	setenv(ENV_RX_TRANSFER_SIZE, "16384", 1);
+	setenv(ENV_DEVICE_MEMORY, "0", 1);
+	// usb_init() reports the missing hotplug support as an error
+	log_level = LL_FATAL;
+	if (evloop_init() < 0) {
+		fprintf(stderr, "evloop_init failed\n");
+		return 1;
+	}
+
+	printf("control %dus, set configuration %dus, bulk %dus\n", timing.control_us, timing.set_config_us, timing.bulk_us);
+	printf("%8s %6s %10s %8s %8s %8s %8s %8s\n", "devices", "cache", "total", "mode", "config", "serial", "started", "visible");
+	for (i = 0; i < sizeof(device_counts) / sizeof(device_counts[0]); i++) {
+		plist_free(stored_cache);
+		stored_cache = NULL;
+		for (r = 0; r < sizeof(rounds) / sizeof(rounds[0]); r++) {
+			double ms = 0;
+			printf("%8d %6s", device_counts[i], rounds[r]);
+			if (bench_startup(device_counts[i], &timing, &ms) == 0) {
+				printf(" %8.1fms", ms);
+				print_stage(USB_INIT_MODE);
+				print_stage(USB_INIT_CONFIGURED);
+				print_stage(USB_INIT_SERIAL);
+				print_stage(USB_INIT_STARTED);
+				print_stage(USB_INIT_VISIBLE);
+				printf("\n");
+			} else {
+				printf(" %10s (%d of %d visible)\n", "failed", visible_count, device_counts[i]);
+				failed = 1;
+			}
+			fflush(stdout);
+		}
+	}
+	plist_free(stored_cache);
+
+	evloop_shutdown();
+	return failed;
+}